@@ -0,0 +1,188 @@
+/**
+ * Pointer chasing benchmark for alloc_near() and allocation groups
+ *
+ * Fragments the heap, then builds the same linked list three ways while other allocations
+ * go on in between: with plain alloc(), with alloc_near() on the previous node, and from an
+ * allocation group. Each list is then walked repeatedly. Every variant runs in a process of
+ * its own, starting from the same fragmented heap.
+ *
+ * Usage: locality_bench [nodes] [walks]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../source/allocator.h"
+
+#define FRAG_BLOCKS     20000       // Blocks allocated (and half freed again) before the list is built
+#define PAGE_SIZE       4096
+
+struct node
+{
+    struct node*    next;
+    long            value;
+    char            payload[16];
+};
+
+typedef enum
+{
+    PLACE_ALLOC,
+    PLACE_NEAR,
+    PLACE_GROUP
+} placement_t;
+
+static const char* placement_names[] = {"alloc", "alloc_near", "alloc_group"};
+
+static size_t random_size()
+{
+    return 16 + (rand() % 16) * 16;
+}
+
+/**
+ * Leave holes of assorted sizes all over the heap
+ */
+static void fragment()
+{
+    static void* blocks[FRAG_BLOCKS];
+
+    for(size_t i = 0; i < FRAG_BLOCKS; i++)
+        blocks[i] = alloc(random_size());
+
+    for(size_t i = 0; i < FRAG_BLOCKS; i++)
+    {
+        size_t j = rand() % FRAG_BLOCKS;
+        if(blocks[j] != NULL)
+        {
+            dealloc(blocks[j]);
+            blocks[j] = NULL;
+        }
+    }
+}
+
+/**
+ * Build a list of 'count' nodes, with an unrelated allocation between every other node
+ */
+static struct node* build(placement_t placement, size_t count)
+{
+    alloc_group_t*  group = alloc_group_create(64 * 1024);
+    struct node*    head = NULL;
+    struct node*    tail = NULL;
+
+    for(size_t i = 0; i < count; i++)
+    {
+        struct node* node;
+
+        switch(placement)
+        {
+        case PLACE_NEAR:
+            node = alloc_near(tail, sizeof(struct node));
+            break;
+        case PLACE_GROUP:
+            node = alloc_in_group(group, sizeof(struct node));
+            break;
+        default:
+            node = alloc(sizeof(struct node));
+            break;
+        }
+
+        node->next = NULL;
+        node->value = i;
+        if(tail != NULL)
+            tail->next = node;
+        else
+            head = node;
+        tail = node;
+
+        if(rand() % 2)
+            alloc(random_size());
+    }
+
+    alloc_group_destroy(group);
+    return head;
+}
+
+static int compare_pages(const void* a, const void* b)
+{
+    uintptr_t x = *(const uintptr_t*)a;
+    uintptr_t y = *(const uintptr_t*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Count the pages the list touches, and the average distance from one node to the next
+ */
+static void layout(struct node* head, size_t count, size_t* pages, double* distance)
+{
+    uintptr_t*  page = malloc(count * sizeof(uintptr_t));
+    size_t      n = 0;
+    double      total = 0;
+
+    for(struct node* node = head; node != NULL; node = node->next)
+    {
+        page[n++] = (uintptr_t)node / PAGE_SIZE;
+        if(node->next != NULL)
+            total += (double)llabs((long long)((intptr_t)node->next - (intptr_t)node));
+    }
+
+    qsort(page, n, sizeof(uintptr_t), compare_pages);
+    *pages = (n > 0);
+    for(size_t i = 1; i < n; i++)
+        *pages += (page[i] != page[i - 1]);
+    *distance = (n > 1) ? total / (n - 1) : 0;
+
+    free(page);
+}
+
+static void run(placement_t placement, size_t count, int walks)
+{
+    struct timespec start, end;
+    size_t          pages;
+    double          distance;
+    long            sum = 0;
+
+    srand(1);
+    fragment();
+    struct node* head = build(placement, count);
+    layout(head, count, &pages, &distance);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int i = 0; i < walks; i++)
+        for(struct node* node = head; node != NULL; node = node->next)
+            sum += node->value;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double ns = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / ((double)walks * count);
+    printf("%-12s %8zu %14.0f %10.2f%s\n", placement_names[placement], pages, distance, ns,
+           (sum == 0) ? " (empty)" : "");
+}
+
+int main(int argc, char** argv)
+{
+    size_t  count = (argc > 1) ? strtoul(argv[1], NULL, 10) : 20000;
+    int     walks = (argc > 2) ? atoi(argv[2]) : 200;
+
+    printf("%-12s %8s %14s %10s\n", "placement", "pages", "avg distance", "ns/hop");
+    fflush(stdout);
+
+    for(placement_t p = PLACE_ALLOC; p <= PLACE_GROUP; p++)
+    {
+        pid_t pid = fork();
+        if(pid < 0)
+        {
+            perror("fork");
+            return 1;
+        }
+        if(pid == 0)
+        {
+            run(p, count, walks);
+            fflush(stdout);
+            _exit(0);
+        }
+        waitpid(pid, NULL, 0);
+    }
+
+    return 0;
+}
@@ -0,0 +1,452 @@
+/**
+ * Memory efficiency comparison against the system malloc
+ *
+ * Runs the same workloads (same sizes, same order, same seeds) on this allocator and on
+ * glibc malloc, each in a process of its own so neither sees the other's heap. While a
+ * workload runs, a sampler thread reads the resident set size from /proc/self/statm and
+ * the heap size from the allocator under test, and the workload keeps its own count of
+ * live (requested) bytes. One CSV row per run goes to stdout:
+ *
+ *      allocator,workload,ops,seconds,ops_per_sec,peak_rss_kb,peak_live_kb,peak_heap_kb,live_heap_ratio
+ *
+ * where live_heap_ratio is peak live bytes over peak heap bytes (1.0 means no overhead).
+ *
+ * Usage: mem_compare [-n names.txt] [-r rounds] [-t samples.csv] [allocator [workload]]
+ *
+ * With -t, every sample is also written to 'samples.csv' as
+ *
+ *      allocator,workload,ms,rss_kb,live_kb,heap_kb
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../source/allocator.h"
+
+#define SAMPLE_INTERVAL_US  1000        // Time between samples
+#define FRAG_ARRAY_SIZE     8000        // Same as STRUCT_ARRAY_SIZE in main.c
+#define NAMES_MAX           32768       // Names we'll read from the names file
+
+/**
+ * The allocator under test
+ */
+struct allocator
+{
+    const char* name;
+    void        (*init)();
+    void*       (*alloc)(size_t);
+    void        (*free)(void*);
+    size_t      (*heap_bytes)();
+};
+
+/**
+ * A workload. Returns the number of allocations and frees it made.
+ */
+struct workload
+{
+    const char* name;
+    size_t      (*run)(const struct allocator*, int rounds);
+};
+
+/**
+ * Sampled state, shared with the sampler thread
+ */
+struct samples
+{
+    const struct allocator* allocator;
+    const char*             workload;
+    FILE*                   out;            // Time series (NULL for none)
+    struct timespec         start;
+    size_t                  peak_rss;
+    size_t                  peak_live;      // Updated by the workload, not the sampler
+    size_t                  peak_heap;
+    bool                    stop;
+};
+
+static size_t           live_bytes = 0;     // Bytes the workload has allocated and not freed yet
+static struct samples   samples;
+static const char*      names_path = "names.txt";
+
+static void glibc_init()
+{
+}
+
+static size_t glibc_heap_bytes()
+{
+    struct mallinfo2 info = mallinfo2();
+    return info.arena + info.hblkhd;
+}
+
+static void mallocv2_init()
+{
+    allocator_init();
+}
+
+static const struct allocator allocators[] = {
+    {"mallocv2", mallocv2_init, alloc, dealloc, allocator_heap_bytes},
+    {"glibc", glibc_init, malloc, free, glibc_heap_bytes},
+};
+
+/**
+ * Allocate through the allocator under test, counting live bytes
+ */
+static inline void* bench_alloc(const struct allocator* a, size_t size)
+{
+    void* ptr = a->alloc(size);
+    if(ptr == NULL)
+    {
+        fprintf(stderr, "%s: out of memory allocating %zu bytes\n", a->name, size);
+        exit(1);
+    }
+
+    // Workloads are single threaded, so the peak can be tracked exactly here rather than sampled
+    size_t live = __atomic_add_fetch(&live_bytes, size, __ATOMIC_RELAXED);
+    if(live > samples.peak_live)
+        samples.peak_live = live;
+    return ptr;
+}
+
+static inline void bench_free(const struct allocator* a, void* ptr, size_t size)
+{
+    __atomic_sub_fetch(&live_bytes, size, __ATOMIC_RELAXED);
+    a->free(ptr);
+}
+
+/**
+ * The fragmentation phase from main.c: fill arrays of randomly sized structs, then free
+ * random slots, a round at a time. Unlike main.c, the survivors are freed at the end.
+ */
+static size_t workload_frag(const struct allocator* a, int rounds)
+{
+    static const size_t sizes[] = {41, 113, 512, 1024};     // medium, big, huge and insane structs
+    static void*        ptrs[4][FRAG_ARRAY_SIZE];
+    static size_t       counts[4];
+    size_t              ops = 0;
+
+    srand(1);
+    for(int round = 0; round < rounds; round++)
+    {
+        memset(counts, 0, sizeof(counts));
+        for(int j = 0; j < FRAG_ARRAY_SIZE; j++)
+        {
+            int t = rand() % 5 - 1;
+            if(t < 0)
+                continue;
+            ptrs[t][counts[t]++] = bench_alloc(a, sizes[t]);
+            ops++;
+        }
+
+        for(int j = 0; j < FRAG_ARRAY_SIZE; j++)
+        {
+            int t = rand() % 5 - 1;
+            if(t < 0 || counts[t] == 0)
+                continue;
+
+            size_t slot = rand() % counts[t];
+            if(ptrs[t][slot] != NULL)
+            {
+                bench_free(a, ptrs[t][slot], sizes[t]);
+                ptrs[t][slot] = NULL;
+                ops++;
+            }
+        }
+
+        for(int t = 0; t < 4; t++)
+        {
+            for(size_t j = 0; j < counts[t]; j++)
+            {
+                if(ptrs[t][j] != NULL)
+                {
+                    bench_free(a, ptrs[t][j], sizes[t]);
+                    ops++;
+                }
+            }
+        }
+    }
+
+    return ops;
+}
+
+/**
+ * String churn on the names file: copy every name, build "first last" pairs, grow the
+ * pairs by appending (reallocating by hand, the way a string class would), then free a
+ * random half and rebuild it.
+ */
+static size_t workload_names(const struct allocator* a, int rounds)
+{
+    static char*    names[NAMES_MAX];
+    static char*    pairs[NAMES_MAX];
+    static size_t   pair_len[NAMES_MAX];
+    size_t          num_names = 0;
+    size_t          ops = 0;
+    char            line[256];
+
+    FILE* f = fopen(names_path, "r");
+    if(f == NULL)
+    {
+        fprintf(stderr, "can't open %s: %s\n", names_path, strerror(errno));
+        exit(1);
+    }
+
+    srand(2);
+    while(num_names < NAMES_MAX && fgets(line, sizeof(line), f) != NULL)
+    {
+        size_t len = strcspn(line, "\r\n");
+        line[len] = '\0';
+        names[num_names] = memcpy(bench_alloc(a, len + 1), line, len + 1);
+        num_names++;
+        ops++;
+    }
+    fclose(f);
+
+    for(int round = 0; round < rounds; round++)
+    {
+        for(size_t i = 0; i < num_names; i++)
+        {
+            const char* other = names[rand() % num_names];
+            size_t      len = strlen(names[i]) + 1 + strlen(other) + 1;
+
+            pairs[i] = bench_alloc(a, len);
+            pair_len[i] = len;
+            snprintf(pairs[i], len, "%s %s", names[i], other);
+            ops++;
+        }
+
+        // Append a middle name to every pair, growing the string the naive way
+        for(size_t i = 0; i < num_names; i++)
+        {
+            const char* middle = names[rand() % num_names];
+            size_t      len = pair_len[i] + 1 + strlen(middle);
+            char*       grown = bench_alloc(a, len);
+
+            snprintf(grown, len, "%s %s", pairs[i], middle);
+            bench_free(a, pairs[i], pair_len[i]);
+            pairs[i] = grown;
+            pair_len[i] = len;
+            ops += 2;
+        }
+
+        for(size_t i = 0; i < num_names; i++)
+        {
+            if(rand() % 2)
+                continue;
+
+            bench_free(a, pairs[i], pair_len[i]);
+            pair_len[i] = strlen(names[i]) + 1;
+            pairs[i] = memcpy(bench_alloc(a, pair_len[i]), names[i], pair_len[i]);
+            ops += 2;
+        }
+
+        for(size_t i = 0; i < num_names; i++)
+        {
+            bench_free(a, pairs[i], pair_len[i]);
+            ops++;
+        }
+    }
+
+    for(size_t i = 0; i < num_names; i++)
+    {
+        bench_free(a, names[i], strlen(names[i]) + 1);
+        ops++;
+    }
+
+    return ops;
+}
+
+static const struct workload workloads[] = {
+    {"frag", workload_frag},
+    {"names", workload_names},
+};
+
+/**
+ * Resident set size in bytes, from /proc/self/statm (read without stdio, so the sampler
+ * never allocates)
+ */
+static size_t sample_rss()
+{
+    char    buf[128];
+    int     fd = open("/proc/self/statm", O_RDONLY);
+    ssize_t len;
+
+    if(fd < 0)
+        return 0;
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if(len <= 0)
+        return 0;
+    buf[len] = '\0';
+
+    // The second field is the resident page count
+    char* resident = strchr(buf, ' ');
+    if(resident == NULL)
+        return 0;
+    return strtoull(resident + 1, NULL, 10) * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static double elapsed_since(const struct timespec* start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void sample_once()
+{
+    size_t rss = sample_rss();
+    size_t live = __atomic_load_n(&live_bytes, __ATOMIC_RELAXED);
+    size_t heap = samples.allocator->heap_bytes();
+
+    if(rss > samples.peak_rss)
+        samples.peak_rss = rss;
+    if(heap > samples.peak_heap)
+        samples.peak_heap = heap;
+
+    if(samples.out != NULL)
+        fprintf(samples.out, "%s,%s,%.3f,%zu,%zu,%zu\n", samples.allocator->name, samples.workload,
+                elapsed_since(&samples.start) * 1000, rss / 1024, live / 1024, heap / 1024);
+}
+
+static void* sampler_func(void* unused)
+{
+    (void)unused;
+
+    while(!__atomic_load_n(&samples.stop, __ATOMIC_ACQUIRE))
+    {
+        sample_once();
+        usleep(SAMPLE_INTERVAL_US);
+    }
+
+    return NULL;
+}
+
+/**
+ * Run one workload on one allocator, and print its CSV row
+ */
+static void run_one(const struct allocator* a, const struct workload* w, int rounds, const char* series)
+{
+    pthread_t sampler;
+
+    // The sampler's buffer comes from stdio, so set it up before the workload starts
+    samples.allocator = a;
+    samples.workload = w->name;
+    samples.out = NULL;
+    if(series != NULL && (samples.out = fopen(series, "a")) == NULL)
+    {
+        fprintf(stderr, "can't open %s: %s\n", series, strerror(errno));
+        exit(1);
+    }
+
+    a->init();
+    clock_gettime(CLOCK_MONOTONIC, &samples.start);
+    if(pthread_create(&sampler, NULL, sampler_func, NULL) != 0)
+    {
+        fprintf(stderr, "Can not create thread");
+        abort();
+    }
+
+    size_t ops = w->run(a, rounds);
+    double seconds = elapsed_since(&samples.start);
+
+    __atomic_store_n(&samples.stop, true, __ATOMIC_RELEASE);
+    pthread_join(sampler, NULL);
+    sample_once();
+
+    if(samples.out != NULL)
+        fclose(samples.out);
+
+    printf("%s,%s,%zu,%.4f,%.0f,%zu,%zu,%zu,%.3f\n", a->name, w->name, ops, seconds, ops / seconds,
+           samples.peak_rss / 1024, samples.peak_live / 1024, samples.peak_heap / 1024,
+           samples.peak_heap ? (double)samples.peak_live / samples.peak_heap : 0.0);
+}
+
+int main(int argc, char** argv)
+{
+    const char* series = NULL;
+    int         rounds = 10;
+    int         opt;
+
+    while((opt = getopt(argc, argv, "n:r:t:")) != -1)
+    {
+        switch(opt)
+        {
+        case 'n':
+            names_path = optarg;
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        case 't':
+            series = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: mem_compare [-n names.txt] [-r rounds] [-t samples.csv] [allocator [workload]]\n"
+                            "Allocators are: mallocv2, glibc\nWorkloads are: frag, names\n");
+            return 1;
+        }
+    }
+
+    const char* only_allocator = (optind < argc) ? argv[optind] : NULL;
+    const char* only_workload = (optind + 1 < argc) ? argv[optind + 1] : NULL;
+
+    if(series != NULL)
+    {
+        FILE* f = fopen(series, "w");
+        if(f == NULL)
+        {
+            fprintf(stderr, "can't open %s: %s\n", series, strerror(errno));
+            return 1;
+        }
+        fprintf(f, "allocator,workload,ms,rss_kb,live_kb,heap_kb\n");
+        fclose(f);
+    }
+
+    printf("allocator,workload,ops,seconds,ops_per_sec,peak_rss_kb,peak_live_kb,peak_heap_kb,live_heap_ratio\n");
+    fflush(stdout);
+
+    for(size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++)
+    {
+        if(only_workload != NULL && strcmp(only_workload, workloads[w].name))
+            continue;
+
+        for(size_t a = 0; a < sizeof(allocators) / sizeof(allocators[0]); a++)
+        {
+            if(only_allocator != NULL && strcmp(only_allocator, allocators[a].name))
+                continue;
+
+            // A fresh process for every run, so each allocator starts from an empty heap
+            pid_t pid = fork();
+            if(pid < 0)
+            {
+                perror("fork");
+                return 1;
+            }
+            if(pid == 0)
+            {
+                run_one(&allocators[a], &workloads[w], rounds, series);
+                fflush(stdout);
+                _exit(0);
+            }
+
+            int status;
+            waitpid(pid, &status, 0);
+            if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            {
+                fprintf(stderr, "%s/%s failed\n", allocators[a].name, workloads[w].name);
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,129 @@
+/**
+ * Container workloads on the std::pmr resources in allocator.hpp, against the default
+ * (operator new) resource.
+ *
+ * Usage: pmr_bench [rounds]
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+
+#include "../source/allocator.hpp"
+
+#define BENCH_ELEMS     2000        // Elements per container per round
+#define BENCH_VECTORS   16          // Vectors grown side by side (so their buffers interleave)
+
+/**
+ * Grow a few vectors element by element, so every reallocation frees a buffer the
+ * other vectors' next reallocation can reuse
+ */
+static size_t bench_vector(std::pmr::memory_resource* resource)
+{
+    std::pmr::vector<std::pmr::vector<long>> vectors(resource);
+    size_t sum = 0;
+
+    vectors.resize(BENCH_VECTORS);
+    for(int i = 0; i < BENCH_ELEMS; i++)
+        for(auto& v : vectors)
+            v.push_back(i);
+
+    for(auto& v : vectors)
+        sum += v.size();
+    return sum;
+}
+
+/**
+ * Fill a hash map, then erase every other key and insert them again
+ */
+static size_t bench_map(std::pmr::memory_resource* resource)
+{
+    std::pmr::unordered_map<long, long> map(resource);
+
+    for(long i = 0; i < BENCH_ELEMS; i++)
+        map.emplace(i, i);
+    for(long i = 0; i < BENCH_ELEMS; i += 2)
+        map.erase(i);
+    for(long i = 0; i < BENCH_ELEMS; i += 2)
+        map.emplace(i, -i);
+
+    return map.size();
+}
+
+/**
+ * Build a list, and churn its front and back
+ */
+static size_t bench_list(std::pmr::memory_resource* resource)
+{
+    std::pmr::list<long> list(resource);
+
+    for(long i = 0; i < BENCH_ELEMS; i++)
+        list.push_back(i);
+    for(long i = 0; i < BENCH_ELEMS; i++)
+    {
+        list.pop_front();
+        list.push_back(i);
+    }
+
+    return list.size();
+}
+
+struct workload
+{
+    const char* name;
+    size_t      (*run)(std::pmr::memory_resource*);
+};
+
+/**
+ * Run a workload 'rounds' times; 'reset' (if any) is called after every round
+ */
+template<class Reset>
+static double bench_run(const workload& w, std::pmr::memory_resource* resource, int rounds, Reset reset)
+{
+    auto    start = std::chrono::steady_clock::now();
+    size_t  check = 0;
+
+    for(int i = 0; i < rounds; i++)
+    {
+        check += w.run(resource);
+        reset();
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    if(check == 0)
+        std::abort();
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+int main(int argc, char** argv)
+{
+    int rounds = (argc > 1) ? std::atoi(argv[1]) : 200;
+
+    const workload workloads[] = {
+        {"vector", bench_vector},
+        {"unordered_map", bench_map},
+        {"list", bench_list},
+    };
+
+    allocator_init();
+
+    std::printf("%-14s %12s %12s %12s %12s\n", "workload", "new/delete", "mallocv2", "region", "pool");
+    for(const workload& w : workloads)
+    {
+        mallocv2::region_resource   region;
+        mallocv2::pool_resource     pool(64);
+        auto                        none = [] {};
+
+        double base = bench_run(w, std::pmr::new_delete_resource(), rounds, none);
+        double ours = bench_run(w, mallocv2::default_resource(), rounds, none);
+        double reg = bench_run(w, &region, rounds, [&] { region.release(); });
+        double poo = bench_run(w, &pool, rounds, none);
+
+        std::printf("%-14s %10.1fms %10.1fms %10.1fms %10.1fms\n", w.name, base, ours, reg, poo);
+    }
+
+    return 0;
+}
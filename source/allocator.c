@@ -2,124 +2,389 @@
  * Implementation of allocator.h
  */
 #include "allocator.h"
+#include "bins.h"
+#include "conf.h"
+#include "guard.h"
+#include "heap.h"
+#include "leak.h"
+#include "maintenance.h"
 #include "memblk.h"
+#include "probes.h"
+#include "profiler.h"
+#include "size_classes.h"
+#include "thread_heap.h"
+#include "tlsf.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <math.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 //#define ALLOC_DEBUG
 
-static list_t alloc_list    = {NULL, NULL, RWLOCK_INITIALIZER}; // List of blocks 'in use' by the allocator 
-static list_t free_list     = {NULL, NULL, RWLOCK_INITIALIZER}; // List blocks that are currently free for use.
+// Specialised builds fix the strategy at compile time (-DALLOC_STRATEGY=ALLOC_STRATEGY_FF, say),
+// which compiles the other strategies out of alloc(). Without it, the strategy is picked at run time.
+#define ALLOC_STRATEGY_FF   1
+#define ALLOC_STRATEGY_BF   2
+#define ALLOC_STRATEGY_WF   3
+#define ALLOC_STRATEGY_TLSF 4
+
+#define ALLOC_SHARD_SHIFT   16      // Blocks are sharded by 64 KiB slices of the address space
+#define ALLOC_NEAR_PAGE     4096    // alloc_near() stops looking once it finds a block in the hint's page
+
+/**
+ * A shard of the list heap, with its own locks.
+ *
+ * Every block belongs to the shard its data falls in, so dealloc() can go straight to the
+ * right shard. alloc() searches the calling thread's preferred shard first, and only steals
+ * from the others when that has nothing that fits.
+ */
+struct alloc_shard
+{
+    list_t  alloc_list;     // List of blocks 'in use' by the allocator
+    list_t  free_list;      // List blocks that are currently free for use.
+    bins_t  free_bins;      // Size bins over the free list, for the fit searches
+    size_t  num_allocated;
+    size_t  num_free;
+} __attribute__((aligned(64)));     // Keep each shard's locks off its neighbours' cache lines
+
+static struct alloc_shard shards[ALLOC_SHARDS];
+
+#define TLSF_POOL_MIN   (256 * 1024)            // Size of the first pool handed to the TLSF heap
+#define TLSF_POOL_MAX   (16 * 1024 * 1024)      // Largest pool we'll grow the TLSF heap by in one go
 
 static bool init            = false;
-static size_t brk_start;
-static size_t brk_end;
 
-static pthread_mutex_t brk_lock = PTHREAD_MUTEX_INITIALIZER;
+#ifndef ALLOC_STRATEGY
 static alloc_method_t  cur_method = ALLOC_FF;
+static __thread int    thread_method = -1;      // Per-thread override of 'cur_method' (-1 if not set)
+#endif
+
+static void _alloc_init();
+
+static bool            isolate_threads = false; // Cache line isolation (see allocator_set_cacheline_isolation())
+
+// Everything below is written while allocating, so each group starts on a cache line of its
+// own, away from the read-mostly settings above (and from each other)
+static tlsf_t          tlsf_heap __attribute__((aligned(ALLOC_CACHELINE)));    // Backing store for the ALLOC_TLSF strategy
+static pthread_mutex_t tlsf_lock __attribute__((aligned(ALLOC_CACHELINE))) = PTHREAD_MUTEX_INITIALIZER;
+static size_t          tlsf_next_pool = TLSF_POOL_MIN;
+
+static memblk_t*       spare_nodes __attribute__((aligned(ALLOC_CACHELINE))) = NULL;  // Block nodes freed up by coalescing, for reuse by split blocks
+static pthread_mutex_t spare_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned        maint_interval_ms = 0;     // Maintenance thread settings (0 = no maintenance thread)
+static unsigned        maint_budget_pct = 0;
+
+struct limit_callback
+{
+    alloc_limit_fn  fn;
+    void*           ctx;
+};
+
+static size_t          soft_limit = 0;            // Limits on 'usage.bytes_in_use' (0 = no limit)
+static size_t          hard_limit = 0;
+static struct limit_callback limit_callbacks[ALLOC_MAX_LIMIT_CALLBACKS];
+static size_t          num_limit_callbacks = 0;
+static pthread_mutex_t limit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Every alloc() and dealloc() updates this, from every thread, so it gets a whole cache line
+static struct
+{
+    size_t  bytes_in_use;       // Bytes in blocks handed out by alloc() (and not yet freed)
+    bool    over_soft_limit;    // Set when the soft limit is crossed, until usage drops back under it
+} usage __attribute__((aligned(ALLOC_CACHELINE)));
+
+#ifdef ALLOC_STRATEGY
+static const alloc_method_t fixed_method[] = {ALLOC_FF, ALLOC_FF, ALLOC_BF, ALLOC_WF, ALLOC_TLSF};
+
+static void _alloc_fixed_strategy(alloc_method_t method)
+{
+    if(method != fixed_method[ALLOC_STRATEGY])
+        printf("allocator: this build only supports one strategy; ignoring the change\n");
+}
+#endif
 
-static size_t num_allocated = 0;
-static size_t num_free = 0;
+/**
+ * The strategy the calling thread allocates with
+ */
+static inline alloc_method_t _alloc_method()
+{
+#ifdef ALLOC_STRATEGY
+    return fixed_method[ALLOC_STRATEGY];
+#else
+    return (thread_method < 0) ? cur_method : (alloc_method_t)thread_method;
+#endif
+}
 
 void allocator_set_method(alloc_method_t method)
 {
-    cur_method = method;        
+#ifdef ALLOC_STRATEGY
+    _alloc_fixed_strategy(method);
+#else
+    cur_method = method;
+#endif
 }
-void print_alloc_list()
+
+void allocator_set_thread_method(alloc_method_t method)
+{
+#ifdef ALLOC_STRATEGY
+    _alloc_fixed_strategy(method);
+#else
+    thread_method = (int)method;
+#endif
+}
+
+void allocator_set_cacheline_isolation(bool enable)
 {
+    isolate_threads = enable;
+}
 
-    printf("\nalloc_list: ");
-    rwlock_rdlock(&alloc_list.lock);
-    memblk_t* block = alloc_list.head;
-    while(block != NULL)
-    {
-        //printf("%p(%ld) -> ", (void*)block, block->size);
-        printf("block: %p prev: %p next: %p size: %ld,\t data: %p\n",
-                (void*)block, (void*)block->prev,
-                (void*)block->next, block->size,
-                (void*)block->data);
+void allocator_set_hugepage_heap(size_t bytes)
+{
+    heap_set_hugepage_reserve(bytes);
+}
 
-        block = block->next;
+void allocator_set_maintenance(unsigned interval_ms, unsigned cpu_budget_pct)
+{
+    maint_interval_ms = interval_ms;
+    maint_budget_pct = cpu_budget_pct;
+
+    if(init && interval_ms > 0)
+        maintenance_start(interval_ms, cpu_budget_pct);
+}
+
+void allocator_set_guard_sampling(unsigned rate, size_t slots)
+{
+    guard_set_sampling(rate, slots);
+}
+
+void allocator_set_heap_profiling(size_t sample_rate)
+{
+    profiler_set_rate(sample_rate);
+}
+
+int allocator_dump_heap_profile(const char* path)
+{
+    return profiler_dump(path);
+}
+
+int allocator_dump_heap_profile_on_signal(int signo, const char* prefix)
+{
+    return profiler_dump_on_signal(signo, prefix);
+}
+
+void allocator_set_leak_report(alloc_leak_mode_t mode)
+{
+    leak_set_mode(mode);
+}
+
+void allocator_leak_report()
+{
+    leak_report();
+}
+
+void allocator_set_limits(size_t soft, size_t hard)
+{
+    soft_limit = soft;
+    hard_limit = hard;
+}
+
+int allocator_add_soft_limit_callback(alloc_limit_fn fn, void* ctx)
+{
+    pthread_mutex_lock(&limit_lock);
+    if(num_limit_callbacks == ALLOC_MAX_LIMIT_CALLBACKS)
+    {
+        pthread_mutex_unlock(&limit_lock);
+        return -1;
     }
 
-    printf("NULL\n");
-    printf("alloc_list = %p\n", (void*)alloc_list.head);
-    printf("last_allocated = %p\n\n\n", (void*)alloc_list.tail);
-    rwlock_unlock(&alloc_list.lock);
+    limit_callbacks[num_limit_callbacks].fn     = fn;
+    limit_callbacks[num_limit_callbacks].ctx    = ctx;
+    num_limit_callbacks++;
+    pthread_mutex_unlock(&limit_lock);
+
+    return 0;
+}
+
+size_t allocator_bytes_in_use()
+{
+    return __atomic_load_n(&usage.bytes_in_use, __ATOMIC_RELAXED);
+}
+
+size_t allocator_heap_bytes()
+{
+    return heap_size();
+}
+
+void allocator_stop_maintenance()
+{
+    maintenance_stop();
+}
+
+void allocator_init()
+{
+    _alloc_init();
+}
+
+void allocator_shard_stats(size_t shard, alloc_shard_stats_t* stats)
+{
+    stats->allocated_blocks = __atomic_load_n(&shards[shard].num_allocated, __ATOMIC_RELAXED);
+    stats->free_blocks      = __atomic_load_n(&shards[shard].num_free, __ATOMIC_RELAXED);
+    stats->alloc_contended  = __atomic_load_n(&shards[shard].alloc_list.lock.contended, __ATOMIC_RELAXED);
+    stats->free_contended   = __atomic_load_n(&shards[shard].free_list.lock.contended, __ATOMIC_RELAXED);
+}
+
+static inline size_t _alloc_shard_index(const void* data)
+{
+    return ((uintptr_t)data >> ALLOC_SHARD_SHIFT) & (ALLOC_SHARDS - 1);
+}
+
+static inline struct alloc_shard* _alloc_shard_of(const void* data)
+{
+    return &shards[_alloc_shard_index(data)];
+}
+
+void print_alloc_list()
+{
+    for(size_t i = 0; i < ALLOC_SHARDS; i++)
+    {
+        list_t* alloc_list = &shards[i].alloc_list;
+
+        printf("\nalloc_list[%zu]: ", i);
+        rwlock_rdlock(&alloc_list->lock);
+        memblk_t* block = alloc_list->head;
+        while(block != NULL)
+        {
+            //printf("%p(%ld) -> ", (void*)block, block->size);
+            printf("block: %p prev: %p next: %p size: %ld,\t data: %p\n",
+                    (void*)block, (void*)block->prev,
+                    (void*)block->next, block->size,
+                    (void*)block->data);
+
+            block = block->next;
+        }
+
+        printf("NULL\n");
+        printf("alloc_list = %p\n", (void*)alloc_list->head);
+        printf("last_allocated = %p\n\n\n", (void*)alloc_list->tail);
+        rwlock_unlock(&alloc_list->lock);
+    }
 }
 
 void print_free_list()
 {
-    printf("\nfree: ");
-    rwlock_rdlock(&free_list.lock);
-    memblk_t* block = free_list.head;
-    while(block != NULL)
+    for(size_t i = 0; i < ALLOC_SHARDS; i++)
     {
-        //printf("%p(%ld) -> ", (void*)block, block->size);
-        printf("block: %p prev: %p next: %p size: %ld,\t data: %p\n",
-                (void*)block, (void*)block->prev,
-                (void*)block->next, block->size,
-                (void*)block->data);
+        list_t* free_list = &shards[i].free_list;
 
-        block = block->next;
+        printf("\nfree[%zu]: ", i);
+        rwlock_rdlock(&free_list->lock);
+        memblk_t* block = free_list->head;
+        while(block != NULL)
+        {
+            //printf("%p(%ld) -> ", (void*)block, block->size);
+            printf("block: %p prev: %p next: %p size: %ld,\t data: %p\n",
+                    (void*)block, (void*)block->prev,
+                    (void*)block->next, block->size,
+                    (void*)block->data);
+
+            block = block->next;
+        }
+
+        printf("NULL\n");
+        printf("free = %p\n", (void*)free_list->head);
+        printf("free = %p\n\n\n", (void*)free_list->tail);
+        rwlock_unlock(&free_list->lock);
     }
 
-    printf("NULL\n");
-    printf("free = %p\n", (void*)free_list.head);
-    printf("free = %p\n\n\n", (void*)free_list.tail);
-    rwlock_unlock(&free_list.lock);
+    printf("search kernel = %s\n\n\n", bins_kernel());
 }
 
 static void _alloc_init()
 {
     if(!init)
     {
-        brk_start = (size_t)sbrk(0);
-        brk_end = brk_start;
-        pthread_mutex_init(&brk_lock, NULL);
-        rwlock_init(&alloc_list.lock);
-        rwlock_init(&free_list.lock);
+        // Settings from the environment win over anything set before now
+        conf_apply();
+
+        heap_init();
+        tlsf_init(&tlsf_heap);
+        for(size_t i = 0; i < ALLOC_SHARDS; i++)
+        {
+            rwlock_init(&shards[i].alloc_list.lock);
+            rwlock_init(&shards[i].free_list.lock);
+            shards[i].free_list.bins = &shards[i].free_bins;
+        }
         init = true;
+
+        if(maint_interval_ms > 0)
+            maintenance_start(maint_interval_ms, maint_budget_pct);
     }
 }
 
 /**
- * Create a new block by calling sbrk. This allocates enough
- * room for the block, and the size of the void pointer to
- * hold the actual data itself.
+ * Set up a new block at 'mem', with its data following the node (padded out to 'align'
+ * if that's more than HEAP_ALIGN)
  */
-static memblk_t* _alloc_create_new_block(size_t size)
+static memblk_t* _alloc_init_block(void* mem, size_t size, size_t align)
 {
-    memblk_t* block;
+    memblk_t* block = mem;
 
-#ifdef ALLOC_DEBUG
-    printf("_alloc_create_new_block: creating a new block of size %ld\n", size);
-#endif
-    pthread_mutex_lock(&brk_lock);
-    block       = sbrk(sizeof(memblk_t));
-    if(block == (void*)-1)
-    {
-        printf("call to sbrk failed!\n");
-        abort();
-    }
     block->size = size;
-    block->data = sbrk(size);
+    block->data = (uint8_t*)block + sizeof(memblk_t);
+    if(align > HEAP_ALIGN)
+        block->data = (void*)(((uintptr_t)block->data + align - 1) & ~(uintptr_t)(align - 1));
     block->next = NULL;
     block->prev = NULL;
+    block->owner = NULL;
+    block->remote_next = NULL;
+    block->list = NULL;
+    block->flags = 0;
     int ret = pthread_mutex_init(&block->lock, NULL);
     if(ret)
     {
         fprintf(stderr, "failed to create block mutex!\n");
         abort();
     }
-    pthread_mutex_unlock(&brk_lock);
+
+    return block;
+}
+
+/**
+ * Create a new block by growing the heap. This carves enough room for the
+ * block, and the data itself, in one go (the data follows the block, padded
+ * out to 'align' if that's more than HEAP_ALIGN).
+ *
+ * Blocks aligned to a cache line or more are padded at the end too, so nothing
+ * carved after them lands on their last line.
+ *
+ * Returns NULL if the heap can't grow.
+ */
+static memblk_t* _alloc_create_new_block(size_t size, size_t align)
+{
+    memblk_t* block;
+    size_t    pad = (align > HEAP_ALIGN) ? align - HEAP_ALIGN : 0;
+    size_t    tail = size;
+
+    if(align >= ALLOC_CACHELINE)
+        tail = (size + ALLOC_CACHELINE - 1) & ~(size_t)(ALLOC_CACHELINE - 1);
+
+#ifdef ALLOC_DEBUG
+    printf("_alloc_create_new_block: creating a new block of size %ld\n", size);
+#endif
+    block       = heap_grow(sizeof(memblk_t) + pad + tail);
+    if(block == NULL)
+        return NULL;
+    _alloc_init_block(block, size, align);
+    PROBE2(new_block, block->data, size);
 
 #ifdef ALLOC_DEBUG
     printf("_alloc_create_new_block: block at %p chunk at %p\n", (void*)block, block->data);
@@ -131,8 +396,8 @@ static memblk_t* _alloc_create_new_block(size_t size)
 /**
  *  Create a split block
  *
- *  Allocate a new node (using sbrk). The value of block->ptr
- *  is then set to dataptr.
+ *  Allocate a new node (from the heap). The value of block->ptr
+ *  is then set to dataptr. Returns NULL if the heap can't grow.
  */
 static memblk_t* _alloc_create_split_block(size_t size, void* dataptr)
 {
@@ -141,17 +406,25 @@ static memblk_t* _alloc_create_split_block(size_t size, void* dataptr)
 #ifdef ALLOC_DEBUG
     printf("_alloc_create_split_block: creating a new block of size %ld\n", size);
 #endif
-    pthread_mutex_lock(&brk_lock);
-    block       = sbrk(sizeof(memblk_t));
-    if(block == (void*)-1)
-    {
-        printf("call to sbrk failed!\n");
-        abort();
-    }
+    // Reuse a node left over from coalescing if we can
+    pthread_mutex_lock(&spare_lock);
+    block = spare_nodes;
+    if(block != NULL)
+        spare_nodes = block->next;
+    pthread_mutex_unlock(&spare_lock);
+
+    if(block == NULL)
+        block = heap_grow(sizeof(memblk_t));
+    if(block == NULL)
+        return NULL;
     block->size = size;
     block->data= dataptr;
     block->next = NULL;
     block->prev = NULL;
+    block->owner = NULL;
+    block->remote_next = NULL;
+    block->list = NULL;
+    block->flags = 0;
     int ret = pthread_mutex_init(&block->lock, NULL);
     if(ret)
     {
@@ -159,7 +432,6 @@ static memblk_t* _alloc_create_split_block(size_t size, void* dataptr)
         abort();
     }
     //printf("_alloc_create_split_block: block created at %p\n", (void*)block);
-    pthread_mutex_unlock(&brk_lock);
 #ifdef ALLOC_DEBUG
     printf("_alloc_create_split_block: block created at %p\n", (void*)block);
 #endif
@@ -170,286 +442,409 @@ static memblk_t* _alloc_create_split_block(size_t size, void* dataptr)
 /**
  * Find first 'size' sized block in the free list.
  * 
- * Iterates over the free list to find a block that first fits the size that we need passed
- * in via the argument 'size'. The block is then locked, and returned to the caller.
+ * Scans the free bins from the class of 'size' upwards, and takes the first block that fits
+ * and isn't locked, so this is a segregated first fit: the block is the first fit within the
+ * smallest class that has one, not the first fit in list order.
  * 
  * NULL is returned in either the situation the requested size cannot be serviced, or
  * all blocks of the requested size are locked.
  */
-static memblk_t* find_first_free(size_t size)
+static memblk_t* find_first_free(bins_t* bins, size_t size)
 {
-    memblk_t* block = free_list.head;
-
-    while(block != NULL)
-    {
-        //printf("block @ %p\n", block);
-        if(block->size >= size)
-        {
-            // Attempt to acquire the lock for this block.
-            // This prevents us from acquiring the block twice. If  the block is to be acquired twice, it will be passed to 
-            // _update_free_list() while it is currently on the alloc list. This is impossible, and means that the state
-            // of the lists has become corrupt.
-            if(pthread_mutex_trylock(&block->lock) == 0)
-                return block;
-        }
-
-        block = block->next;
-    }
-
-    return NULL;
+    // Locking the block prevents us from acquiring it twice. If the block is to be acquired twice, it will be
+    // passed to _update_free_list() while it is currently on the alloc list. This is impossible, and means that
+    // the state of the lists has become corrupt.
+    return bins_first_fit(bins, size);
 }
 
 /**
  * Find best sized block for the requested size.
  * 
- * Iterates over the free list to find a block that is the "best fit" for the request. That is, 
- * the smallest possible block that will result in the largest possible hole. 
+ * Finds the smallest free block that will hold the request. Only the first bin with a block
+ * that fits needs to be searched, as every block in the bins above it is larger.
  * 
- * NOTE: As this function requires a full pass to find the smallest possible block size,
- * it will return NULL if the block is locked, meaning the iteration has effectively been
- * wasted. In this case, the allocator will create a new block instead. 
+ * NOTE: If the best block is locked, this returns NULL rather than settling for the next best,
+ * and the allocator will create a new block instead.
  */
-static memblk_t* _find_best_fit(size_t size)
+static memblk_t* _find_best_fit(bins_t* bins, size_t size)
 {
-    memblk_t*   block = free_list.head;
-    memblk_t*   best = NULL;
-    size_t      curr_size = SIZE_MAX;
-    while(block != NULL)
-    {
-        if(block->size == size)
-        {
-            best = block;
-            break;
-        }
-            
-        if(block->size < curr_size && block->size >= size)
-        {
-            curr_size = block->size;
-            best = block;
-        }
+    return bins_best_fit(bins, size);
+}
 
-        block = block->next;
-    }
+/**
+ * Find the largest free block that holds 'size' bytes, leaving the biggest possible
+ * remainder to split off. That's the largest block in the highest bin that isn't empty.
+ *
+ * Like _find_best_fit(), this returns NULL if the block it settles on is locked.
+ */
+static memblk_t* _find_worst_fit(bins_t* bins, size_t size)
+{
+    return bins_worst_fit(bins, size);
+}
 
-    // At this point, we've found the best fit block (as we've iterated over the entire free list).
-    // We can now attempt lock the block, and return it to the caller
-    if(best != NULL)
-    {
-        int ret = pthread_mutex_trylock(&best->lock);
-        if(ret == 0)
-            return best;
+/**
+ * Put a block on its shard's free list
+ */
+static void _alloc_add_free(memblk_t* block)
+{
+    struct alloc_shard* shard = _alloc_shard_of(block->data);
 
-    }
+    rwlock_wrlock(&shard->free_list.lock);
+    block->flags = 0;
+    list_append_block(&shard->free_list, block);
+    shard->num_free++;
+    rwlock_unlock(&shard->free_list.lock);
+}
 
-    return NULL;
+/**
+ * Put a block on its shard's allocated list, owned by 'owner'
+ */
+static void _alloc_add_allocated(memblk_t* block, thread_heap_t* owner)
+{
+    struct alloc_shard* shard = _alloc_shard_of(block->data);
+
+    rwlock_wrlock(&shard->alloc_list.lock);
+    block->owner = owner;
+    list_append_block(&shard->alloc_list, block);
+    shard->num_allocated++;
+    rwlock_unlock(&shard->alloc_list.lock);
 }
 
 /**
- * 
+ * Allocate 'size' bytes from 'found', a block on 'shard's free list that the caller has
+ * locked. Anything past 'size' is split off and stays free.
  */
-static memblk_t* _find_worst_fit()
+static void* _alloc_take(struct alloc_shard* shard, memblk_t* found, size_t size, thread_heap_t* heap)
 {
-    memblk_t*   block = free_list.head;
-    memblk_t*   worst = NULL;
-    size_t      curr_size = 0;
+    memblk_t* split = NULL;
 
-    while(block != NULL)
+    if(found->size > size)
     {
-        if(block->size > curr_size)
-            worst = block;
-
-        block = block->next;
+        split = _alloc_create_split_block(found->size - size, (((uint8_t*)found->data) + size));
+        if(split == NULL)
+        {
+            pthread_mutex_unlock(&found->lock);
+            return NULL;
+        }
+        PROBE3(split, found->data, size, split->size);
     }
 
-    // At this point, we've found the best fit block (as we've iterated over the entire free list).
-    // We can now attempt lock the block, and return it to the caller
-    if(worst != NULL)
+    // Take the block off the free list before shrinking it, so it leaves the bin it's filed under
+    rwlock_wrlock(&shard->free_list.lock);
+    list_delete_block(&shard->free_list, found);
+    shard->num_free--;
+    if(split != NULL)
     {
-        int ret = pthread_mutex_trylock(&worst->lock);
-        if(ret == 0)
-            return worst;
-        
+        found->size = size;
+
+        // Let's add the split block to the free list. It's in this shard unless it
+        // starts past a shard boundary.
+        if(_alloc_shard_of(split->data) == shard)
+        {
+            list_append_block(&shard->free_list, split);
+            shard->num_free++;
+            split = NULL;
+        }
     }
+    rwlock_unlock(&shard->free_list.lock);
 
-    return NULL;
-}
+    if(split != NULL)
+        _alloc_add_free(split);
 
-static void* _alloc_first_fit(size_t size)
-{
-    memblk_t* found;
+    // Now let's add the block we found to the allocated list
+    _alloc_add_allocated(found, heap);
+    pthread_mutex_unlock(&found->lock);
 
-    _alloc_init();
+    return found->data;
+}
 
-    // First, let's check the free list
-    rwlock_rdlock(&free_list.lock);
-    found = find_first_free(size);
-    rwlock_unlock(&free_list.lock);
+/**
+ * Generic allocation core, shared by every fit policy.
+ *
+ * 'find' searches a shard's free bins (under its free list's read lock) and returns a
+ * suitable block locked, or NULL. Each caller passes a constant, so once this is inlined
+ * the policy is a direct call with no branch on the strategy.
+ *
+ * The calling thread's preferred shard is searched first, then its neighbours in turn, so
+ * best and worst fit are the best and worst in the first shard that has a fit.
+ */
+static inline __attribute__((always_inline)) void* _alloc_fit(size_t size, memblk_t* (*find)(bins_t*, size_t))
+{
+    thread_heap_t*      heap = thread_heap_self();
+    struct alloc_shard* shard = NULL;
+    memblk_t*           found = NULL;
+    size_t              searched = 0;
 
-    if(found != NULL)
+    // First, let's check the free lists
+    for(size_t i = 0; i < ALLOC_SHARDS && found == NULL; i++)
     {
-        int size_diff = found->size - size;
-        if(found->size >= size && size_diff > 0)
-        {
-
-            found->size = size;
-            rwlock_wrlock(&free_list.lock);
-            // Let's add the split block to the free list
-            list_append_block(&free_list, _alloc_create_split_block(size_diff, (((uint8_t*)found->data) + size_diff)));
-            num_free++;
-            rwlock_unlock(&free_list.lock);
-        }
-
-        rwlock_wrlock(&free_list.lock);
-        list_delete_block(&free_list, found);
-        rwlock_unlock(&free_list.lock);
-
-        // Now let's add the block we found to the allocated list
-        rwlock_wrlock(&alloc_list.lock);
-        list_append_block(&alloc_list, found);
-        pthread_mutex_unlock(&found->lock);
-        num_allocated++;
-        num_free--;
-        rwlock_unlock(&alloc_list.lock);
-        
-        return found->data;
+        shard = &shards[(heap->id + i) & (ALLOC_SHARDS - 1)];
+        if(__atomic_load_n(&shard->num_free, __ATOMIC_RELAXED) == 0)
+            continue;
+
+        rwlock_rdlock(&shard->free_list.lock);
+        found = find(&shard->free_bins, size);
+        rwlock_unlock(&shard->free_list.lock);
+        searched++;
     }
+    PROBE4(search, size, _alloc_method(), searched, found);
+
+    if(found != NULL)
+        return _alloc_take(shard, found, size, heap);
 
-    // There doesn't seem to be a block for this size in the free list, so let's
+    // There doesn't seem to be a block for this size in the free lists, so let's
     // create it.
-    rwlock_wrlock(&alloc_list.lock);
-    memblk_t* block = _alloc_create_new_block(size);
-    list_append_block(&alloc_list, block);
-    num_allocated++;
-    rwlock_unlock(&alloc_list.lock);
+    memblk_t* block = _alloc_create_new_block(size, HEAP_ALIGN);
+    if(block == NULL)
+        return NULL;
+
+    _alloc_add_allocated(block, heap);
 
     return block->data;
 }
 
-static void* _alloc_best_fit(size_t size)
+// A specialised build only calls one of these
+static __attribute__((unused)) void* _alloc_first_fit(size_t size)
 {
-    memblk_t* found;
-
-    _alloc_init();
+    return _alloc_fit(size, find_first_free);
+}
 
-    // First, let's check the free list
-    rwlock_rdlock(&free_list.lock);
-    found = _find_best_fit(size);
-    rwlock_unlock(&free_list.lock);
+static __attribute__((unused)) void* _alloc_best_fit(size_t size)
+{
+    return _alloc_fit(size, _find_best_fit);
+}
 
-    if(found != NULL)
-    {
-        if(found->size > size)
-        {
-            int size_diff = found->size - size;
-            found->size = size;
-
-            rwlock_wrlock(&free_list.lock);
-            // Let's add the split block to the free list
-            list_append_block(&free_list, _alloc_create_split_block(size_diff, (((uint8_t*)found->data) + size)));
-            num_free++;
-            rwlock_unlock(&free_list.lock);
-        }
+static __attribute__((unused)) void* _alloc_worst_fit(size_t size)
+{
+    return _alloc_fit(size, _find_worst_fit);
+}
 
-        rwlock_wrlock(&free_list.lock);
-        list_delete_block(&free_list, found);
-        num_free--;
-        rwlock_unlock(&free_list.lock);
+/**
+ * Allocate a small block for cache line isolation: from the thread's cache if it has a
+ * block of the right class, otherwise carved from the thread's own span
+ */
+static __attribute__((unused)) void* _alloc_private(thread_heap_t* heap, size_t size)
+{
+    memblk_t* block = thread_heap_cache_pop(heap, size_class_of(size));
 
-        // Now let's add the block we found to the allocated list
-        rwlock_wrlock(&alloc_list.lock);
-        list_append_block(&alloc_list, found);
-        rwlock_unlock(&alloc_list.lock);
-        pthread_mutex_unlock(&found->lock);
+    if(block == NULL)
+    {
+        void* mem = thread_heap_carve(heap, sizeof(memblk_t) + size);
+        if(mem == NULL)
+            return NULL;
 
-        return found->data;
+        block = _alloc_init_block(mem, size, HEAP_ALIGN);
+        block->flags = BLOCK_PRIVATE;
     }
 
-    // There doesn't seem to be a block for this size in the free list, so let's
-    // create it.
-    rwlock_wrlock(&alloc_list.lock);
-    //printf("whoa looks like we're making a new block!\n");
-    memblk_t* block = _alloc_create_new_block(size);
-    list_append_block(&alloc_list, block);
-    num_allocated++;
-    rwlock_unlock(&alloc_list.lock);
-    
+    _alloc_add_allocated(block, heap);
+
     return block->data;
 }
 
-static void* _alloc_worst_fit(size_t size)
+/**
+ * Isolation has been turned off; give the blocks in the thread's cache to the free lists
+ */
+static __attribute__((unused)) void _alloc_release_private(thread_heap_t* heap)
 {
-    memblk_t* found;
-
-    _alloc_init();
-
-    // First, let's check the free list
-    rwlock_rdlock(&free_list.lock);
-    found = _find_worst_fit(size);
-    rwlock_unlock(&free_list.lock);
-
-    if(found != NULL)
+    for(unsigned cls = 0; cls < SIZE_CLASS_COUNT; cls++)
     {
-        if(found->size > size)
-        {
-            int size_diff = found->size - size;
-            found->size = size;
-
-            rwlock_wrlock(&free_list.lock);
-            // Let's add the split block to the free list
-            list_append_block(&free_list, _alloc_create_split_block(size_diff, (((uint8_t*)found->data) + size)));
-            num_free++;
-            rwlock_unlock(&free_list.lock);
-        }
-
-        rwlock_wrlock(&free_list.lock);
-        list_delete_block(&free_list, found);
-        num_free--;
-        rwlock_unlock(&free_list.lock);
+        memblk_t* block;
+        while((block = thread_heap_cache_pop(heap, cls)) != NULL)
+            _alloc_add_free(block);
+    }
+}
 
-        // Now let's add the block we found to the allocated list
-        rwlock_wrlock(&alloc_list.lock);
-        list_append_block(&alloc_list, found);
-        num_allocated++;
-        rwlock_unlock(&alloc_list.lock);
-        pthread_mutex_unlock(&found->lock);
+/**
+ * Give what's left of a thread heap's span to the free lists, as a block of its own
+ */
+static void _alloc_release_span(thread_heap_t* heap)
+{
+    size_t left = heap->span_end - heap->span_top;
 
-        return found->data;
-    }
+    if(left > sizeof(memblk_t))
+        _alloc_add_free(_alloc_init_block(heap->span_top, left - sizeof(memblk_t), HEAP_ALIGN));
 
-    // There doesn't seem to be a block for this size in the free list, so let's
-    // create it.
-    rwlock_wrlock(&alloc_list.lock);
-    memblk_t* block = _alloc_create_new_block(size);
-    list_append_block(&alloc_list, block);
-    num_allocated++;
-    rwlock_unlock(&alloc_list.lock);
-    
-    return block->data;
+    heap->span_top = NULL;
+    heap->span_end = NULL;
 }
 
-void* alloc(size_t size)
+/**
+ * Move a batch of remotely freed blocks (chained through 'remote_next') that all belong
+ * to one shard from its allocated list to its free list. When the owner itself drains
+ * the batch ('owner' isn't NULL), its private blocks go back to its cache instead.
+ */
+static void _alloc_drain_shard(struct alloc_shard* shard, memblk_t* batch, thread_heap_t* owner)
 {
-    void* ptr;
+    memblk_t*   block;
+    size_t      count = 0;
 
-    if((signed long long int)size < 0)
+    rwlock_wrlock(&shard->alloc_list.lock);
+    for(block = batch; block != NULL; block = block->remote_next)
     {
-        printf("alloc: allocation size < 0! Size: %ld\n", size);
-        return NULL;
+        list_delete_block(&shard->alloc_list, block);
+        count++;
     }
+    shard->num_allocated -= count;
+    rwlock_unlock(&shard->alloc_list.lock);
 
-    if(cur_method == ALLOC_FF)
-        ptr = _alloc_first_fit(size);
-    else if(cur_method == ALLOC_BF)
+    rwlock_wrlock(&shard->free_list.lock);
+    block = batch;
+    while(block != NULL)
+    {
+        memblk_t* next = block->remote_next;
+        block->remote_next = NULL;
+        if(owner != NULL && (block->flags & BLOCK_PRIVATE))
+        {
+            thread_heap_cache_push(owner, block);
+            count--;
+        }
+        else
+        {
+            block->flags = 0;
+            list_append_block(&shard->free_list, block);
+        }
+        block = next;
+    }
+    shard->num_free += count;
+    rwlock_unlock(&shard->free_list.lock);
+}
+
+/**
+ * Move every block other threads have deallocated on our behalf from the allocated
+ * lists to the free lists. The batch is split up by shard first, so it costs one write
+ * lock on each list of each shard it touches, rather than a pair per block.
+ *
+ * 'own' is true if the calling thread owns 'heap'.
+ */
+static void _alloc_drain_remote(thread_heap_t* heap, bool own)
+{
+    memblk_t*   batch = thread_heap_take_remote(heap);
+    memblk_t*   by_shard[ALLOC_SHARDS] = {NULL};
+
+    while(batch != NULL)
+    {
+        memblk_t*   next = batch->remote_next;
+        size_t      i = _alloc_shard_index(batch->data);
+
+        batch->remote_next = by_shard[i];
+        by_shard[i] = batch;
+        batch = next;
+    }
+
+    for(size_t i = 0; i < ALLOC_SHARDS; i++)
+    {
+        if(by_shard[i] != NULL)
+            _alloc_drain_shard(&shards[i], by_shard[i], own ? heap : NULL);
+    }
+}
+
+/**
+ * Allocate from the TLSF heap.
+ *
+ * The search itself is O(1); the only unbounded part is growing the heap, which
+ * happens geometrically (so rarely) when no free block is large enough. Returns
+ * NULL if the heap can't grow.
+ */
+static __attribute__((unused)) void* _alloc_tlsf(size_t size)
+{
+    void* ptr;
+
+    _alloc_init();
+
+    pthread_mutex_lock(&tlsf_lock);
+    ptr = tlsf_malloc(&tlsf_heap, size);
+    if(ptr == NULL)
+    {
+        // A pool sized to fit the request exactly isn't enough, as the search rounds it up
+        size_t need = tlsf_pool_size_for(size);
+        size_t pool_size = tlsf_next_pool;
+        if(pool_size < need)
+            pool_size = need;
+
+        void* pool = (need != 0) ? heap_grow(pool_size) : NULL;
+        if(pool == NULL || !tlsf_add_pool(&tlsf_heap, pool, pool_size))
+        {
+            pthread_mutex_unlock(&tlsf_lock);
+            return NULL;
+        }
+        PROBE2(new_block, pool, pool_size);
+
+        if(tlsf_next_pool < TLSF_POOL_MAX)
+            tlsf_next_pool *= 2;
+
+        ptr = tlsf_malloc(&tlsf_heap, size);
+    }
+    pthread_mutex_unlock(&tlsf_lock);
+
+    return ptr;
+}
+
+/**
+ * Allocate from the guard slots, or the heap for the current strategy
+ */
+static void* _alloc(size_t size)
+{
+    void* ptr;
+
+    if((signed long long int)size < 0)
+    {
+        printf("alloc: allocation size < 0! Size: %ld\n", size);
+        return NULL;
+    }
+
+    _alloc_init();
+
+    if(guard_rate != 0 && (ptr = guard_maybe_alloc(size)) != NULL)
+        return ptr;
+
+#if ALLOC_STRATEGY == ALLOC_STRATEGY_TLSF
+    return _alloc_tlsf(size);
+#else
+#ifndef ALLOC_STRATEGY
+    alloc_method_t method = _alloc_method();
+
+    if(method == ALLOC_TLSF)
+        return _alloc_tlsf(size);
+#endif
+
+    thread_heap_t* heap = thread_heap_self();
+    if(thread_heap_has_remote(heap))
+        _alloc_drain_remote(heap, true);
+
+    // Round up to a size class, so a freed block fits the next request of its class
+    // exactly, and so every split leaves the rest of the block aligned
+    size = size_class_round(size);
+
+    if(isolate_threads)
+    {
+        if(size <= SIZE_CLASS_MAX)
+            return _alloc_private(heap, size);
+    }
+    else if(heap->cache_count != 0)
+    {
+        _alloc_release_private(heap);
+    }
+
+#if ALLOC_STRATEGY == ALLOC_STRATEGY_FF
+    ptr = _alloc_first_fit(size);
+#elif ALLOC_STRATEGY == ALLOC_STRATEGY_BF
+    ptr = _alloc_best_fit(size);
+#elif ALLOC_STRATEGY == ALLOC_STRATEGY_WF
+    ptr = _alloc_worst_fit(size);
+#else
+    if(method == ALLOC_FF)
+        ptr = _alloc_first_fit(size);
+    else if(method == ALLOC_BF)
         ptr = _alloc_best_fit(size);
-    else if(cur_method == ALLOC_WF)
+    else if(method == ALLOC_WF)
         ptr = _alloc_worst_fit(size);
     else
     {
         printf("Unknown allocation strategy! Aborting...\n");
         exit(-1);
     }
-
-    num_allocated++;
+#endif
 
 #ifdef ALLOC_DEBUG
     printf("alloc: allocated a new pointer at %p\n", ptr);
@@ -459,6 +854,326 @@ void* alloc(size_t size)
 #endif
 
     return ptr;
+#endif
+}
+
+/**
+ * Usage has just gone over the soft limit. Hand back whatever the allocator is sitting
+ * on, and let the application know so it can drop caches of its own.
+ */
+static void _alloc_soft_limit_exceeded(size_t in_use)
+{
+    // Only the thread that crosses the limit does the cleanup
+    if(__atomic_exchange_n(&usage.over_soft_limit, true, __ATOMIC_ACQ_REL))
+        return;
+
+    allocator_flush_thread_caches();
+    allocator_coalesce();
+    allocator_trim();
+
+    pthread_mutex_lock(&limit_lock);
+    for(size_t i = 0; i < num_limit_callbacks; i++)
+        limit_callbacks[i].fn(in_use, soft_limit, limit_callbacks[i].ctx);
+    pthread_mutex_unlock(&limit_lock);
+}
+
+/**
+ * Take 'size' bytes off the usage count, and re-arm the soft limit once we're back under it
+ */
+static inline void _alloc_release_bytes(size_t size)
+{
+    size_t in_use = __atomic_sub_fetch(&usage.bytes_in_use, size, __ATOMIC_RELAXED);
+
+    if(usage.over_soft_limit && in_use <= soft_limit)
+        __atomic_store_n(&usage.over_soft_limit, false, __ATOMIC_RELEASE);
+}
+
+/**
+ * Allocate a block whose data is aligned to 'align' (a power of two above HEAP_ALIGN).
+ *
+ * The free lists only promise HEAP_ALIGN, so these always get a padded block of their
+ * own from the heap. Once freed, the block is reused like any other.
+ */
+static void* _alloc_aligned(size_t size, size_t align)
+{
+    if((signed long long int)size < 0)
+    {
+        printf("alloc_aligned: allocation size < 0! Size: %ld\n", size);
+        return NULL;
+    }
+
+    _alloc_init();
+
+    thread_heap_t* heap = thread_heap_self();
+    if(thread_heap_has_remote(heap))
+        _alloc_drain_remote(heap, true);
+
+    memblk_t* block = _alloc_create_new_block(size_class_round(size), align);
+    if(block == NULL)
+        return NULL;
+
+    _alloc_add_allocated(block, heap);
+
+    return block->data;
+}
+
+/**
+ * Reserve 'size' bytes against the hard limit, before allocating them, so racing threads
+ * can't all squeeze under it. Returns false (with errno set) if they don't fit. The heaps'
+ * rounding is added (and checked against the limit again) by _alloc_accounted().
+ */
+static inline bool _alloc_reserve(size_t size)
+{
+    size_t in_use = __atomic_add_fetch(&usage.bytes_in_use, size, __ATOMIC_RELAXED);
+    if(hard_limit != 0 && in_use > hard_limit)
+    {
+        __atomic_sub_fetch(&usage.bytes_in_use, size, __ATOMIC_RELAXED);
+        errno = ENOMEM;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Find a free block in 'shard' that fits 'size' bytes and starts as close to 'hint' as
+ * possible, and lock it. Only the ALLOC_NEAR_SCAN most recently freed blocks are looked
+ * at, and the search stops at the first one in the same page as 'hint'.
+ */
+static __attribute__((unused)) memblk_t* _find_nearest(struct alloc_shard* shard, const void* hint, size_t size)
+{
+    memblk_t*   best = NULL;
+    uintptr_t   best_distance = UINTPTR_MAX;
+    uintptr_t   page = (uintptr_t)hint & ~(uintptr_t)(ALLOC_NEAR_PAGE - 1);
+    size_t      scanned = 0;
+
+    rwlock_rdlock(&shard->free_list.lock);
+    for(memblk_t* block = shard->free_list.tail; block != NULL && scanned < ALLOC_NEAR_SCAN; block = block->prev, scanned++)
+    {
+        if(block->size < size)
+            continue;
+
+        uintptr_t data = (uintptr_t)block->data;
+        uintptr_t distance = (data > (uintptr_t)hint) ? data - (uintptr_t)hint : (uintptr_t)hint - data;
+        if(distance < best_distance)
+        {
+            best = block;
+            best_distance = distance;
+            if((data & ~(uintptr_t)(ALLOC_NEAR_PAGE - 1)) == page)
+                break;
+        }
+    }
+
+    if(best != NULL && pthread_mutex_trylock(&best->lock) != 0)
+        best = NULL;
+    rwlock_unlock(&shard->free_list.lock);
+
+    return best;
+}
+
+static void* _alloc_near(const void* hint, size_t size)
+{
+    if(hint == NULL || (signed long long int)size < 0)
+        return _alloc(size);
+
+    _alloc_init();
+
+    if(guard_owns((void*)hint) || tlsf_owns(&tlsf_heap, (void*)hint))
+        return _alloc(size);
+
+#if ALLOC_STRATEGY == ALLOC_STRATEGY_TLSF
+    return _alloc(size);
+#else
+    if(_alloc_method() == ALLOC_TLSF)
+        return _alloc(size);
+
+    thread_heap_t* heap = thread_heap_self();
+    if(thread_heap_has_remote(heap))
+        _alloc_drain_remote(heap, true);
+
+    size = size_class_round(size);
+
+    // A thread's private blocks are already carved one after another
+    if(isolate_threads && size <= SIZE_CLASS_MAX)
+        return _alloc_private(heap, size);
+
+    struct alloc_shard* shard = _alloc_shard_of(hint);
+    memblk_t*           found = _find_nearest(shard, hint, size);
+    if(found != NULL)
+        return _alloc_take(shard, found, size, heap);
+
+    return _alloc(size);
+#endif
+}
+
+struct alloc_group
+{
+    memblk_t*   rest;       // What's left of the current reservation (on no list), or NULL
+    size_t      reserve;    // Size of each reservation
+};
+
+/**
+ * Carve 'size' bytes from the group's reservation, reserving another run if it's used up.
+ * Each allocation but the first in a run is a split block, so the data is contiguous.
+ */
+static void* _alloc_group(alloc_group_t* group, size_t size)
+{
+    memblk_t* block;
+
+    if((signed long long int)size < 0)
+        return NULL;
+
+    size = size_class_round(size);
+    if(group->rest == NULL || group->rest->size < size)
+    {
+        // Whatever is left of the old run is too small for this; let anyone have it
+        if(group->rest != NULL)
+            _alloc_add_free(group->rest);
+
+        group->rest = _alloc_create_new_block((size > group->reserve) ? size : group->reserve, HEAP_ALIGN);
+        if(group->rest == NULL)
+            return NULL;
+    }
+
+    block = group->rest;
+    if(block->size > size)
+    {
+        memblk_t* split = _alloc_create_split_block(block->size - size, (uint8_t*)block->data + size);
+        if(split == NULL)
+            return NULL;
+        PROBE3(split, block->data, size, split->size);
+
+        block->size = size;
+        group->rest = split;
+    }
+    else
+    {
+        group->rest = NULL;
+    }
+
+    _alloc_add_allocated(block, thread_heap_self());
+
+    return block->data;
+}
+
+/**
+ * Everything the allocation entry points share once they have a pointer (or not): usage
+ * accounting, limits, sampling and leak tracking. Always inlined, so profiler backtraces
+ * still start at the caller.
+ */
+static inline __attribute__((always_inline)) void* _alloc_accounted(void* ptr, size_t size, void* site)
+{
+    if(ptr == NULL)
+    {
+        __atomic_sub_fetch(&usage.bytes_in_use, size, __ATOMIC_RELAXED);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // Both heaps round sizes up, and we count what dealloc() will give back
+    size_t in_use;
+    size_t usable = size;
+    if(!guard_owns(ptr))
+        usable = tlsf_owns(&tlsf_heap, ptr) ? tlsf_block_size(ptr) : size_class_round(size);
+    if(usable != size)
+    {
+        in_use = __atomic_add_fetch(&usage.bytes_in_use, usable - size, __ATOMIC_RELAXED);
+
+        // _alloc_reserve() only checked the request itself; the rounding may not fit either.
+        // dealloc() gives back all 'usable' bytes, leaving the count as it was.
+        if(hard_limit != 0 && in_use > hard_limit)
+        {
+            dealloc(ptr);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+    else
+    {
+        in_use = __atomic_load_n(&usage.bytes_in_use, __ATOMIC_RELAXED);
+    }
+
+    if(soft_limit != 0 && in_use > soft_limit && !usage.over_soft_limit)
+        _alloc_soft_limit_exceeded(in_use);
+
+    if(profiler_should_sample(size))
+        profiler_record_alloc(ptr, size);
+
+    if(leak_mode != ALLOC_LEAKS_OFF)
+        leak_record(ptr, size, site);
+
+    PROBE3(alloc, ptr, size, _alloc_method());
+    return ptr;
+}
+
+void* alloc(size_t size)
+{
+    if(!_alloc_reserve(size))
+        return NULL;
+
+    return _alloc_accounted(_alloc(size), size, __builtin_return_address(0));
+}
+
+void* alloc_cacheline(size_t size)
+{
+    if(!_alloc_reserve(size))
+        return NULL;
+
+    return _alloc_accounted(_alloc_aligned(size, ALLOC_CACHELINE), size, __builtin_return_address(0));
+}
+
+void* alloc_near(const void* hint, size_t size)
+{
+    if(!_alloc_reserve(size))
+        return NULL;
+
+    return _alloc_accounted(_alloc_near(hint, size), size, __builtin_return_address(0));
+}
+
+void* alloc_in_group(alloc_group_t* group, size_t size)
+{
+    if(!_alloc_reserve(size))
+        return NULL;
+
+    return _alloc_accounted(_alloc_group(group, size), size, __builtin_return_address(0));
+}
+
+alloc_group_t* alloc_group_create(size_t reserve)
+{
+    alloc_group_t* group = alloc(sizeof(alloc_group_t));
+    if(group == NULL)
+        return NULL;
+
+    _alloc_init();
+    group->rest = NULL;
+    group->reserve = size_class_round(reserve);
+
+    return group;
+}
+
+void alloc_group_destroy(alloc_group_t* group)
+{
+    if(group == NULL)
+        return;
+
+    if(group->rest != NULL)
+        _alloc_add_free(group->rest);
+    dealloc(group);
+}
+
+void* alloc_aligned(size_t size, size_t align)
+{
+    if(align == 0 || (align & (align - 1)) != 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if(!_alloc_reserve(size))
+        return NULL;
+
+    void* ptr = (align > HEAP_ALIGN) ? _alloc_aligned(size, align) : _alloc(size);
+    return _alloc_accounted(ptr, size, __builtin_return_address(0));
 }
 
 void dealloc(void* chunk)
@@ -467,17 +1182,47 @@ void dealloc(void* chunk)
     if(chunk == NULL)
         return;
 
-    // Let's try and find this block in the allocated list
-    rwlock_rdlock(&alloc_list.lock);
-    memblk_t* block = alloc_list.head;
+    if(profiler_live != 0)
+        profiler_record_free(chunk);
+
+    if(leak_tracked)
+        leak_forget(chunk);
+
+    // Sampled blocks live in the guard slot pool, outside every other heap
+    if(guard_owns(chunk))
+    {
+        PROBE3(dealloc, chunk, guard_size(chunk), 0);
+        _alloc_release_bytes(guard_size(chunk));
+        guard_free(chunk);
+        return;
+    }
+
+    // Blocks from the TLSF heap carry their own header, so they can be freed straight away
+    if(tlsf_owns(&tlsf_heap, chunk))
+    {
+        PROBE3(dealloc, chunk, tlsf_block_size(chunk), 0);
+        _alloc_release_bytes(tlsf_block_size(chunk));
+
+        pthread_mutex_lock(&tlsf_lock);
+        tlsf_free(&tlsf_heap, chunk);
+        pthread_mutex_unlock(&tlsf_lock);
+        return;
+    }
+
+    // Let's try and find this block in its shard's allocated list
+    struct alloc_shard* shard = _alloc_shard_of(chunk);
+    size_t searched = 0;
+    rwlock_rdlock(&shard->alloc_list.lock);
+    memblk_t* block = shard->alloc_list.head;
     while(block != NULL)
     {
+        searched++;
         if(block->data == chunk)
             break;
         
         block = block->next;
     }
-    rwlock_unlock(&alloc_list.lock);
+    rwlock_unlock(&shard->alloc_list.lock);
 
     if(block == NULL)
     {
@@ -486,40 +1231,109 @@ void dealloc(void* chunk)
         printf("dealloc(): Unable to find block for pointer %p!\n", chunk);
         abort();
     }
+
+    // A block freed by another thread stays on the allocated list until its owner drains
+    // its remote queue, so finding it there doesn't mean it hasn't been freed already
+    if(__atomic_fetch_or(&block->flags, BLOCK_FREED, __ATOMIC_ACQ_REL) & BLOCK_FREED)
+    {
+        printf("dealloc(): double free of pointer %p!\n", chunk);
+        abort();
+    }
+
+    PROBE3(dealloc, chunk, block->size, searched);
+    _alloc_release_bytes(block->size);
+
+    if(block->owner != NULL && block->owner != thread_heap_self() &&
+            !__atomic_load_n(&block->owner->orphaned, __ATOMIC_ACQUIRE))
+    {
+        // Another thread allocated this block. Rather than fight it for the list locks,
+        // hand the block back to it; it will free the block on its next alloc().
+        thread_heap_push_remote(block->owner, block);
+    }
     else
     {
         // At this point, we know that:
         //      The pointer at 'chunk' was a valid allocated pointer
         //      We know where the block is
         // Let's remove this block from the chain
-        rwlock_wrlock(&alloc_list.lock);
-        list_delete_block(&alloc_list, block);
-        num_allocated--;
-        rwlock_unlock(&alloc_list.lock);
+        rwlock_wrlock(&shard->alloc_list.lock);
+        list_delete_block(&shard->alloc_list, block);
+        shard->num_allocated--;
+        rwlock_unlock(&shard->alloc_list.lock);
+
+        // Now let's add it to the free list (or our cache, if it's one of our private blocks)
+        if((block->flags & BLOCK_PRIVATE) && block->owner != NULL && block->owner == thread_heap_self())
+            thread_heap_cache_push(block->owner, block);
+        else
+            _alloc_add_free(block);
+    }
+}
+
+#ifdef ALLOC_DEBUG
+/**
+ * Size of the allocated list block whose data is at 'chunk' (0 if there isn't one)
+ */
+static size_t _alloc_block_size(void* chunk)
+{
+    struct alloc_shard* shard = _alloc_shard_of(chunk);
+    size_t              size = 0;
 
-        // Now let's add it to the free list
-        rwlock_wrlock(&free_list.lock);
-        list_append_block(&free_list, block);
-        num_free++;
-        rwlock_unlock(&free_list.lock);
+    rwlock_rdlock(&shard->alloc_list.lock);
+    for(memblk_t* block = shard->alloc_list.head; block != NULL; block = block->next)
+    {
+        if(block->data == chunk)
+        {
+            size = block->size;
+            break;
+        }
     }
+    rwlock_unlock(&shard->alloc_list.lock);
+
+    return size;
+}
+#endif
+
+void dealloc_sized(void* chunk, size_t size)
+{
+#ifdef ALLOC_DEBUG
+    // Every heap rounds up, so the block must be at least as big as the caller thinks
+    if(chunk != NULL && !guard_owns(chunk) && !tlsf_owns(&tlsf_heap, chunk) &&
+            size_class_round(size) > _alloc_block_size(chunk))
+    {
+        printf("dealloc_sized(): %p was not allocated with size %ld!\n", chunk, size);
+        abort();
+    }
+#else
+    (void)size;
+#endif
+
+    dealloc(chunk);
 }
 
 size_t average_allocated_size()
 {
     double      ret;
     double      sum = 0;
-    rwlock_rdlock(&alloc_list.lock);
-    memblk_t*   block = alloc_list.head;
+    size_t      count = 0;
 
-    while(block != NULL)
+    for(size_t i = 0; i < ALLOC_SHARDS; i++)
     {
-        sum += block->size;
-        block = block->next;
+        rwlock_rdlock(&shards[i].alloc_list.lock);
+        for(memblk_t* block = shards[i].alloc_list.head; block != NULL; block = block->next)
+            sum += block->size;
+        count += shards[i].num_allocated;
+        rwlock_unlock(&shards[i].alloc_list.lock);
     }
-    rwlock_unlock(&alloc_list.lock);
 
-    ret = floor(sum / num_allocated);
+    pthread_mutex_lock(&tlsf_lock);
+    sum += tlsf_heap.used_bytes;
+    count += tlsf_heap.num_used;
+    pthread_mutex_unlock(&tlsf_lock);
+
+    if(count == 0)
+        return 0;
+
+    ret = floor(sum / count);
 
     return (size_t)ret;
 }
@@ -528,40 +1342,558 @@ size_t average_free_size()
 {
     double      ret;
     double      sum = 0;
-    rwlock_rdlock(&free_list.lock);
-    memblk_t*   block = free_list.head;
+    size_t      count = 0;
 
-    while(block != NULL)
+    for(size_t i = 0; i < ALLOC_SHARDS; i++)
     {
-        sum += block->size;
-        block = block->next;
+        rwlock_rdlock(&shards[i].free_list.lock);
+        for(memblk_t* block = shards[i].free_list.head; block != NULL; block = block->next)
+            sum += block->size;
+        count += shards[i].num_free;
+        rwlock_unlock(&shards[i].free_list.lock);
     }
-    rwlock_unlock(&free_list.lock);
-    ret = floor(sum / num_allocated);
+
+    pthread_mutex_lock(&tlsf_lock);
+    sum += tlsf_heap.free_bytes;
+    count += tlsf_heap.num_free;
+    pthread_mutex_unlock(&tlsf_lock);
+
+    if(count == 0)
+        return 0;
+
+    ret = floor(sum / count);
 
     return (size_t)ret;
 }
 
 size_t number_of_allocated_blocks()
 {
-    return num_allocated;
+    size_t count = tlsf_heap.num_used;
+
+    for(size_t i = 0; i < ALLOC_SHARDS; i++)
+        count += __atomic_load_n(&shards[i].num_allocated, __ATOMIC_RELAXED);
+
+    return count;
 }
 
 size_t number_of_free_blocks()
 {
-    return num_free;
+    size_t count = tlsf_heap.num_free;
+
+    for(size_t i = 0; i < ALLOC_SHARDS; i++)
+        count += __atomic_load_n(&shards[i].num_free, __ATOMIC_RELAXED);
+
+    return count;
 }
 
-void print_free_block_sizes()
+size_t number_of_remote_frees()
 {
-    rwlock_rdlock(&free_list.lock);
-    memblk_t* block = free_list.head;
+    return thread_heap_remote_frees();
+}
 
-    while(block != NULL)
+/**
+ * If 'next' starts where 'block' ends, return the end of 'next' (so the size of the
+ * merged block is the return value - block->data). Otherwise return NULL.
+ *
+ * Blocks made by _alloc_create_new_block() have their node directly in front of their
+ * data (padded out to HEAP_ALIGN), so those are adjacent if 'block' runs up to the node.
+ * Split blocks have their node elsewhere, and are adjacent if 'block' runs up to the data.
+ * Blocks padded out for alloc_aligned() look like split blocks here; nothing ends at their
+ * data, so they're never merged into the block in front of them.
+ */
+static uint8_t* _alloc_adjacent_end(memblk_t* block, memblk_t* next)
+{
+    uint8_t* end = (uint8_t*)block->data + block->size;
+    uint8_t* next_end = (uint8_t*)next->data + next->size;
+
+    if(next->data == (uint8_t*)next + sizeof(memblk_t))
     {
-        printf("%ld -> ", block->size);
-        block = block->next;
+        uint8_t* padded = (uint8_t*)(((uintptr_t)end + HEAP_ALIGN - 1) & ~(uintptr_t)(HEAP_ALIGN - 1));
+        if(padded == (uint8_t*)next)
+            return next_end;
+    }
+    else if(end == next->data)
+    {
+        return next_end;
+    }
+
+    return NULL;
+}
+
+/**
+ * Coalesce one shard's free list. Blocks either side of a shard boundary belong to
+ * different shards, so they're never merged.
+ */
+static size_t _alloc_coalesce_shard(struct alloc_shard* shard)
+{
+    size_t      merged = 0;
+    memblk_t*   spare = NULL;
+
+    rwlock_wrlock(&shard->free_list.lock);
+    list_sort_by_address(&shard->free_list);
+
+    memblk_t* block = shard->free_list.head;
+    while(block != NULL && block->next != NULL)
+    {
+        memblk_t*   next = block->next;
+        uint8_t*    end = _alloc_adjacent_end(block, next);
+
+        // Blocks that are locked are in the middle of being allocated, so leave them be
+        if(end == NULL || pthread_mutex_trylock(&block->lock) != 0)
+        {
+            block = next;
+            continue;
+        }
+
+        if(pthread_mutex_trylock(&next->lock) != 0)
+        {
+            pthread_mutex_unlock(&block->lock);
+            block = next;
+            continue;
+        }
+
+        list_delete_block(&shard->free_list, next);
+        bins_resize(&shard->free_bins, block, end - (uint8_t*)block->data);
+        block->flags = 0;
+        shard->num_free--;
+        merged++;
+
+        pthread_mutex_unlock(&next->lock);
+        pthread_mutex_destroy(&next->lock);
+
+        // If the node lived in front of its data, it's now part of 'block'. Otherwise
+        // it's a split node, and can be recycled.
+        if(next->data != (uint8_t*)next + sizeof(memblk_t))
+        {
+            next->next = spare;
+            spare = next;
+        }
+
+        // Stay on 'block'; it may now reach the block after 'next' as well
+        pthread_mutex_unlock(&block->lock);
+    }
+    rwlock_unlock(&shard->free_list.lock);
+
+    if(spare != NULL)
+    {
+        pthread_mutex_lock(&spare_lock);
+        while(spare != NULL)
+        {
+            memblk_t* next = spare->next;
+            spare->next = spare_nodes;
+            spare_nodes = spare;
+            spare = next;
+        }
+        pthread_mutex_unlock(&spare_lock);
+    }
+
+    return merged;
+}
+
+size_t allocator_coalesce()
+{
+    size_t merged = 0;
+
+    _alloc_init();
+
+    for(size_t i = 0; i < ALLOC_SHARDS; i++)
+        merged += _alloc_coalesce_shard(&shards[i]);
+
+    return merged;
+}
+
+size_t allocator_trim()
+{
+    size_t  page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t  trimmed = 0;
+
+    _alloc_init();
+
+    // Only a read lock is needed, as each block we advise is locked for the duration
+    // (so nobody can allocate it out from under us).
+    for(size_t i = 0; i < ALLOC_SHARDS; i++)
+    {
+        list_t* free_list = &shards[i].free_list;
+
+        rwlock_rdlock(&free_list->lock);
+        for(memblk_t* block = free_list->head; block != NULL; block = block->next)
+        {
+            if((block->flags & BLOCK_TRIMMED) || block->size < 2 * page_size)
+                continue;
+
+            uintptr_t start = ((uintptr_t)block->data + page_size - 1) & ~(uintptr_t)(page_size - 1);
+            uintptr_t end   = ((uintptr_t)block->data + block->size) & ~(uintptr_t)(page_size - 1);
+            if(end <= start || pthread_mutex_trylock(&block->lock) != 0)
+                continue;
+
+            if(madvise((void*)start, end - start, MADV_DONTNEED) == 0)
+            {
+                trimmed += end - start;
+                block->flags |= BLOCK_TRIMMED;
+            }
+            pthread_mutex_unlock(&block->lock);
+        }
+        rwlock_unlock(&free_list->lock);
+    }
+
+    PROBE1(trim, trimmed);
+    return trimmed;
+}
+
+size_t allocator_flush_thread_caches()
+{
+    size_t flushed = 0;
+
+    _alloc_init();
+
+    for(thread_heap_t* heap = thread_heap_list(); heap != NULL; heap = heap->next)
+    {
+        // An exited thread's private blocks would sit idle until a new thread adopted its heap
+        if(__atomic_load_n(&heap->orphaned, __ATOMIC_ACQUIRE) &&
+           (heap->cache_count != 0 || heap->span_top != heap->span_end) &&
+           thread_heap_claim_orphan(heap))
+        {
+            _alloc_release_private(heap);
+            _alloc_release_span(heap);
+            thread_heap_unclaim(heap);
+            flushed++;
+        }
+
+        memblk_t* head = __atomic_load_n(&heap->remote, __ATOMIC_ACQUIRE);
+        if(head == NULL)
+            continue;
+
+        // A heap is idle if its queue hasn't changed since we last looked (so the owner
+        // hasn't allocated in the meantime). Orphans are always fair game.
+        if(head == heap->seen_remote || __atomic_load_n(&heap->orphaned, __ATOMIC_ACQUIRE))
+        {
+            _alloc_drain_remote(heap, false);
+            heap->seen_remote = NULL;
+            flushed++;
+        }
+        else
+        {
+            heap->seen_remote = head;
+        }
+    }
+
+    return flushed;
+}
+
+void print_free_block_sizes()
+{
+    for(size_t i = 0; i < ALLOC_SHARDS; i++)
+    {
+        rwlock_rdlock(&shards[i].free_list.lock);
+        memblk_t* block = shards[i].free_list.head;
+
+        while(block != NULL)
+        {
+            printf("%ld -> ", block->size);
+            block = block->next;
+        }
+        rwlock_unlock(&shards[i].free_list.lock);
     }
-    rwlock_unlock(&free_list.lock);
     printf("\n");
-}
\ No newline at end of file
+}
+/**
+ * A batch of blocks copied out of the heap during a walk
+ */
+struct walk_batch
+{
+    alloc_block_info_t  info[ALLOC_WALK_BATCH];
+    memblk_t*           blocks[ALLOC_WALK_BATCH];   // The block each entry came from (list walks only)
+    uint64_t            seqs[ALLOC_WALK_BATCH];     // The block's 'seq' when we copied it
+    size_t              count;
+};
+
+static bool _alloc_walk_callbacks(struct walk_batch* batch, alloc_walk_fn callback, void* ctx)
+{
+    for(size_t i = 0; i < batch->count; i++)
+    {
+        if(callback(&batch->info[i], ctx))
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * Walk one of the block lists in batches.
+ *
+ * Each batch picks up after the most recent block from the previous batch that is still
+ * on the list (and hasn't been re-appended since). If all of those have moved on, we've
+ * lost our place, so we skip as many blocks from the head as we have already visited.
+ *
+ * Returns false if the callback stopped the walk.
+ */
+static bool _alloc_walk_list(list_t* list, int in_use, alloc_walk_fn callback, void* ctx, struct walk_batch* batch)
+{
+    size_t  visited = 0;
+    bool    first = true;
+    bool    done;
+
+    do
+    {
+        memblk_t* block = NULL;
+
+        rwlock_rdlock(&list->lock);
+        if(first)
+        {
+            block = list->head;
+        }
+        else
+        {
+            size_t i;
+            for(i = batch->count; i > 0; i--)
+            {
+                memblk_t* last = batch->blocks[i - 1];
+                if(last->list == list && last->seq == batch->seqs[i - 1])
+                {
+                    block = last->next;
+                    break;
+                }
+            }
+
+            if(i == 0)
+            {
+                block = list->head;
+                for(size_t skip = visited; block != NULL && skip > 0; skip--)
+                    block = block->next;
+            }
+        }
+
+        batch->count = 0;
+        while(block != NULL && batch->count < ALLOC_WALK_BATCH)
+        {
+            batch->info[batch->count].ptr       = block->data;
+            batch->info[batch->count].size      = block->size;
+            batch->info[batch->count].in_use    = in_use;
+            batch->blocks[batch->count]         = block;
+            batch->seqs[batch->count]           = block->seq;
+            batch->count++;
+            block = block->next;
+        }
+        done = (block == NULL);
+        rwlock_unlock(&list->lock);
+
+        first = false;
+        visited += batch->count;
+        if(!_alloc_walk_callbacks(batch, callback, ctx))
+            return false;
+    } while(!done);
+
+    return true;
+}
+
+static bool _alloc_walk_tlsf_collect(void* ptr, size_t size, bool used, void* ctx)
+{
+    struct walk_batch* batch = ctx;
+
+    batch->info[batch->count].ptr       = ptr;
+    batch->info[batch->count].size      = size;
+    batch->info[batch->count].in_use    = used;
+    batch->count++;
+
+    return true;
+}
+
+/**
+ * Walk the TLSF heap, pool by pool, in batches.
+ *
+ * TLSF blocks are found by walking physically, so a batch can resume directly from where
+ * the last one stopped, unless a free has merged headers away in the meantime. In that
+ * case we walk the pool again from the start, passing over everything below our old
+ * resume point.
+ */
+static bool _alloc_walk_tlsf(alloc_walk_fn callback, void* ctx, struct walk_batch* batch)
+{
+    size_t num_pools = __atomic_load_n(&tlsf_heap.num_pools, __ATOMIC_ACQUIRE);
+
+    for(size_t pool = 0; pool < num_pools; pool++)
+    {
+        void*       resume = NULL;
+        const void* skip_below = NULL;
+        uint64_t    merges = 0;
+        bool        first = true;
+
+        do
+        {
+            batch->count = 0;
+
+            pthread_mutex_lock(&tlsf_lock);
+            if(!first && tlsf_heap.merges != merges)
+            {
+                skip_below = resume;
+                resume = NULL;
+            }
+            resume = tlsf_walk_pool(&tlsf_heap, pool, resume, skip_below, ALLOC_WALK_BATCH,
+                                    _alloc_walk_tlsf_collect, batch);
+            merges = tlsf_heap.merges;
+            pthread_mutex_unlock(&tlsf_lock);
+
+            first = false;
+            if(!_alloc_walk_callbacks(batch, callback, ctx))
+                return false;
+        } while(resume != NULL);
+    }
+
+    return true;
+}
+
+void allocator_walk(alloc_walk_fn callback, void* ctx)
+{
+    struct walk_batch batch;
+
+    _alloc_init();
+
+    if(callback == NULL)
+        return;
+
+    for(size_t i = 0; i < ALLOC_SHARDS; i++)
+    {
+        if(!_alloc_walk_list(&shards[i].alloc_list, 1, callback, ctx, &batch))
+            return;
+    }
+
+    for(size_t i = 0; i < ALLOC_SHARDS; i++)
+    {
+        if(!_alloc_walk_list(&shards[i].free_list, 0, callback, ctx, &batch))
+            return;
+    }
+
+    _alloc_walk_tlsf(callback, ctx, &batch);
+}
+
+static int _alloc_frag_callback(const alloc_block_info_t* block, void* ctx)
+{
+    alloc_frag_t* frag = ctx;
+
+    if(block->in_use)
+    {
+        frag->used_blocks++;
+        frag->used_bytes += block->size;
+        return 0;
+    }
+
+    frag->free_blocks++;
+    frag->free_bytes += block->size;
+    if(block->size > frag->largest_free)
+        frag->largest_free = block->size;
+
+    int bucket = (block->size == 0) ? 0 : 63 - __builtin_clzll((unsigned long long)block->size);
+    if(bucket >= ALLOC_FRAG_BUCKETS)
+        bucket = ALLOC_FRAG_BUCKETS - 1;
+    frag->histogram[bucket]++;
+
+    return 0;
+}
+
+void allocator_fragmentation(alloc_frag_t* frag)
+{
+    memset(frag, 0, sizeof(alloc_frag_t));
+    allocator_walk(_alloc_frag_callback, frag);
+
+    if(frag->free_bytes > 0)
+        frag->external_fragmentation = 1.0 - (double)frag->largest_free / (double)frag->free_bytes;
+}
+
+/**
+ * On-disk format of the heap map (see allocator_dump_heap_map())
+ */
+struct heap_map_header
+{
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    record_size;
+    uint64_t    heap_start;
+    uint64_t    heap_end;
+    uint64_t    num_records;
+};
+
+struct heap_map_record
+{
+    uint64_t    address;
+    uint64_t    size;
+    uint32_t    in_use;
+    uint32_t    reserved;
+};
+
+#define HEAP_MAP_BUFFERED   256
+
+struct heap_map_ctx
+{
+    int                     fd;
+    int                     error;          // errno of the first failed write (0 if none)
+    struct heap_map_header  header;
+    struct heap_map_record  records[HEAP_MAP_BUFFERED];
+    size_t                  count;          // Records in 'records'
+};
+
+static void _alloc_heap_map_flush(struct heap_map_ctx* map)
+{
+    size_t len = map->count * sizeof(struct heap_map_record);
+
+    if(map->count > 0 && map->error == 0 && write(map->fd, map->records, len) != (ssize_t)len)
+        map->error = errno ? errno : EIO;
+
+    map->count = 0;
+}
+
+static int _alloc_heap_map_callback(const alloc_block_info_t* block, void* ctx)
+{
+    struct heap_map_ctx*    map = ctx;
+    uint64_t                start = (uintptr_t)block->ptr;
+    uint64_t                end = start + block->size;
+
+    if(map->header.num_records == 0 || start < map->header.heap_start)
+        map->header.heap_start = start;
+    if(end > map->header.heap_end)
+        map->header.heap_end = end;
+
+    map->records[map->count].address    = start;
+    map->records[map->count].size       = block->size;
+    map->records[map->count].in_use     = block->in_use ? 1 : 0;
+    map->records[map->count].reserved   = 0;
+    map->header.num_records++;
+
+    if(++map->count == HEAP_MAP_BUFFERED)
+        _alloc_heap_map_flush(map);
+
+    return map->error != 0;
+}
+
+int allocator_dump_heap_map(const char* path)
+{
+    struct heap_map_ctx map;
+
+    memset(&map, 0, sizeof(struct heap_map_ctx));
+    memcpy(map.header.magic, "MV2HMAP", 8);
+    map.header.version      = 1;
+    map.header.record_size  = sizeof(struct heap_map_record);
+
+    map.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(map.fd < 0)
+        return -1;
+
+    // Leave room for the header, which we can only fill in once we've seen every block
+    if(lseek(map.fd, sizeof(struct heap_map_header), SEEK_SET) < 0)
+        map.error = errno;
+
+    allocator_walk(_alloc_heap_map_callback, &map);
+    _alloc_heap_map_flush(&map);
+
+    if(map.error == 0 &&
+       pwrite(map.fd, &map.header, sizeof(struct heap_map_header), 0) != sizeof(struct heap_map_header))
+        map.error = errno ? errno : EIO;
+
+    close(map.fd);
+
+    if(map.error != 0)
+    {
+        errno = map.error;
+        return -1;
+    }
+
+    return 0;
+}
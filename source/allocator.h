@@ -5,13 +5,20 @@
 #ifndef _ALLOCATOR_H_
 #define _ALLOCATOR_H_
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 typedef enum
 {
     ALLOC_FF,   /** First fit allocation strategy */
     ALLOC_BF,   /** Best fit allocation strategy */
-    ALLOC_WF    /** Worst fit allocation strategy */
+    ALLOC_WF,   /** Worst fit allocation strategy */
+    ALLOC_TLSF  /** Two-level segregated fit (bounded time) allocation strategy */
 } alloc_method_t;
 
 /**
@@ -19,8 +26,154 @@ typedef enum
  */
 void allocator_set_method(alloc_method_t method);
 
+/**
+ *  Set the allocation strategy for the calling thread only.
+ *
+ *  This overrides allocator_set_method() for this thread, and is how real-time
+ *  request threads should opt in to ALLOC_TLSF, where worst-case allocation time
+ *  matters more than packing.
+ */
+void allocator_set_thread_method(alloc_method_t method);
+
+/**
+ *  Back the heap with a 'bytes' sized, 2 MiB aligned mapping that uses transparent huge pages
+ *  (via madvise(MADV_HUGEPAGE)) to cut dTLB misses on large heaps. Blocks and TLSF pools are
+ *  carved from this mapping first, and the allocator falls back to sbrk() once it is used up,
+ *  or if huge pages are unavailable.
+ *
+ *  Must be called before allocator_init() or the first allocation. 0 (the default) disables it.
+ */
+void allocator_set_hugepage_heap(size_t bytes);
+
+/**
+ *  Run a background maintenance thread that periodically hands back blocks stuck in idle
+ *  threads' remote free queues, re-sorts and coalesces the free list, and trims free pages
+ *  back to the OS, so that work stays off the alloc()/dealloc() path.
+ *
+ *  'interval_ms' is the time between passes, and 'cpu_budget_pct' caps the share of a CPU the
+ *  thread may use (passes are spaced further apart when they run long). The thread starts at
+ *  allocator_init() (or the first allocation), or straight away if the allocator is already
+ *  running. An interval of 0 (the default) means no maintenance thread.
+ */
+void allocator_set_maintenance(unsigned interval_ms, unsigned cpu_budget_pct);
+
+/**
+ *  Put 1 in every 'rate' allocations (of up to a page) in a slot of its own, between two
+ *  PROT_NONE guard pages, so an overflow or use after free on a sampled block faults at once
+ *  and reports the block along with where it was allocated and freed. The slots come from a
+ *  fixed pool of 'slots' pages (0 for the default of 64), so the cost stays small enough to
+ *  leave on in production. A rate of 0 (the default) turns sampling off.
+ */
+void allocator_set_guard_sampling(unsigned rate, size_t slots);
+
+#define ALLOC_PROFILE_DEFAULT_RATE  (512 * 1024)
+
+/**
+ *  Sample roughly one allocation every 'sample_rate' bytes (ALLOC_PROFILE_DEFAULT_RATE is a
+ *  good default) and record its call stack, so the heap profile can show which call sites
+ *  own live memory, and which allocate the most overall. The gaps between samples are random
+ *  (exponentially distributed), so allocation patterns can't hide from the sampler. Only
+ *  sampled allocations pay for a backtrace. A rate of 0 (the default) turns profiling off.
+ */
+void allocator_set_heap_profiling(size_t sample_rate);
+
+/**
+ *  Write the heap profile to 'path', in the legacy pprof heap format ("heap_v2"), so it
+ *  can be read with 'pprof <binary> <path>'. Each stack has its live and cumulative sample
+ *  counts and bytes; pprof scales these back up to estimates using the sample rate.
+ *
+ *  Returns 0 on success, or -1 (with errno set) on failure.
+ */
+int allocator_dump_heap_profile(const char* path);
+
+/**
+ *  Dump the heap profile to "<prefix>.<pid>.<n>.heap" every time the process receives
+ *  signal 'signo' (SIGUSR2, say). Returns 0 on success, or -1 (with errno set) on failure.
+ */
+int allocator_dump_heap_profile_on_signal(int signo, const char* prefix);
+
+typedef enum
+{
+    ALLOC_LEAKS_OFF,        /** No leak tracking (the default) */
+    ALLOC_LEAKS_SITES,      /** Record the call site of every allocation */
+    ALLOC_LEAKS_BACKTRACES  /** Record a full backtrace for every allocation as well */
+} alloc_leak_mode_t;
+
+/**
+ *  Track live allocations, and print a report of every block still allocated when the
+ *  process exits, grouped by the call site that allocated it and sorted by bytes. Call sites
+ *  are just the return address of alloc(), so ALLOC_LEAKS_SITES is cheap; ALLOC_LEAKS_BACKTRACES
+ *  takes a backtrace on every allocation, and prints one for each call site in the report.
+ *  Only allocations made while tracking is on are attributed to a call site.
+ */
+void allocator_set_leak_report(alloc_leak_mode_t mode);
+
+/**
+ *  Print the leak report now (see allocator_set_leak_report())
+ */
+void allocator_leak_report();
+
+#define ALLOC_MAX_LIMIT_CALLBACKS   8
+
+/**
+ *  Called when usage goes over a soft limit. 'in_use' is the usage that crossed 'limit'.
+ */
+typedef void (*alloc_limit_fn)(size_t in_use, size_t limit, void* ctx);
+
+/**
+ *  Limit the number of bytes the process can have allocated at once (0 for no limit).
+ *
+ *  Past 'hard', alloc() fails and returns NULL (with errno set to ENOMEM), so callers can back
+ *  off rather than the process being OOM killed. Crossing 'soft' flushes the thread caches,
+ *  coalesces and trims the heap, then runs the soft limit callbacks; it fires again once usage
+ *  has dropped back under the limit and crossed it again.
+ */
+void allocator_set_limits(size_t soft, size_t hard);
+
+/**
+ *  Register a callback to run when the soft limit is crossed (up to ALLOC_MAX_LIMIT_CALLBACKS).
+ *  Returns 0 on success, or -1 if there's no room left.
+ */
+int allocator_add_soft_limit_callback(alloc_limit_fn fn, void* ctx);
+
+/**
+ *  Get the number of bytes currently allocated (as counted against the limits)
+ */
+size_t allocator_bytes_in_use();
+
+/**
+ *  Get the number of bytes the heap has taken from the OS, in use or not
+ */
+size_t allocator_heap_bytes();
+
+/**
+ *  Stop the maintenance thread (if there is one)
+ */
+void allocator_stop_maintenance();
+
 /**
  *  Initialise the allocator
+ *
+ *  This is also when the MALLOCV2_CONF environment variable is read, so a program can be
+ *  tuned without rebuilding it. It's a comma separated list of 'option:value' pairs, e.g.
+ *
+ *      MALLOCV2_CONF="strategy:best,maintenance:50,soft_limit:512m"
+ *
+ *      strategy            first, best, worst or tlsf          (allocator_set_method())
+ *      isolate             0 or 1                              (allocator_set_cacheline_isolation())
+ *      hugepages           size of the huge page heap          (allocator_set_hugepage_heap())
+ *      maintenance         interval in ms                      (allocator_set_maintenance())
+ *      maintenance_budget  CPU budget in percent, with 'maintenance'
+ *      guard               sampling rate                       (allocator_set_guard_sampling())
+ *      guard_slots         number of guard slots, with 'guard'
+ *      profile             sampling rate in bytes              (allocator_set_heap_profiling())
+ *      leaks               off, sites (or 1) or full           (allocator_set_leak_report())
+ *      soft_limit          size                                (allocator_set_limits())
+ *      hard_limit          size
+ *
+ *  Sizes and counts take a k, m or g suffix. Settings from the environment override those
+ *  made by the program before initialisation. Unknown options and bad values are reported
+ *  on stderr and ignored.
  */
 void allocator_init();
 
@@ -34,6 +187,183 @@ void* alloc(size_t);
  */
 void dealloc(void*);
 
+/**
+ * Allocate 'size' bytes aligned to 'align' (a power of two). Alignments up to 16 bytes
+ * are what alloc() gives anyway; larger ones get a padded block of their own.
+ * Returns NULL (with errno set) on failure, or EINVAL if 'align' isn't a power of two.
+ */
+void* alloc_aligned(size_t size, size_t align);
+
+/**
+ * Deallocate a chunk of memory, given the size it was allocated with (for callers that
+ * know it anyway, like C++ sized delete). Debug builds check the size against the block.
+ */
+void dealloc_sized(void*, size_t size);
+
+/**
+ * Cache line isolation
+ *
+ * Objects that different threads write to should never share a cache line. With isolation
+ * on, each thread carves its small blocks (up to 1 KiB) from spans of its own, and keeps
+ * them in a per-thread cache once they're freed, so they're only ever reused by the same
+ * thread. Blocks freed after their thread has exited go back to the shared free lists.
+ * Cached blocks aren't on the free lists, so the free block statistics don't count them.
+ *
+ * alloc_cacheline() isolates a single object, whatever the mode: its data starts on a
+ * cache line, and nothing else is placed on the lines it covers.
+ */
+#define ALLOC_CACHELINE     64
+
+/**
+ * Turn cache line isolation on or off (it's off by default)
+ */
+void allocator_set_cacheline_isolation(bool enable);
+
+/**
+ * Allocate 'size' bytes on cache lines of their own
+ */
+void* alloc_cacheline(size_t size);
+
+/**
+ * Locality hints
+ *
+ * Linked structures built with alloc() land wherever the free lists happen to have room.
+ * alloc_near() takes the free block closest to 'hint' (an earlier allocation) instead,
+ * preferring one in the same page; it looks at up to ALLOC_NEAR_SCAN of the most recently
+ * freed blocks around the hint, and falls back to alloc() if none of them fit (or if the
+ * hint is NULL, or isn't on the list heap).
+ *
+ * An allocation group reserves a run of memory up front, and carves the allocations made
+ * through it one after another, so a structure built through one group is contiguous.
+ * Group allocations are freed with dealloc() like any other; destroying the group only
+ * gives back the part of its reservation it never handed out. A group is not thread safe.
+ */
+#define ALLOC_NEAR_SCAN     1024
+
+/**
+ * Allocate 'size' bytes as close to 'hint' as the free lists allow
+ */
+void* alloc_near(const void* hint, size_t size);
+
+typedef struct alloc_group alloc_group_t;
+
+/**
+ * Create a group that reserves 'reserve' bytes at a time. Returns NULL if out of memory.
+ */
+alloc_group_t* alloc_group_create(size_t reserve);
+
+/**
+ * Allocate 'size' bytes from a group, right after the previous allocation if it fits
+ */
+void* alloc_in_group(alloc_group_t*, size_t size);
+
+/**
+ * Destroy a group (allocations made from it stay valid)
+ */
+void alloc_group_destroy(alloc_group_t*);
+
+/**
+ * Regions (arenas)
+ *
+ * A region hands out memory by bumping a pointer through large chunks that it gets
+ * from alloc(). Individual allocations are never freed; instead the whole region is
+ * reset (or destroyed) at once, which is ideal for request-scoped data. Chunks are
+ * kept across region_reset(), so a region that is reused for every request stops
+ * touching the allocator entirely once it has warmed up.
+ *
+ * A region is not thread safe; give each thread (or request) its own.
+ */
+typedef struct region region_t;
+
+/**
+ * Create a region with room for 'initial' bytes before it needs to grow.
+ */
+region_t* region_create(size_t initial);
+
+/**
+ * Allocate 'size' bytes (16 byte aligned) from a region.
+ */
+void* region_alloc(region_t*, size_t size);
+
+/**
+ * Limit the number of bytes that can be allocated from a region between resets (0 for no
+ * limit). Past 'hard', region_alloc() returns NULL. The first allocation to cross 'soft'
+ * calls 'fn' (if it isn't NULL); it is re-armed by region_reset(). Region chunks also count
+ * towards the global limits (see allocator_set_limits()).
+ */
+void region_set_limits(region_t*, size_t soft, size_t hard, alloc_limit_fn fn, void* ctx);
+
+/**
+ * Get the number of bytes allocated from a region since it was created (or last reset)
+ */
+size_t region_bytes_in_use(region_t*);
+
+/**
+ * Free every allocation made from the region in O(1). The region keeps its chunks.
+ */
+void region_reset(region_t*);
+
+/**
+ * Free every allocation made from the region, and the region itself.
+ */
+void region_destroy(region_t*);
+
+/**
+ * Object pools
+ *
+ * A pool hands out fixed size objects from slabs it carves itself. Objects are spaced
+ * so that no object smaller than a cache line straddles two of them, and each thread
+ * keeps a small cache of objects in front of the pool's shared free list, so the common
+ * pool_get()/pool_put() is a push or pop on thread-local memory with no size lookup or
+ * list search.
+ *
+ * Objects may be put back from any thread. Pools themselves are created and destroyed
+ * by one thread; don't destroy a pool other threads are still using.
+ */
+typedef struct pool pool_t;
+
+/**
+ * Create a pool of 'obj_size' byte objects aligned to 'align' bytes (a power of two, or
+ * 0 for the default 16 byte alignment). Returns NULL if the pool table is full.
+ */
+pool_t* pool_create(size_t obj_size, size_t align);
+
+/**
+ * Get an object from a pool
+ */
+void* pool_get(pool_t*);
+
+/**
+ * Return an object to the pool it came from
+ */
+void pool_put(pool_t*, void*);
+
+/**
+ * Destroy a pool, freeing every object in it
+ */
+void pool_destroy(pool_t*);
+
+
+/**
+ * Sort each shard's free list by address, and merge free blocks that are next to each other.
+ * Returns the number of merges. (This is one step of a maintenance pass.)
+ */
+size_t allocator_coalesce();
+
+/**
+ * Hand the whole pages inside large free blocks back to the OS. Returns the number of
+ * bytes trimmed. (This is one step of a maintenance pass.)
+ */
+size_t allocator_trim();
+
+/**
+ * Free the blocks sitting in the remote free queues of idle (or exited) threads, and give
+ * exited threads' private blocks (see allocator_set_cacheline_isolation()) back to the
+ * free lists. Returns the number of thread heaps flushed. (This is one step of a
+ * maintenance pass.)
+ */
+size_t allocator_flush_thread_caches();
+
 
 /**
  * The following are a few special functions to help with the report
@@ -65,6 +395,261 @@ size_t number_of_allocated_blocks();
  */
 size_t number_of_free_blocks();
 
+/**
+ * Get the number of blocks deallocated by a thread other than the one that allocated
+ * them (and so handed back to the owner through its remote free queue)
+ */
+size_t number_of_remote_frees();
+
+/**
+ * The list strategies split their blocks over ALLOC_SHARDS shards (by address), each
+ * with its own locks. These are the counts for one shard.
+ */
+#define ALLOC_SHARDS    8
+
+typedef struct
+{
+    size_t      allocated_blocks;   /** Number of allocated blocks in the shard */
+    size_t      free_blocks;        /** Number of free blocks in the shard */
+    uint64_t    alloc_contended;    /** Times a thread had to wait for the shard's allocated list lock */
+    uint64_t    free_contended;     /** Times a thread had to wait for the shard's free list lock */
+} alloc_shard_stats_t;
+
+/**
+ * Get the counts for shard 'shard' (0 to ALLOC_SHARDS - 1)
+ */
+void allocator_shard_stats(size_t shard, alloc_shard_stats_t* stats);
+
+/**
+ * Heap walking
+ *
+ * allocator_walk() visits every block in the heap, in batches of at most ALLOC_WALK_BATCH.
+ * Each batch is copied out under the lock and the locks are dropped before any callback
+ * runs, so a walk never stalls allocation for long, and the callback may itself allocate.
+ * The walk is weakly consistent: blocks allocated or freed while it runs may be missed,
+ * or reported in either state.
+ */
+#define ALLOC_WALK_BATCH    256
+#define ALLOC_FRAG_BUCKETS  48
+
+typedef struct
+{
+    void*   ptr;        /** Start of the block's data */
+    size_t  size;       /** Size of the block's data in bytes */
+    int     in_use;     /** Non-zero if the block is allocated */
+} alloc_block_info_t;
+
+/**
+ * Heap walk callback. Return non-zero to stop the walk.
+ */
+typedef int (*alloc_walk_fn)(const alloc_block_info_t* block, void* ctx);
+
+typedef struct
+{
+    size_t  used_blocks;                        /** Number of allocated blocks */
+    size_t  used_bytes;                         /** Bytes in allocated blocks */
+    size_t  free_blocks;                        /** Number of free blocks */
+    size_t  free_bytes;                         /** Bytes in free blocks */
+    size_t  largest_free;                       /** Size of the largest free block */
+    size_t  histogram[ALLOC_FRAG_BUCKETS];      /** histogram[i] is the number of free blocks of [2^i, 2^(i + 1)) bytes */
+    double  external_fragmentation;             /** 1 - largest_free / free_bytes (0 when all free memory is in one block) */
+} alloc_frag_t;
+
+/**
+ * Call 'callback' for every block in the heap (see above)
+ */
+void allocator_walk(alloc_walk_fn callback, void* ctx);
+
+/**
+ * Summarise how fragmented the free memory in the heap is
+ */
+void allocator_fragmentation(alloc_frag_t* frag);
+
+/**
+ * Write a binary map of every block in the heap to 'path', for offline visualisation.
+ *
+ * The file is a header, followed by one record per block (all fields little endian):
+ *      header: char magic[8] = "MV2HMAP\0", uint32_t version (1), uint32_t record_size (24),
+ *              uint64_t heap_start, uint64_t heap_end, uint64_t num_records
+ *      record: uint64_t address, uint64_t size, uint32_t in_use, uint32_t reserved (0)
+ *
+ * Returns 0 on success, or -1 (with errno set) on failure.
+ */
+int allocator_dump_heap_map(const char* path);
+
+/**
+ * Persistent heaps
+ *
+ * A persistent heap lives inside a memory-mapped file, so a process that restarts can map
+ * the file again and carry on using the objects (and free blocks) it left there, instead of
+ * rebuilding them. The heap's own metadata only uses offsets, so it doesn't care where the
+ * file gets mapped; the heap asks for the same address as last time, but objects that point
+ * at each other should store mheap_offset()s unless the program checks it got it.
+ *
+ * Objects are found again through a small table of roots in the file's header. Closing the
+ * heap with mheap_close() writes everything back and marks the file clean. A file that wasn't
+ * closed cleanly has its block chain validated and its free lists rebuilt on open; if the
+ * blocks themselves don't hang together, the open fails.
+ *
+ * Persistent heaps are separate from alloc()/dealloc(), and safe to use from several threads.
+ *
+ * The same heaps can also live in shared memory (see mheap_create_shared()), where several
+ * processes map them at once. One process can allocate a buffer, fill it in and pass its
+ * mheap_offset() to another (over a pipe, say), which reads it with mheap_ptr() and frees it
+ * when it's done, without the data ever being copied. The heap's lock is process shared; a
+ * process that dies while allocating or freeing leaves it held.
+ */
+#define MHEAP_MAX_ROOTS 16
+
+typedef struct mheap mheap_t;
+
+/**
+ * Open the persistent heap in the file at 'path', or make a new one 'size' bytes long (up to
+ * 4 GiB) if the file doesn't exist or is empty. The size of an existing heap is the size of
+ * its file, and 'size' is ignored.
+ *
+ * Returns NULL (with errno set) on failure, or EINVAL if the file isn't a usable heap.
+ */
+mheap_t* mheap_open(const char* path, size_t size);
+
+/**
+ * Make a new shared heap of 'size' bytes (up to 4 GiB) in the POSIX shared memory object
+ * 'name' (which mustn't exist yet, and should start with '/'), or in an anonymous memfd if
+ * 'name' is NULL. Other processes attach with mheap_attach_shared(), or mheap_attach_fd() on
+ * the memfd (inherited across fork(), or passed over a UNIX socket). Remove a named heap with
+ * shm_unlink() once every process has attached.
+ *
+ * Returns NULL (with errno set) on failure.
+ */
+mheap_t* mheap_create_shared(const char* name, size_t size);
+
+/**
+ * Attach to the shared heap in the shared memory object 'name'. Returns NULL (with errno set)
+ * on failure, or EINVAL if it isn't a heap.
+ */
+mheap_t* mheap_attach_shared(const char* name);
+
+/**
+ * Attach to the shared heap in 'fd'. The heap keeps its own duplicate of 'fd', so the caller
+ * still owns (and may close) it. Returns NULL (with errno set) on failure.
+ */
+mheap_t* mheap_attach_fd(int fd);
+
+/**
+ * Get the file descriptor of a heap's file or shared memory segment
+ */
+int mheap_fd(const mheap_t*);
+
+/**
+ * Write the heap back to its file, mark it clean, and unmap it. Returns 0 on success, or -1
+ * (with errno set) if the heap couldn't be written back (in which case it's left marked dirty).
+ * Closing a shared heap just unmaps it; the heap lasts until every process has closed it.
+ */
+int mheap_close(mheap_t*);
+
+/**
+ * Write the heap back to its file, without closing it. Returns 0 on success, or -1 (with errno set).
+ */
+int mheap_sync(mheap_t*);
+
+/**
+ * Allocate 'size' bytes (16 byte aligned) from a persistent heap. Returns NULL if it's full.
+ */
+void* mheap_alloc(mheap_t*, size_t size);
+
+/**
+ * Free a pointer returned by mheap_alloc()
+ */
+void mheap_free(mheap_t*, void* ptr);
+
+/**
+ * Set root number 'index' (below MHEAP_MAX_ROOTS) to 'ptr', which must be in the heap (or NULL)
+ */
+void mheap_set_root(mheap_t*, unsigned index, void* ptr);
+
+/**
+ * Get root number 'index' (NULL if it has never been set)
+ */
+void* mheap_root(mheap_t*, unsigned index);
+
+/**
+ * Convert between pointers into a persistent heap and offsets from its start, which stay
+ * valid wherever the heap is mapped. NULL is offset 0.
+ */
+uint64_t mheap_offset(const mheap_t*, const void* ptr);
+void* mheap_ptr(const mheap_t*, uint64_t offset);
+
+/**
+ * Returns true if the heap wasn't closed cleanly last time, and had to be rebuilt on open
+ */
+bool mheap_recovered(const mheap_t*);
+
+/**
+ * Get the block counts and fragmentation of a persistent heap
+ */
+void mheap_fragmentation(mheap_t*, alloc_frag_t* frag);
+
+/**
+ * Relocatable allocations (handles)
+ *
+ * Raw pointers pin blocks in place, so the holes between them can never be closed up.
+ * Objects allocated through a handle live in a heap of their own, mapped outside the
+ * program break, where a compactor can slide them together and hand the space it frees
+ * at the top back to the OS.
+ *
+ * hlock() pins an object and returns its current address, which stays valid until the
+ * matching hunlock(); locks nest. An unlocked object may move at any time, so don't keep
+ * its address past hunlock(). hcompact() does the moving, a step at a time: call it
+ * periodically (the maintenance thread does), and halloc() also does a little whenever
+ * more than half the heap is holes. Handles may be used from any thread.
+ */
+typedef struct handle* handle_t;
+
+typedef struct
+{
+    size_t  handles;            /** Handles in use */
+    size_t  locked;             /** Handles currently locked */
+    size_t  live_bytes;         /** Bytes in live objects (headers included) */
+    size_t  heap_bytes;         /** Bytes from the bottom of the handle heap to its top */
+    size_t  resident_bytes;     /** Bytes of the handle heap that haven't been handed back to the OS */
+} handle_stats_t;
+
+/**
+ * Allocate a relocatable object of 'size' bytes. Returns NULL (with errno set) on failure.
+ */
+handle_t halloc(size_t size);
+
+/**
+ * Pin an object and get its address
+ */
+void* hlock(handle_t);
+
+/**
+ * Undo one hlock()
+ */
+void hunlock(handle_t);
+
+/**
+ * Free an object (which must not be locked)
+ */
+void hfree(handle_t);
+
+/**
+ * Get the size an object was allocated with
+ */
+size_t hsize(handle_t);
+
+/**
+ * Compact the handle heap, moving at most 'budget' bytes (0 for no limit). A pass picks
+ * up where the last call left off. Returns the number of bytes handed back to the OS.
+ */
+size_t hcompact(size_t budget);
+
+/**
+ * Get the handle heap's statistics
+ */
+void hstats(handle_stats_t* stats);
+
 /**
  * Print out information about every block in the allocated list
  */
@@ -75,6 +660,23 @@ void print_alloc_list();
  */
 void print_free_list();
 
+/**
+ * Get the number of objects a pool has carved so far
+ */
+size_t pool_capacity(pool_t*);
 
+/**
+ * Get the number of objects in use from a pool (objects parked in thread caches count as in use)
+ */
+size_t pool_objects_in_use(pool_t*);
+
+/**
+ * Print the occupancy of every pool
+ */
+void print_pool_stats();
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
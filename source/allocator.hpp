@@ -0,0 +1,227 @@
+/**
+ * C++ interface
+ *
+ * std::pmr memory resources and an std::allocator-compatible template on top of the C
+ * interface in allocator.h, so standard containers can use the allocator (or a region or
+ * pool) without any glue of their own. Header only; link against the allocator as usual.
+ */
+#ifndef _ALLOCATOR_HPP_
+#define _ALLOCATOR_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <new>
+
+#include "allocator.h"
+
+namespace mallocv2
+{
+
+/**
+ * Memory resource backed by alloc_aligned()/dealloc_sized(). Every instance is
+ * interchangeable, so memory from one may be handed back to any other.
+ */
+class memory_resource : public std::pmr::memory_resource
+{
+protected:
+    void* do_allocate(std::size_t bytes, std::size_t align) override
+    {
+        void* ptr = alloc_aligned(bytes, align);
+        if(ptr == nullptr)
+            throw std::bad_alloc();
+        return ptr;
+    }
+
+    void do_deallocate(void* ptr, std::size_t bytes, std::size_t align) override
+    {
+        (void)align;
+        dealloc_sized(ptr, bytes);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return dynamic_cast<const memory_resource*>(&other) != nullptr;
+    }
+};
+
+/**
+ * The process-wide instance (pass it to std::pmr::set_default_resource() to make
+ * every pmr container use the allocator)
+ */
+inline memory_resource* default_resource() noexcept
+{
+    static memory_resource resource;
+    return &resource;
+}
+
+/**
+ * Allocator for standard containers, e.g. std::vector<int, mallocv2::allocator<int>>
+ */
+template<class T>
+class allocator
+{
+public:
+    using value_type = T;
+
+    allocator() noexcept = default;
+
+    template<class U>
+    allocator(const allocator<U>&) noexcept {}
+
+    T* allocate(std::size_t n)
+    {
+        if(n > static_cast<std::size_t>(-1) / sizeof(T))
+            throw std::bad_array_new_length();
+
+        void* ptr = alloc_aligned(n * sizeof(T), alignof(T));
+        if(ptr == nullptr)
+            throw std::bad_alloc();
+        return static_cast<T*>(ptr);
+    }
+
+    void deallocate(T* ptr, std::size_t n) noexcept
+    {
+        dealloc_sized(ptr, n * sizeof(T));
+    }
+};
+
+template<class T, class U>
+bool operator==(const allocator<T>&, const allocator<U>&) noexcept { return true; }
+
+template<class T, class U>
+bool operator!=(const allocator<T>&, const allocator<U>&) noexcept { return false; }
+
+/**
+ * Memory resource that bumps through a region. Deallocation does nothing; memory comes
+ * back all at once on release() or when the resource is destroyed. Like the region
+ * itself, it's not thread safe.
+ */
+class region_resource : public std::pmr::memory_resource
+{
+public:
+    /**
+     * Create a region with room for 'initial' bytes
+     */
+    explicit region_resource(std::size_t initial = 64 * 1024)
+        : region_(region_create(initial)), owned_(true)
+    {
+        if(region_ == nullptr)
+            throw std::bad_alloc();
+    }
+
+    /**
+     * Use an existing region (which the caller still owns)
+     */
+    explicit region_resource(region_t* region) noexcept
+        : region_(region), owned_(false)
+    {
+    }
+
+    region_resource(const region_resource&) = delete;
+    region_resource& operator=(const region_resource&) = delete;
+
+    ~region_resource() override
+    {
+        if(owned_)
+            region_destroy(region_);
+    }
+
+    /**
+     * Free everything allocated through this resource (the region keeps its chunks)
+     */
+    void release() noexcept { region_reset(region_); }
+
+    region_t* region() const noexcept { return region_; }
+
+protected:
+    void* do_allocate(std::size_t bytes, std::size_t align) override
+    {
+        // Regions align to 16 bytes; over-allocate and align up for anything stricter
+        std::size_t pad = (align > 16) ? align - 16 : 0;
+        void*       ptr = region_alloc(region_, bytes + pad);
+        if(ptr == nullptr)
+            throw std::bad_alloc();
+
+        std::uintptr_t addr = reinterpret_cast<std::uintptr_t>(ptr);
+        if(pad != 0)
+            addr = (addr + align - 1) & ~static_cast<std::uintptr_t>(align - 1);
+        return reinterpret_cast<void*>(addr);
+    }
+
+    void do_deallocate(void*, std::size_t, std::size_t) override
+    {
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return this == &other;
+    }
+
+private:
+    region_t*   region_;
+    bool        owned_;
+};
+
+/**
+ * Memory resource that takes anything up to 'obj_size' bytes from a pool, and passes
+ * bigger (or more strictly aligned) requests on to 'upstream'. Made for node-based
+ * containers (list, map, unordered_map), whose nodes are all one size.
+ */
+class pool_resource : public std::pmr::memory_resource
+{
+public:
+    explicit pool_resource(std::size_t obj_size, std::size_t align = 0,
+                           std::pmr::memory_resource* upstream = default_resource())
+        : pool_(pool_create(obj_size, align)), obj_size_(obj_size),
+          align_(align == 0 ? 16 : align), upstream_(upstream)
+    {
+        if(pool_ == nullptr)
+            throw std::bad_alloc();
+    }
+
+    pool_resource(const pool_resource&) = delete;
+    pool_resource& operator=(const pool_resource&) = delete;
+
+    /**
+     * Destroying the resource frees every pooled object
+     */
+    ~pool_resource() override { pool_destroy(pool_); }
+
+    pool_t* pool() const noexcept { return pool_; }
+
+protected:
+    void* do_allocate(std::size_t bytes, std::size_t align) override
+    {
+        if(bytes > obj_size_ || align > align_)
+            return upstream_->allocate(bytes, align);
+
+        void* ptr = pool_get(pool_);
+        if(ptr == nullptr)
+            throw std::bad_alloc();
+        return ptr;
+    }
+
+    void do_deallocate(void* ptr, std::size_t bytes, std::size_t align) override
+    {
+        if(bytes > obj_size_ || align > align_)
+            upstream_->deallocate(ptr, bytes, align);
+        else
+            pool_put(pool_, ptr);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return this == &other;
+    }
+
+private:
+    pool_t*                     pool_;
+    std::size_t                 obj_size_;
+    std::size_t                 align_;
+    std::pmr::memory_resource*  upstream_;
+};
+
+}
+
+#endif
@@ -0,0 +1,428 @@
+/**
+ * Implementation of bins.h
+ */
+#define _GNU_SOURCE     // mremap()
+
+#include "bins.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BINS_X86
+#endif
+
+#define BINS_INITIAL_CAPACITY   1024
+#define BINS_PACKED_MAX         0x7fffffffU     // Sizes are compared as signed 32 bit lanes
+
+/**
+ * Search kernels. 'n' is the number of blocks in the bin; kernels may read on to the
+ * end of the vector holding element n - 1, which is zero padded. Each returns 'n' if
+ * nothing matches.
+ */
+struct bins_kernels
+{
+    const char* name;
+    size_t      (*first_ge)(const uint32_t* sizes, size_t n, uint32_t size, size_t start);  // First index >= start with sizes[i] >= size
+    size_t      (*min_ge)(const uint32_t* sizes, size_t n, uint32_t size);                  // Index of the smallest sizes[i] >= size
+    size_t      (*max)(const uint32_t* sizes, size_t n);                                    // Index of the largest sizes[i]
+};
+
+static inline uint32_t _bins_packed(size_t size)
+{
+    return (size > BINS_PACKED_MAX) ? BINS_PACKED_MAX : (uint32_t)size;
+}
+
+static inline unsigned _bins_of(size_t size)
+{
+    return (size > SIZE_CLASS_MAX) ? SIZE_CLASS_COUNT : size_class_of(size);
+}
+
+/**
+ * Scalar kernels (and the fallback for the rare cases the vector kernels can't decide)
+ */
+static size_t _scalar_first_ge(const uint32_t* sizes, size_t n, uint32_t size, size_t start)
+{
+    for(size_t i = start; i < n; i++)
+    {
+        if(sizes[i] >= size)
+            return i;
+    }
+
+    return n;
+}
+
+static size_t _scalar_min_ge(const uint32_t* sizes, size_t n, uint32_t size)
+{
+    size_t best = n;
+
+    for(size_t i = 0; i < n; i++)
+    {
+        if(sizes[i] >= size && (best == n || sizes[i] < sizes[best]))
+        {
+            best = i;
+            if(sizes[i] == size)
+                break;
+        }
+    }
+
+    return best;
+}
+
+static size_t _scalar_max(const uint32_t* sizes, size_t n)
+{
+    size_t best = n;
+
+    for(size_t i = 0; i < n; i++)
+    {
+        if(best == n || sizes[i] > sizes[best])
+            best = i;
+    }
+
+    return best;
+}
+
+#ifdef BINS_X86
+
+/**
+ * SSE2 kernels (4 sizes per compare). Sizes are at most INT32_MAX, so signed compares are safe.
+ */
+static size_t _sse2_first_ge(const uint32_t* sizes, size_t n, uint32_t size, size_t start)
+{
+    const __m128i limit = _mm_set1_epi32((int)size - 1);
+
+    for(size_t i = start & ~(size_t)3; i < n; i += 4)
+    {
+        __m128i x = _mm_load_si128((const __m128i*)(sizes + i));
+        int     mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(x, limit)));
+
+        if(i < start)
+            mask &= ~((1 << (start - i)) - 1);
+
+        if(mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+
+    return n;
+}
+
+static size_t _sse2_first_eq(const uint32_t* sizes, size_t n, uint32_t size)
+{
+    const __m128i value = _mm_set1_epi32((int)size);
+
+    for(size_t i = 0; i < n; i += 4)
+    {
+        __m128i x = _mm_load_si128((const __m128i*)(sizes + i));
+        int     mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(x, value)));
+
+        if(mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+
+    return n;
+}
+
+static size_t _sse2_min_ge(const uint32_t* sizes, size_t n, uint32_t size)
+{
+    const __m128i   limit = _mm_set1_epi32((int)size - 1);
+    const __m128i   none = _mm_set1_epi32(BINS_PACKED_MAX);
+    __m128i         best = none;
+    uint32_t        lanes[4];
+
+    for(size_t i = 0; i < n; i += 4)
+    {
+        // Sizes that don't fit become INT32_MAX, then keep the lane-wise minimum
+        __m128i x = _mm_load_si128((const __m128i*)(sizes + i));
+        __m128i fits = _mm_cmpgt_epi32(x, limit);
+        x = _mm_or_si128(_mm_and_si128(fits, x), _mm_andnot_si128(fits, none));
+
+        __m128i smaller = _mm_cmplt_epi32(x, best);
+        best = _mm_or_si128(_mm_and_si128(smaller, x), _mm_andnot_si128(smaller, best));
+    }
+
+    _mm_storeu_si128((__m128i*)lanes, best);
+    uint32_t min = lanes[0];
+    for(int i = 1; i < 4; i++)
+        min = (lanes[i] < min) ? lanes[i] : min;
+
+    // Either nothing fits, or the best fit is a (capped) enormous block
+    if(min == BINS_PACKED_MAX)
+        return _scalar_min_ge(sizes, n, size);
+
+    return _sse2_first_eq(sizes, n, min);
+}
+
+static size_t _sse2_max(const uint32_t* sizes, size_t n)
+{
+    __m128i     best = _mm_setzero_si128();
+    uint32_t    lanes[4];
+
+    for(size_t i = 0; i < n; i += 4)
+    {
+        __m128i x = _mm_load_si128((const __m128i*)(sizes + i));
+        __m128i larger = _mm_cmpgt_epi32(x, best);
+        best = _mm_or_si128(_mm_and_si128(larger, x), _mm_andnot_si128(larger, best));
+    }
+
+    _mm_storeu_si128((__m128i*)lanes, best);
+    uint32_t max = lanes[0];
+    for(int i = 1; i < 4; i++)
+        max = (lanes[i] > max) ? lanes[i] : max;
+
+    return (n == 0) ? n : _sse2_first_eq(sizes, n, max);
+}
+
+/**
+ * AVX2 kernels (8 sizes per compare)
+ */
+__attribute__((target("avx2"))) static size_t _avx2_first_ge(const uint32_t* sizes, size_t n, uint32_t size, size_t start)
+{
+    const __m256i limit = _mm256_set1_epi32((int)size - 1);
+
+    for(size_t i = start & ~(size_t)7; i < n; i += 8)
+    {
+        __m256i x = _mm256_load_si256((const __m256i*)(sizes + i));
+        int     mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(x, limit)));
+
+        if(i < start)
+            mask &= ~((1 << (start - i)) - 1);
+
+        if(mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+
+    return n;
+}
+
+__attribute__((target("avx2"))) static size_t _avx2_first_eq(const uint32_t* sizes, size_t n, uint32_t size)
+{
+    const __m256i value = _mm256_set1_epi32((int)size);
+
+    for(size_t i = 0; i < n; i += 8)
+    {
+        __m256i x = _mm256_load_si256((const __m256i*)(sizes + i));
+        int     mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(x, value)));
+
+        if(mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+
+    return n;
+}
+
+__attribute__((target("avx2"))) static size_t _avx2_min_ge(const uint32_t* sizes, size_t n, uint32_t size)
+{
+    const __m256i   limit = _mm256_set1_epi32((int)size - 1);
+    const __m256i   none = _mm256_set1_epi32(BINS_PACKED_MAX);
+    __m256i         best = none;
+    uint32_t        lanes[8];
+
+    for(size_t i = 0; i < n; i += 8)
+    {
+        __m256i x = _mm256_load_si256((const __m256i*)(sizes + i));
+        x = _mm256_blendv_epi8(none, x, _mm256_cmpgt_epi32(x, limit));
+        best = _mm256_min_epi32(best, x);
+    }
+
+    _mm256_storeu_si256((__m256i*)lanes, best);
+    uint32_t min = lanes[0];
+    for(int i = 1; i < 8; i++)
+        min = (lanes[i] < min) ? lanes[i] : min;
+
+    if(min == BINS_PACKED_MAX)
+        return _scalar_min_ge(sizes, n, size);
+
+    return _avx2_first_eq(sizes, n, min);
+}
+
+__attribute__((target("avx2"))) static size_t _avx2_max(const uint32_t* sizes, size_t n)
+{
+    __m256i     best = _mm256_setzero_si256();
+    uint32_t    lanes[8];
+
+    for(size_t i = 0; i < n; i += 8)
+        best = _mm256_max_epi32(best, _mm256_load_si256((const __m256i*)(sizes + i)));
+
+    _mm256_storeu_si256((__m256i*)lanes, best);
+    uint32_t max = lanes[0];
+    for(int i = 1; i < 8; i++)
+        max = (lanes[i] > max) ? lanes[i] : max;
+
+    return (n == 0) ? n : _avx2_first_eq(sizes, n, max);
+}
+
+#endif
+
+static struct bins_kernels  kernels = {"scalar", _scalar_first_ge, _scalar_min_ge, _scalar_max};
+static pthread_once_t       kernels_once = PTHREAD_ONCE_INIT;
+
+static void _bins_pick_kernels()
+{
+#ifdef BINS_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        kernels.name        = "avx2";
+        kernels.first_ge    = _avx2_first_ge;
+        kernels.min_ge      = _avx2_min_ge;
+        kernels.max         = _avx2_max;
+    }
+    else if(__builtin_cpu_supports("sse2"))
+    {
+        kernels.name        = "sse2";
+        kernels.first_ge    = _sse2_first_ge;
+        kernels.min_ge      = _sse2_min_ge;
+        kernels.max         = _sse2_max;
+    }
+#endif
+}
+
+/**
+ * Make room for one more block in a bin. The arrays are mapped straight from the OS
+ * (so they're zeroed, and suitably aligned), and grown with mremap().
+ */
+static void _bins_grow(struct bin* bin)
+{
+    uint32_t capacity = bin->capacity ? bin->capacity * 2 : BINS_INITIAL_CAPACITY;
+
+    pthread_once(&kernels_once, _bins_pick_kernels);
+
+    if(bin->capacity == 0)
+    {
+        bin->sizes  = mmap(NULL, capacity * sizeof(uint32_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        bin->blocks = mmap(NULL, capacity * sizeof(memblk_t*), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    else
+    {
+        bin->sizes  = mremap(bin->sizes, bin->capacity * sizeof(uint32_t), capacity * sizeof(uint32_t), MREMAP_MAYMOVE);
+        bin->blocks = mremap(bin->blocks, bin->capacity * sizeof(memblk_t*), capacity * sizeof(memblk_t*), MREMAP_MAYMOVE);
+    }
+
+    if(bin->sizes == MAP_FAILED || bin->blocks == MAP_FAILED)
+    {
+        printf("bins: unable to grow a bin to %u blocks!\n", capacity);
+        abort();
+    }
+
+    bin->capacity = capacity;
+}
+
+void bins_insert(bins_t* bins, memblk_t* block)
+{
+    unsigned    b = _bins_of(block->size);
+    struct bin* bin = &bins->bin[b];
+
+    if(bin->count == bin->capacity)
+        _bins_grow(bin);
+
+    block->bin          = b;
+    block->bin_index    = bin->count;
+    bin->sizes[bin->count]  = _bins_packed(block->size);
+    bin->blocks[bin->count] = block;
+    bin->count++;
+}
+
+void bins_remove(bins_t* bins, memblk_t* block)
+{
+    struct bin* bin = &bins->bin[block->bin];
+    uint32_t    last = --bin->count;
+
+    // Fill the hole with the last block, and keep the padding past the end zeroed
+    bin->sizes[block->bin_index]    = bin->sizes[last];
+    bin->blocks[block->bin_index]   = bin->blocks[last];
+    bin->blocks[block->bin_index]->bin_index = block->bin_index;
+    bin->sizes[last]    = 0;
+    bin->blocks[last]   = NULL;
+}
+
+void bins_resize(bins_t* bins, memblk_t* block, size_t size)
+{
+    if(_bins_of(size) != block->bin)
+    {
+        bins_remove(bins, block);
+        block->size = size;
+        bins_insert(bins, block);
+    }
+    else
+    {
+        block->size = size;
+        bins->bin[block->bin].sizes[block->bin_index] = _bins_packed(size);
+    }
+}
+
+memblk_t* bins_first_fit(bins_t* bins, size_t size)
+{
+    uint32_t packed = _bins_packed(size ? size : 1);
+
+    for(unsigned b = _bins_of(size); b < BINS_COUNT; b++)
+    {
+        struct bin* bin = &bins->bin[b];
+        size_t      i = 0;
+
+        while((i = kernels.first_ge(bin->sizes, bin->count, packed, i)) < bin->count)
+        {
+            memblk_t* block = bin->blocks[i];
+
+            // Locked blocks are being allocated by someone else, so move on to the next one
+            if(block->size >= size && pthread_mutex_trylock(&block->lock) == 0)
+                return block;
+
+            i++;
+        }
+    }
+
+    return NULL;
+}
+
+memblk_t* bins_best_fit(bins_t* bins, size_t size)
+{
+    uint32_t packed = _bins_packed(size ? size : 1);
+
+    // Every block in a bin is larger than every block in the bins below it, so the
+    // first bin with a block that fits has the best fit
+    for(unsigned b = _bins_of(size); b < BINS_COUNT; b++)
+    {
+        struct bin* bin = &bins->bin[b];
+        size_t      i = kernels.min_ge(bin->sizes, bin->count, packed);
+
+        if(i < bin->count)
+        {
+            memblk_t* block = bin->blocks[i];
+            if(block->size >= size && pthread_mutex_trylock(&block->lock) == 0)
+                return block;
+
+            return NULL;
+        }
+    }
+
+    return NULL;
+}
+
+memblk_t* bins_worst_fit(bins_t* bins, size_t size)
+{
+    // Likewise, the largest block is in the highest bin that isn't empty
+    for(unsigned b = BINS_COUNT; b-- > _bins_of(size);)
+    {
+        struct bin* bin = &bins->bin[b];
+        if(bin->count == 0)
+            continue;
+
+        memblk_t* block = bin->blocks[kernels.max(bin->sizes, bin->count)];
+        if(block->size >= size && pthread_mutex_trylock(&block->lock) == 0)
+            return block;
+
+        return NULL;
+    }
+
+    return NULL;
+}
+
+const char* bins_kernel()
+{
+    pthread_once(&kernels_once, _bins_pick_kernels);
+
+    return kernels.name;
+}
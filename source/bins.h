@@ -0,0 +1,70 @@
+/**
+ * Free block bins
+ *
+ * Mirrors the free list into one bin per size class (plus one for everything past the
+ * largest class). Each bin keeps its blocks' sizes in a packed array, alongside a matching
+ * array of block pointers, so a search compares 4 or 8 sizes per instruction (SSE2, or
+ * AVX2 where the CPU has it) rather than chasing one 'next' pointer per candidate.
+ *
+ * Bins hang off a list_t, and list_append_block()/list_delete_block() keep them in step,
+ * so they're protected by the list's lock: searches need the read lock, and everything
+ * else needs the write lock.
+ */
+#ifndef _BINS_H_
+#define _BINS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "memblk.h"
+#include "size_classes.h"
+
+#define BINS_COUNT  (SIZE_CLASS_COUNT + 1)
+
+struct bin
+{
+    uint32_t*   sizes;      /** Block sizes (capped at INT32_MAX), zero past 'count' */
+    memblk_t**  blocks;     /** blocks[i] is the block whose size is sizes[i] */
+    uint32_t    count;      /** Blocks in the bin */
+    uint32_t    capacity;   /** Room in the arrays (always a multiple of 8) */
+};
+
+struct bins
+{
+    struct bin  bin[BINS_COUNT];
+};
+
+typedef struct bins bins_t;
+
+/**
+ * Add a block to its bin
+ */
+void bins_insert(bins_t*, memblk_t*);
+
+/**
+ * Take a block out of its bin
+ */
+void bins_remove(bins_t*, memblk_t*);
+
+/**
+ * Change the size of a block that is in the bins
+ */
+void bins_resize(bins_t*, memblk_t*, size_t size);
+
+/**
+ * Search the bins for a block of at least 'size' bytes, and lock it.
+ *
+ * First fit takes the first unlocked block that fits, in the smallest bin that has one.
+ * Best and worst fit pick the smallest and largest block that fits, and (like their list
+ * equivalents) give up and return NULL if that block is locked.
+ */
+memblk_t* bins_first_fit(bins_t*, size_t size);
+memblk_t* bins_best_fit(bins_t*, size_t size);
+memblk_t* bins_worst_fit(bins_t*, size_t size);
+
+/**
+ * Name of the search kernel in use ("avx2", "sse2" or "scalar")
+ */
+const char* bins_kernel();
+
+#endif
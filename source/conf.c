@@ -0,0 +1,265 @@
+/**
+ * Implementation of conf.h
+ */
+#include "conf.h"
+#include "allocator.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * Settings that go through a setter taking several of them at once
+ */
+struct conf
+{
+    bool        maintenance;
+    unsigned    maint_interval_ms;
+    unsigned    maint_budget_pct;
+    bool        guard;
+    unsigned    guard_rate;
+    size_t      guard_slots;
+    bool        limits;
+    size_t      soft_limit;
+    size_t      hard_limit;
+};
+
+/**
+ * Write to stderr without going through stdio (which may allocate)
+ */
+static void _conf_write(const char* msg, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t n = write(STDERR_FILENO, msg, len);
+        if(n <= 0)
+            return;
+        msg += n;
+        len -= n;
+    }
+}
+
+/**
+ * Report an option we're ignoring, and why
+ */
+static void _conf_report(const char* option, const char* reason)
+{
+    char    msg[CONF_MAX_LEN + 128];
+    size_t  len = 0;
+    const char* parts[] = {"mallocv2: ignoring " CONF_ENV " option '", option, "' (", reason, ")\n"};
+
+    for(size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++)
+    {
+        size_t n = strlen(parts[i]);
+        if(n > sizeof(msg) - len)
+            n = sizeof(msg) - len;
+        memcpy(msg + len, parts[i], n);
+        len += n;
+    }
+
+    _conf_write(msg, len);
+}
+
+/**
+ * Parse an unsigned number, with an optional k, m or g suffix (powers of 1024)
+ */
+static bool _conf_size(const char* value, size_t* out)
+{
+    char*               end;
+    unsigned long long  n;
+    unsigned            shift = 0;
+
+    if(*value < '0' || *value > '9')
+        return false;
+
+    // This runs inside the program's first alloc(), so leave its errno as it was
+    int saved = errno;
+    errno = 0;
+    n = strtoull(value, &end, 10);
+    bool range = (errno == ERANGE);
+    errno = saved;
+
+    if(range || n > SIZE_MAX)
+        return false;
+
+    switch(*end)
+    {
+    case 'k': case 'K': shift = 10; end++; break;
+    case 'm': case 'M': shift = 20; end++; break;
+    case 'g': case 'G': shift = 30; end++; break;
+    default: break;
+    }
+
+    if(*end != '\0' || n > (SIZE_MAX >> shift))
+        return false;
+
+    *out = (size_t)n << shift;
+    return true;
+}
+
+static bool _conf_unsigned(const char* value, unsigned* out)
+{
+    size_t n;
+
+    if(!_conf_size(value, &n) || n > UINT32_MAX)
+        return false;
+
+    *out = (unsigned)n;
+    return true;
+}
+
+/**
+ * Apply one option. Returns NULL if it was fine, or why it was ignored.
+ */
+static const char* _conf_option(struct conf* conf, const char* name, const char* value)
+{
+    size_t      size;
+    unsigned    n;
+
+    if(!strcmp(name, "strategy"))
+    {
+        if(!strcmp(value, "first"))
+            allocator_set_method(ALLOC_FF);
+        else if(!strcmp(value, "best"))
+            allocator_set_method(ALLOC_BF);
+        else if(!strcmp(value, "worst"))
+            allocator_set_method(ALLOC_WF);
+        else if(!strcmp(value, "tlsf"))
+            allocator_set_method(ALLOC_TLSF);
+        else
+            return "expected first, best, worst or tlsf";
+    }
+    else if(!strcmp(name, "isolate"))
+    {
+        if(!_conf_unsigned(value, &n) || n > 1)
+            return "expected 0 or 1";
+        allocator_set_cacheline_isolation(n == 1);
+    }
+    else if(!strcmp(name, "hugepages"))
+    {
+        if(!_conf_size(value, &size))
+            return "expected a size";
+        allocator_set_hugepage_heap(size);
+    }
+    else if(!strcmp(name, "maintenance"))
+    {
+        if(!_conf_unsigned(value, &conf->maint_interval_ms))
+            return "expected an interval in ms";
+        conf->maintenance = true;
+    }
+    else if(!strcmp(name, "maintenance_budget"))
+    {
+        if(!_conf_unsigned(value, &n) || n == 0 || n > 100)
+            return "expected a percentage";
+        conf->maint_budget_pct = n;
+    }
+    else if(!strcmp(name, "guard"))
+    {
+        if(!_conf_unsigned(value, &conf->guard_rate))
+            return "expected a sampling rate";
+        conf->guard = true;
+    }
+    else if(!strcmp(name, "guard_slots"))
+    {
+        if(!_conf_size(value, &conf->guard_slots))
+            return "expected a number of slots";
+    }
+    else if(!strcmp(name, "profile"))
+    {
+        if(!_conf_size(value, &size))
+            return "expected a sampling rate in bytes";
+        allocator_set_heap_profiling(size);
+    }
+    else if(!strcmp(name, "leaks"))
+    {
+        if(!strcmp(value, "0") || !strcmp(value, "off"))
+            allocator_set_leak_report(ALLOC_LEAKS_OFF);
+        else if(!strcmp(value, "1") || !strcmp(value, "sites"))
+            allocator_set_leak_report(ALLOC_LEAKS_SITES);
+        else if(!strcmp(value, "full"))
+            allocator_set_leak_report(ALLOC_LEAKS_BACKTRACES);
+        else
+            return "expected off, sites or full";
+    }
+    else if(!strcmp(name, "soft_limit"))
+    {
+        if(!_conf_size(value, &conf->soft_limit))
+            return "expected a size";
+        conf->limits = true;
+    }
+    else if(!strcmp(name, "hard_limit"))
+    {
+        if(!_conf_size(value, &conf->hard_limit))
+            return "expected a size";
+        conf->limits = true;
+    }
+    else
+    {
+        return "unknown option";
+    }
+
+    return NULL;
+}
+
+void conf_apply()
+{
+    static bool     applied = false;
+    const char*     env;
+    char            buf[CONF_MAX_LEN];
+    struct conf     conf = {0};
+
+    // Threads can race into the first alloc(); only one of them reads the settings
+    if(__atomic_exchange_n(&applied, true, __ATOMIC_ACQ_REL))
+        return;
+
+    env = getenv(CONF_ENV);
+    if(env == NULL || *env == '\0')
+        return;
+
+    if(strlen(env) >= sizeof(buf))
+    {
+        static const char msg[] = "mallocv2: ignoring " CONF_ENV " (too long)\n";
+        _conf_write(msg, sizeof(msg) - 1);
+        return;
+    }
+    strcpy(buf, env);
+
+    conf.maint_budget_pct = 100;
+
+    for(char* option = buf; option != NULL && *option != '\0'; )
+    {
+        char* next = strchr(option, ',');
+        if(next != NULL)
+            *next++ = '\0';
+
+        char* value = strchr(option, ':');
+        if(value == NULL)
+        {
+            if(*option != '\0')
+                _conf_report(option, "expected option:value");
+        }
+        else
+        {
+            *value++ = '\0';
+
+            const char* reason = _conf_option(&conf, option, value);
+            if(reason != NULL)
+            {
+                value[-1] = ':';
+                _conf_report(option, reason);
+            }
+        }
+
+        option = next;
+    }
+
+    if(conf.maintenance)
+        allocator_set_maintenance(conf.maint_interval_ms, conf.maint_budget_pct);
+    if(conf.guard)
+        allocator_set_guard_sampling(conf.guard_rate, conf.guard_slots);
+    if(conf.limits)
+        allocator_set_limits(conf.soft_limit, conf.hard_limit);
+}
@@ -0,0 +1,23 @@
+/**
+ * Run time configuration
+ *
+ * Reads the allocator's settings from the MALLOCV2_CONF environment variable, a comma
+ * separated list of 'option:value' pairs (see allocator.h for the options), and applies
+ * them through the same setters a program would call. Parsing happens in place on a
+ * fixed buffer, so it never allocates, and can run from inside the first alloc().
+ *
+ * Options that aren't recognised, or whose values don't parse, are reported on stderr
+ * and skipped; the rest still apply.
+ */
+#ifndef _CONF_H_
+#define _CONF_H_
+
+#define CONF_ENV        "MALLOCV2_CONF"
+#define CONF_MAX_LEN    1024            /** Longest configuration string we'll read */
+
+/**
+ * Parse CONF_ENV (if it's set) and apply it
+ */
+void conf_apply();
+
+#endif
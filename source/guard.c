@@ -0,0 +1,339 @@
+/**
+ * Implementation of guard.h
+ */
+#include "guard.h"
+
+#include <execinfo.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define GUARD_ALIGN         16
+#define GUARD_TRACE_DEPTH   16
+
+typedef enum
+{
+    SLOT_FREE,          // Never used
+    SLOT_USED,          // Holds a live allocation
+    SLOT_QUARANTINED    // Freed, and waiting its turn to be reused
+} slot_state_t;
+
+/**
+ * Everything we know about a slot, for the fault report
+ */
+struct guard_slot
+{
+    slot_state_t    state;
+    uint8_t*        ptr;                            // Pointer we handed out
+    size_t          size;                           // Size that was asked for
+    void*           alloc_trace[GUARD_TRACE_DEPTH]; // Where it was allocated
+    int             alloc_depth;
+    void*           free_trace[GUARD_TRACE_DEPTH];  // Where it was freed (if it was)
+    int             free_depth;
+};
+
+unsigned guard_rate = 0;
+
+static size_t               num_slots = GUARD_DEFAULT_SLOTS;
+static size_t               page_size;
+static uint8_t*             pool_base = NULL;       // Start of the slot pool (a guard page)
+static uint8_t*             pool_end = NULL;        // One past the last guard page
+static struct guard_slot*   slots;
+
+// Slots waiting to be handed out. Freed slots go to the back, so the slot that has
+// been freed for longest is reused first (giving use-after-free the best chance to fault).
+static size_t*              queue;
+static size_t               queue_head = 0;
+static size_t               queue_count = 0;
+static pthread_mutex_t      queue_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t       pool_once = PTHREAD_ONCE_INIT;
+static struct sigaction     old_segv;
+
+static __thread unsigned    countdown = 0;          // Allocations until this thread samples again
+static __thread uint64_t    rng_state = 0;          // This thread's interval jitter (0 until it's seeded)
+
+/**
+ * Async-signal-safe output helpers (printf() is off limits in the fault handler)
+ */
+static void _guard_puts(const char* str)
+{
+    ssize_t ret = write(STDERR_FILENO, str, strlen(str));
+    (void)ret;
+}
+
+static void _guard_put_num(uint64_t value, unsigned base)
+{
+    char    buf[32];
+    int     i = sizeof(buf);
+
+    buf[--i] = '\0';
+    do
+    {
+        buf[--i] = "0123456789abcdef"[value % base];
+        value /= base;
+    } while(value != 0 && i > 2);
+
+    if(base == 16)
+    {
+        buf[--i] = 'x';
+        buf[--i] = '0';
+    }
+
+    _guard_puts(&buf[i]);
+}
+
+static void _guard_put_trace(const char* what, void* const* trace, int depth)
+{
+    _guard_puts(what);
+    _guard_puts(":\n");
+    backtrace_symbols_fd(trace, depth, STDERR_FILENO);
+}
+
+static inline uint8_t* _guard_slot_page(size_t slot)
+{
+    return pool_base + (2 * slot + 1) * page_size;
+}
+
+/**
+ * SIGSEGV handler. If the fault is in the slot pool, report what happened, and put the
+ * old handler back so the fault is fatal when we return and the instruction re-runs.
+ */
+static void _guard_segv_handler(int sig, siginfo_t* info, void* ucontext)
+{
+    uint8_t* addr = info->si_addr;
+
+    if(addr >= pool_base && addr < pool_end)
+    {
+        size_t  page = (addr - pool_base) / page_size;
+        size_t  slot;
+        void*   trace[GUARD_TRACE_DEPTH];
+
+        // Odd pages hold data; even pages are guards. A guard page is most likely hit by
+        // running off the end of the slot before it.
+        if(page % 2 == 1 || page == 0)
+            slot = (page == 0) ? 0 : (page - 1) / 2;
+        else
+            slot = (page / 2) - 1;
+
+        struct guard_slot* s = &slots[slot];
+
+        _guard_puts("\n==== heap error detected by guard page sampling ====\n");
+        if(s->state == SLOT_QUARANTINED && addr >= _guard_slot_page(slot) && addr < _guard_slot_page(slot) + page_size)
+            _guard_puts("use after free");
+        else if(addr >= s->ptr + s->size)
+            _guard_puts("heap buffer overflow");
+        else
+            _guard_puts("heap buffer underflow");
+
+        _guard_puts(" at address ");
+        _guard_put_num((uintptr_t)addr, 16);
+        _guard_puts("\nblock ");
+        _guard_put_num((uintptr_t)s->ptr, 16);
+        _guard_puts(" of ");
+        _guard_put_num(s->size, 10);
+        _guard_puts(" bytes\n");
+
+        int depth = backtrace(trace, GUARD_TRACE_DEPTH);
+        _guard_put_trace("faulting access", trace, depth);
+        _guard_put_trace("allocated at", s->alloc_trace, s->alloc_depth);
+        if(s->state == SLOT_QUARANTINED)
+            _guard_put_trace("freed at", s->free_trace, s->free_depth);
+
+        sigaction(SIGSEGV, &old_segv, NULL);
+        return;
+    }
+
+    // Not ours, so pass it on to whoever was there before us
+    if((old_segv.sa_flags & SA_SIGINFO) && old_segv.sa_sigaction != NULL)
+    {
+        old_segv.sa_sigaction(sig, info, ucontext);
+    }
+    else if(old_segv.sa_handler != SIG_DFL && old_segv.sa_handler != SIG_IGN)
+    {
+        old_segv.sa_handler(sig);
+    }
+    else
+    {
+        sigaction(SIGSEGV, &old_segv, NULL);
+    }
+}
+
+/**
+ * Map the slot pool, and install the fault handler
+ */
+static void _guard_pool_init()
+{
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+    size_t  pool_size = (2 * num_slots + 1) * page_size;
+    size_t  meta_size = num_slots * (sizeof(struct guard_slot) + sizeof(size_t));
+
+    uint8_t* pool = mmap(NULL, pool_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    uint8_t* meta = mmap(NULL, meta_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(pool == MAP_FAILED || meta == MAP_FAILED)
+    {
+        fprintf(stderr, "guard: unable to map the guard slot pool, sampling disabled\n");
+        guard_rate = 0;
+        return;
+    }
+
+    slots = (struct guard_slot*)meta;
+    queue = (size_t*)(meta + num_slots * sizeof(struct guard_slot));
+    for(size_t i = 0; i < num_slots; i++)
+        queue[i] = i;
+    queue_count = num_slots;
+
+    // backtrace() may have to load libgcc the first time it's called, which we can't
+    // have happen inside the fault handler.
+    void* trace[1];
+    backtrace(trace, 1);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = _guard_segv_handler;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &old_segv);
+
+    __atomic_store_n(&pool_end, pool + pool_size, __ATOMIC_RELEASE);
+    __atomic_store_n(&pool_base, pool, __ATOMIC_RELEASE);
+}
+
+void guard_set_sampling(unsigned rate, size_t num)
+{
+    if(num > 0 && pool_base == NULL)
+        num_slots = num;
+
+    guard_rate = rate;
+}
+
+/**
+ * Next number from this thread's xorshift generator, seeding it on first use
+ */
+static uint64_t _guard_random()
+{
+    if(rng_state == 0)
+        rng_state = ((uintptr_t)&rng_state ^ (uint64_t)time(NULL) * 0x9e3779b97f4a7c15ULL) | 1;
+
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+
+    return rng_state;
+}
+
+void* guard_maybe_alloc(size_t size)
+{
+    unsigned rate = guard_rate;
+
+    if(countdown > 1)
+    {
+        countdown--;
+        return NULL;
+    }
+
+    if(rate == 0)
+        return NULL;
+
+    // A thread's first trip here starts it at a random point in the interval, so threads
+    // don't all sample their first allocation
+    if(rng_state == 0)
+    {
+        countdown = (unsigned)(_guard_random() % (rate + rate / 4));
+        if(countdown > 0)
+            return NULL;
+    }
+
+    // Jitter the interval a little, so we don't lock step with a periodic allocation pattern
+    countdown = rate + (unsigned)(_guard_random() % (rate / 4 + 1));
+
+    pthread_once(&pool_once, _guard_pool_init);
+    if(pool_base == NULL || size > page_size)
+        return NULL;
+
+    pthread_mutex_lock(&queue_lock);
+    if(queue_count == 0)
+    {
+        pthread_mutex_unlock(&queue_lock);
+        return NULL;
+    }
+
+    size_t slot = queue[queue_head];
+    queue_head = (queue_head + 1) % num_slots;
+    queue_count--;
+    pthread_mutex_unlock(&queue_lock);
+
+    uint8_t* page = _guard_slot_page(slot);
+    if(mprotect(page, page_size, PROT_READ | PROT_WRITE) != 0)
+    {
+        fprintf(stderr, "guard: mprotect failed on slot %ld!\n", slot);
+        abort();
+    }
+
+    // Push the block up against the guard page that follows it (as far as alignment allows).
+    // Even an empty block takes GUARD_ALIGN bytes, so its pointer stays inside the slot's page.
+    size_t              aligned = (size + GUARD_ALIGN - 1) & ~(size_t)(GUARD_ALIGN - 1);
+    if(aligned == 0)
+        aligned = GUARD_ALIGN;
+    struct guard_slot*  s = &slots[slot];
+
+    s->ptr          = page + page_size - aligned;
+    s->size         = size;
+    s->alloc_depth  = backtrace(s->alloc_trace, GUARD_TRACE_DEPTH);
+    s->free_depth   = 0;
+    __atomic_store_n(&s->state, SLOT_USED, __ATOMIC_RELEASE);
+
+    return s->ptr;
+}
+
+bool guard_owns(const void* ptr)
+{
+    uint8_t* base = __atomic_load_n(&pool_base, __ATOMIC_ACQUIRE);
+
+    return base != NULL && (const uint8_t*)ptr >= base && (const uint8_t*)ptr < pool_end;
+}
+
+size_t guard_size(const void* ptr)
+{
+    return slots[((const uint8_t*)ptr - pool_base) / page_size / 2].size;
+}
+
+void guard_free(void* ptr)
+{
+    size_t              slot = ((uint8_t*)ptr - pool_base) / page_size / 2;
+    struct guard_slot*  s = &slots[slot];
+
+    if(__atomic_load_n(&s->state, __ATOMIC_ACQUIRE) != SLOT_USED || s->ptr != ptr)
+    {
+        void*   trace[GUARD_TRACE_DEPTH];
+        int     depth = backtrace(trace, GUARD_TRACE_DEPTH);
+
+        fprintf(stderr, "\n==== heap error detected by guard page sampling ====\n");
+        fprintf(stderr, "%s of pointer %p (slot holds %p, %ld bytes)\n",
+                (s->state == SLOT_QUARANTINED && s->ptr == ptr) ? "double free" : "invalid free",
+                ptr, (void*)s->ptr, s->size);
+        _guard_put_trace("freed at", trace, depth);
+        _guard_put_trace("allocated at", s->alloc_trace, s->alloc_depth);
+        if(s->state == SLOT_QUARANTINED)
+            _guard_put_trace("first freed at", s->free_trace, s->free_depth);
+        abort();
+    }
+
+    s->free_depth = backtrace(s->free_trace, GUARD_TRACE_DEPTH);
+    __atomic_store_n(&s->state, SLOT_QUARANTINED, __ATOMIC_RELEASE);
+
+    // Any access from here on faults, and reports a use after free
+    mprotect(_guard_slot_page(slot), page_size, PROT_NONE);
+
+    pthread_mutex_lock(&queue_lock);
+    queue[(queue_head + queue_count) % num_slots] = slot;
+    queue_count++;
+    pthread_mutex_unlock(&queue_lock);
+}
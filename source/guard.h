@@ -0,0 +1,51 @@
+/**
+ * Sampled guard page allocations
+ *
+ * One in every 'rate' allocations (of a page or less) is placed in a slot of its own: a
+ * page sitting between two PROT_NONE guard pages, with the data pushed up against the
+ * guard page that follows it. Running off the end of the block faults straight away,
+ * rather than silently trampling the next block, and freed slots are made PROT_NONE
+ * too, so a use after free faults as well. The fault handler reports the block and
+ * where it was allocated (and freed), then lets the process die as it normally would.
+ *
+ * Slots come from a small, fixed pool mapped when the first allocation is sampled. If
+ * every slot is in use, allocations just go through the normal path.
+ */
+#ifndef _GUARD_H_
+#define _GUARD_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define GUARD_DEFAULT_SLOTS 64
+
+extern unsigned guard_rate;     /** 1 in 'guard_rate' allocations are sampled (0 if sampling is off) */
+
+/**
+ * Turn sampling on (or off, with a rate of 0). 'slots' only takes effect before the
+ * first sampled allocation.
+ */
+void guard_set_sampling(unsigned rate, size_t slots);
+
+/**
+ * If this allocation is sampled, put it in a guarded slot and return its address.
+ * Returns NULL if it wasn't sampled (or there were no free slots).
+ */
+void* guard_maybe_alloc(size_t size);
+
+/**
+ * Returns true if 'ptr' lies inside the guard slot pool
+ */
+bool guard_owns(const void* ptr);
+
+/**
+ * Get the size of a guarded allocation
+ */
+size_t guard_size(const void* ptr);
+
+/**
+ * Free a guarded allocation
+ */
+void guard_free(void* ptr);
+
+#endif
@@ -0,0 +1,330 @@
+/**
+ * Implementation of the handle functions in allocator.h
+ *
+ * Handle objects live in a heap of their own: one big reservation of address space
+ * (mapped with MAP_NORESERVE, so only the pages in use cost anything) that objects are
+ * bumped into from the bottom up:
+ *
+ *      [ block | block | free | block | ... | block ] top ... end of reservation
+ *
+ * Every block starts with a header naming the handle that owns it (NULL once freed),
+ * so the heap can be walked from the bottom. The compactor walks it with two cursors:
+ * 'src' is the next block to look at, and 'dst' is where the next movable block goes.
+ * Live, unlocked blocks slide down from 'src' to 'dst'; freed blocks are skipped over;
+ * locked blocks stay put, and the compacted area restarts after them. Between steps the
+ * gap from 'dst' to 'src' is a free block, so the heap stays walkable. Once 'src' reaches
+ * the top, the top drops to 'dst' and the pages above it go back to the OS.
+ *
+ * Handles themselves sit in a table that never moves, so a handle stays valid however
+ * often its object does.
+ */
+#include "allocator.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define HANDLE_HEAP_RESERVE     ((size_t)1 << 34)           // Address space for handle objects (16 GiB)
+#define HANDLE_MAX              ((size_t)1 << 22)           // Handles in the table
+#define HANDLE_ALIGN            16
+#define HANDLE_PAGE             4096
+#define HANDLE_COMPACT_MIN      (256 * 1024)                // halloc() leaves heaps smaller than this alone
+#define HANDLE_ALLOC_STEP       (64 * 1024)                 // Bytes halloc() moves when it helps the compactor along
+
+#define ALIGN_UP(x, a)          (((x) + ((a) - 1)) & ~(uintptr_t)((a) - 1))
+
+struct handle
+{
+    uint8_t*        data;       // Where the object is now (NULL while the handle is free)
+    size_t          size;       // Size the object was allocated with
+    uint32_t        locks;      // hlock() depth. Locked objects are never moved
+    struct handle*  next_free;  // Next free handle in the table
+};
+
+/**
+ * Block header. The data follows it.
+ */
+struct hblock
+{
+    struct handle*  owner;      // Handle of the object in this block (NULL if the block is free)
+    size_t          size;       // Size of the whole block, header included
+};
+
+#define HBLOCK_HEADER           sizeof(struct hblock)
+
+static pthread_once_t   handle_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t  handle_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t*         base = NULL;        // Start of the reservation (NULL if it couldn't be mapped)
+static uint8_t*         top;                // End of the last block
+static uint8_t*         touched;            // End of the highest page that may be resident
+static uint8_t*         src = NULL;         // Compactor cursors (NULL between passes)
+static uint8_t*         dst = NULL;
+
+static struct handle*   table;
+static size_t           table_used = 0;     // Handles ever handed out from the table
+static struct handle*   free_handles = NULL;
+
+static size_t           num_handles = 0;
+static size_t           num_locked = 0;
+static size_t           live_bytes = 0;     // Bytes in live blocks (headers included)
+
+static void _handle_init()
+{
+    uint8_t* heap = mmap(NULL, HANDLE_HEAP_RESERVE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    table = mmap(NULL, HANDLE_MAX * sizeof(struct handle), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(heap == MAP_FAILED || table == MAP_FAILED)
+    {
+        if(heap != MAP_FAILED)
+            munmap(heap, HANDLE_HEAP_RESERVE);
+        if(table != MAP_FAILED)
+            munmap(table, HANDLE_MAX * sizeof(struct handle));
+        return;
+    }
+
+    top = heap;
+    touched = heap;
+
+    // Publish the heap last; hcompact() and hstats() check it without initialising anything
+    __atomic_store_n(&base, heap, __ATOMIC_RELEASE);
+}
+
+/**
+ * Turn [start, end) into a single free block
+ */
+static inline void _handle_mark_free(uint8_t* start, uint8_t* end)
+{
+    struct hblock* block = (struct hblock*)start;
+
+    block->owner = NULL;
+    block->size = end - start;
+}
+
+/**
+ * Hand the pages above the top back to the OS. Returns the number of bytes released.
+ */
+static size_t _handle_release_tail()
+{
+    uint8_t* start = (uint8_t*)ALIGN_UP((uintptr_t)top, HANDLE_PAGE);
+
+    if(start >= touched)
+        return 0;
+
+    size_t len = touched - start;
+    if(madvise(start, len, MADV_DONTNEED) != 0)
+        return 0;
+
+    touched = start;
+    return len;
+}
+
+/**
+ * Run the compactor until it has moved 'budget' bytes (0 for no limit), or finished
+ * the pass. Returns the number of bytes released to the OS. Caller holds handle_lock.
+ */
+static size_t _handle_compact(size_t budget)
+{
+    size_t moved = 0;
+
+    if(src == NULL)
+        src = dst = base;
+
+    while(src < top && (budget == 0 || moved < budget))
+    {
+        struct hblock*  block = (struct hblock*)src;
+        size_t          size = block->size;
+
+        if(block->owner == NULL)
+        {
+            src += size;
+        }
+        else if(block->owner->locks > 0)
+        {
+            // Pinned. Whatever is in front of it stays a hole until the next pass.
+            if(dst < src)
+                _handle_mark_free(dst, src);
+            src += size;
+            dst = src;
+        }
+        else
+        {
+            if(dst != src)
+            {
+                memmove(dst, src, size);
+                block = (struct hblock*)dst;
+                block->owner->data = dst + HBLOCK_HEADER;
+                moved += size;
+            }
+            src += size;
+            dst += size;
+        }
+    }
+
+    if(src < top)
+    {
+        if(dst < src)
+            _handle_mark_free(dst, src);
+        return 0;
+    }
+
+    // That's the end of the pass; everything from 'dst' up is free
+    top = dst;
+    src = dst = NULL;
+    return _handle_release_tail();
+}
+
+handle_t halloc(size_t size)
+{
+    pthread_once(&handle_once, _handle_init);
+    if(base == NULL || size > HANDLE_HEAP_RESERVE / 2)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    size_t need = HBLOCK_HEADER + ALIGN_UP(size ? size : 1, HANDLE_ALIGN);
+
+    pthread_mutex_lock(&handle_lock);
+
+    // Once more than half the heap is holes, every allocation does a little compaction,
+    // so the heap never gets much bigger than twice what's live
+    size_t heap_bytes = top - base;
+    if(heap_bytes > HANDLE_COMPACT_MIN && heap_bytes - live_bytes > live_bytes)
+        _handle_compact(HANDLE_ALLOC_STEP);
+
+    // Out of room: finish this pass (if one is running), and then try a whole one
+    if((size_t)(base + HANDLE_HEAP_RESERVE - top) < need)
+    {
+        if(src != NULL)
+            _handle_compact(0);
+        _handle_compact(0);
+    }
+
+    struct handle* handle = free_handles;
+    if(handle != NULL)
+        free_handles = handle->next_free;
+    else if(table_used < HANDLE_MAX)
+        handle = &table[table_used++];
+
+    if(handle == NULL || (size_t)(base + HANDLE_HEAP_RESERVE - top) < need)
+    {
+        if(handle != NULL)
+        {
+            handle->next_free = free_handles;
+            free_handles = handle;
+        }
+        pthread_mutex_unlock(&handle_lock);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    struct hblock* block = (struct hblock*)top;
+    block->owner = handle;
+    block->size = need;
+    top += need;
+    if(top > touched)
+        touched = (uint8_t*)ALIGN_UP((uintptr_t)top, HANDLE_PAGE);
+
+    handle->data = (uint8_t*)block + HBLOCK_HEADER;
+    handle->size = size;
+    handle->locks = 0;
+    handle->next_free = NULL;
+
+    num_handles++;
+    live_bytes += need;
+    pthread_mutex_unlock(&handle_lock);
+
+    return handle;
+}
+
+void* hlock(handle_t handle)
+{
+    void* ptr;
+
+    pthread_mutex_lock(&handle_lock);
+    if(handle->locks++ == 0)
+        num_locked++;
+    ptr = handle->data;
+    pthread_mutex_unlock(&handle_lock);
+
+    return ptr;
+}
+
+void hunlock(handle_t handle)
+{
+    pthread_mutex_lock(&handle_lock);
+    if(handle->locks == 0)
+    {
+        printf("hunlock(): handle %p isn't locked!\n", (void*)handle);
+        abort();
+    }
+    if(--handle->locks == 0)
+        num_locked--;
+    pthread_mutex_unlock(&handle_lock);
+}
+
+size_t hsize(handle_t handle)
+{
+    return handle->size;
+}
+
+void hfree(handle_t handle)
+{
+    if(handle == NULL)
+        return;
+
+    pthread_mutex_lock(&handle_lock);
+    if(handle->data == NULL || handle->locks > 0)
+    {
+        printf("hfree(): handle %p is %s!\n", (void*)handle, handle->data == NULL ? "already free" : "locked");
+        abort();
+    }
+
+    struct hblock* block = (struct hblock*)(handle->data - HBLOCK_HEADER);
+    live_bytes -= block->size;
+    block->owner = NULL;
+
+    // A block at the top can go straight away
+    if((uint8_t*)block + block->size == top && src == NULL)
+        top = (uint8_t*)block;
+
+    handle->data = NULL;
+    handle->next_free = free_handles;
+    free_handles = handle;
+    num_handles--;
+    pthread_mutex_unlock(&handle_lock);
+}
+
+size_t hcompact(size_t budget)
+{
+    size_t released;
+
+    // Nothing to do (and nothing worth mapping) if no handle has been allocated yet
+    if(__atomic_load_n(&base, __ATOMIC_ACQUIRE) == NULL)
+        return 0;
+
+    pthread_mutex_lock(&handle_lock);
+    released = _handle_compact(budget);
+    pthread_mutex_unlock(&handle_lock);
+
+    return released;
+}
+
+void hstats(handle_stats_t* stats)
+{
+    bool mapped = __atomic_load_n(&base, __ATOMIC_ACQUIRE) != NULL;
+
+    pthread_mutex_lock(&handle_lock);
+    stats->handles = num_handles;
+    stats->locked = num_locked;
+    stats->live_bytes = live_bytes;
+    stats->heap_bytes = mapped ? (size_t)(top - base) : 0;
+    stats->resident_bytes = mapped ? (size_t)(touched - base) : 0;
+    pthread_mutex_unlock(&handle_lock);
+}
@@ -0,0 +1,238 @@
+/**
+ * Implementation of heap.h
+ */
+#include "heap.h"
+#include "probes.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static bool             init = false;
+static size_t           brk_start;
+static size_t           brk_end;
+static pthread_mutex_t  brk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * A chunk of memory obtained from the OS in one go. New blocks are carved off its
+ * top with an atomic compare-and-swap, so brk_lock is only taken to replace it.
+ * The header lives at the start of the chunk.
+ */
+struct heap_chunk
+{
+    uint8_t*    top;    // Next uncarved byte
+    uint8_t*    end;    // One past the last byte of the chunk
+};
+
+#define HEAP_CHUNK_HEADER   ((sizeof(struct heap_chunk) + HEAP_ALIGN - 1) & ~(size_t)(HEAP_ALIGN - 1))
+
+static struct heap_chunk*   cur_chunk = NULL;               // Chunk we are currently carving from
+static size_t               next_chunk = HEAP_CHUNK_MIN;    // Size of the next chunk we ask the OS for
+
+static size_t           hp_reserve = 0;     // Requested size of the huge page mapping
+static uint8_t*         hp_base = NULL;     // Start of the huge page mapping (NULL if there isn't one)
+static uint8_t*         hp_top = NULL;      // Next unused byte in the mapping
+static uint8_t*         hp_end = NULL;      // One past the end of the mapping
+
+void heap_set_hugepage_reserve(size_t bytes)
+{
+    if(init)
+    {
+        printf("heap_set_hugepage_reserve: heap is already initialised, ignoring!\n");
+        return;
+    }
+
+    hp_reserve = bytes;
+}
+
+/**
+ * Map the huge page reservation.
+ *
+ * mmap() only promises page alignment, so we over-map by a huge page, and trim the
+ * slop off either side to get a 2 MiB aligned region. Failing to get huge pages isn't
+ * fatal; we just end up with a normal anonymous mapping (or plain sbrk() if even the
+ * mapping fails).
+ */
+static void _heap_map_hugepages()
+{
+    size_t      len = (hp_reserve + HUGEPAGE_SIZE - 1) & ~(size_t)(HUGEPAGE_SIZE - 1);
+    uint8_t*    map = mmap(NULL, len + HUGEPAGE_SIZE, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if(map == MAP_FAILED)
+    {
+        fprintf(stderr, "heap: unable to reserve %ld bytes for the huge page heap (%s), using sbrk\n",
+                len, strerror(errno));
+        return;
+    }
+
+    uint8_t* base = (uint8_t*)(((uintptr_t)map + HUGEPAGE_SIZE - 1) & ~(uintptr_t)(HUGEPAGE_SIZE - 1));
+    if(base > map)
+        munmap(map, base - map);
+    if(map + len + HUGEPAGE_SIZE > base + len)
+        munmap(base + len, (map + len + HUGEPAGE_SIZE) - (base + len));
+
+#ifdef MADV_HUGEPAGE
+    if(madvise(base, len, MADV_HUGEPAGE) != 0)
+        fprintf(stderr, "heap: transparent huge pages unavailable (%s), using normal pages\n", strerror(errno));
+#else
+    fprintf(stderr, "heap: MADV_HUGEPAGE not supported on this platform, using normal pages\n");
+#endif
+
+    hp_base = base;
+    hp_top  = base;
+    hp_end  = base + len;
+}
+
+void heap_init()
+{
+    pthread_mutex_lock(&brk_lock);
+    if(!init)
+    {
+        brk_start = (size_t)sbrk(0);
+        brk_end = brk_start;
+        if(hp_reserve > 0)
+            _heap_map_hugepages();
+        init = true;
+    }
+    pthread_mutex_unlock(&brk_lock);
+}
+
+/**
+ * Get 'size' bytes of fresh memory from the OS (the huge page mapping if there's
+ * room left in it, otherwise sbrk()). Caller holds brk_lock.
+ */
+static uint8_t* _heap_os_grow(size_t size)
+{
+    uint8_t* ptr;
+
+    if(hp_base != NULL && (size_t)(hp_end - hp_top) >= size)
+    {
+        ptr = hp_top;
+        hp_top += size;
+        return ptr;
+    }
+
+    ptr = sbrk(size);
+    if(ptr == (void*)-1)
+        return NULL;
+
+    brk_end = (size_t)ptr + size;
+    return ptr;
+}
+
+/**
+ * Try to carve 'size' bytes from the top of 'chunk' without taking any locks.
+ */
+static inline void* _heap_carve(struct heap_chunk* chunk, size_t size)
+{
+    uint8_t* top = __atomic_load_n(&chunk->top, __ATOMIC_RELAXED);
+
+    do
+    {
+        if((size_t)(chunk->end - top) < size)
+            return NULL;
+    } while(!__atomic_compare_exchange_n(&chunk->top, &top, top + size, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return top;
+}
+
+/**
+ * Replace the current chunk with a new one that can hold at least 'size' bytes,
+ * and carve 'size' bytes from it. Caller holds brk_lock.
+ */
+static void* _heap_refill(size_t size)
+{
+    struct heap_chunk*  old = cur_chunk;
+    uint8_t*            tail = NULL;
+    size_t              chunk_size = next_chunk;
+
+    if(chunk_size < size + HEAP_CHUNK_HEADER)
+        chunk_size = (size + HEAP_CHUNK_HEADER + HEAP_CHUNK_MIN - 1) & ~(size_t)(HEAP_CHUNK_MIN - 1);
+
+    // Claim whatever is left at the top of the old chunk, so nobody else can carve it
+    // while we're replacing it. If the new memory turns out to be contiguous, the tail
+    // becomes the start of the new chunk rather than going to waste.
+    if(old != NULL)
+    {
+        tail = __atomic_exchange_n(&old->top, old->end, __ATOMIC_RELAXED);
+        if(tail > old->end)
+            tail = old->end;
+    }
+
+    // Ask for a little extra in case the break isn't aligned (someone else may be using sbrk() too)
+    uint8_t* mem = _heap_os_grow(chunk_size + HEAP_ALIGN);
+    if(mem == NULL)
+        return NULL;
+    PROBE2(heap_grow, mem, chunk_size + HEAP_ALIGN);
+
+    uint8_t* start = (uint8_t*)(((uintptr_t)mem + HEAP_ALIGN - 1) & ~(uintptr_t)(HEAP_ALIGN - 1));
+    if(old != NULL && mem == old->end)
+        start = tail;
+
+    struct heap_chunk* chunk = (struct heap_chunk*)start;
+    chunk->top = start + HEAP_CHUNK_HEADER + size;
+    chunk->end = mem + chunk_size + HEAP_ALIGN;
+
+    // Publish the new chunk only once it's fully set up
+    __atomic_store_n(&cur_chunk, chunk, __ATOMIC_RELEASE);
+
+    if(next_chunk < HEAP_CHUNK_MAX)
+        next_chunk *= 2;
+
+    return start + HEAP_CHUNK_HEADER;
+}
+
+void* heap_grow(size_t size)
+{
+    struct heap_chunk*  chunk;
+    void*               ptr;
+
+    size = (size + HEAP_ALIGN - 1) & ~(size_t)(HEAP_ALIGN - 1);
+
+    // Fast path: carve from the current chunk
+    chunk = __atomic_load_n(&cur_chunk, __ATOMIC_ACQUIRE);
+    if(chunk != NULL && (ptr = _heap_carve(chunk, size)) != NULL)
+        return ptr;
+
+    pthread_mutex_lock(&brk_lock);
+
+    // Someone may have refilled while we were waiting for the lock
+    chunk = cur_chunk;
+    if(chunk != NULL && (ptr = _heap_carve(chunk, size)) != NULL)
+    {
+        pthread_mutex_unlock(&brk_lock);
+        return ptr;
+    }
+
+    ptr = _heap_refill(size);
+    pthread_mutex_unlock(&brk_lock);
+
+    return ptr;
+}
+
+size_t heap_start()
+{
+    return brk_start;
+}
+
+size_t heap_end()
+{
+    return brk_end;
+}
+
+size_t heap_size()
+{
+    size_t size;
+
+    pthread_mutex_lock(&brk_lock);
+    size = (brk_end - brk_start) + (size_t)(hp_top - hp_base);
+    pthread_mutex_unlock(&brk_lock);
+
+    return size;
+}
@@ -0,0 +1,65 @@
+/**
+ * Heap growth interface
+ *
+ * Every strategy in the allocator gets its memory from the same place, so all
+ * calls that move the program break are funnelled through here. This keeps the
+ * 'brk_lock' in one spot, instead of each strategy racing the others for sbrk().
+ *
+ * With the huge page heap enabled, the "program break" is really the top of the
+ * huge page mapping until that runs out.
+ */
+#ifndef _HEAP_H_
+#define _HEAP_H_
+
+#include <stddef.h>
+
+#define HUGEPAGE_SIZE   (2 * 1024 * 1024)
+#define HEAP_ALIGN      16                      /** Alignment of everything heap_grow() returns */
+#define HEAP_CHUNK_MIN  (64 * 1024)             /** Size of the first chunk requested from the OS */
+#define HEAP_CHUNK_MAX  (4 * 1024 * 1024)       /** Chunks double in size up to this */
+
+/**
+ * Reserve 'bytes' of 2 MiB aligned address space for the heap, backed by transparent
+ * huge pages where the kernel allows it. Heap growth is served from this mapping until
+ * it runs out, after which we fall back to sbrk().
+ *
+ * Must be called before heap_init() to have any effect. 0 disables the mapping.
+ */
+void heap_set_hugepage_reserve(size_t bytes);
+
+/**
+ * Initialise the heap (records the starting program break, and maps the huge page
+ * reservation if one was requested)
+ */
+void heap_init();
+
+/**
+ * Grow the heap by 'size' bytes (rounded up to HEAP_ALIGN).
+ *
+ * The heap is extended from the OS in large chunks that double in size from
+ * HEAP_CHUNK_MIN up to HEAP_CHUNK_MAX, and requests are carved from the current
+ * chunk without a syscall or taking brk_lock. Successive calls are not guaranteed
+ * to return contiguous memory.
+ *
+ * Returns a pointer to the start of the new memory, or NULL if the heap
+ * could not be extended.
+ */
+void* heap_grow(size_t size);
+
+/**
+ * Get the start of the heap
+ */
+size_t heap_start();
+
+/**
+ * Get the current end of the heap
+ */
+size_t heap_end();
+
+/**
+ * Get the number of bytes the heap has taken from the OS (program break growth, plus the
+ * part of the huge page mapping handed out so far)
+ */
+size_t heap_size();
+
+#endif
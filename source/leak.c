@@ -0,0 +1,315 @@
+/**
+ * Implementation of leak.h
+ */
+#include "leak.h"
+#include "allocator.h"
+
+#include <execinfo.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define LEAK_STRIPES        64                  // Independently locked slices of the table
+#define LEAK_BUCKETS        4096                // Hash buckets per stripe
+#define LEAK_TRACE_DEPTH    16
+#define LEAK_SKIP_FRAMES    2                   // leak_record() and alloc()
+#define LEAK_ARENA_SIZE     (1 << 20)
+#define LEAK_TOP_SITES      25                  // Call sites printed in the report
+
+/**
+ * A live allocation
+ */
+struct leak_record
+{
+    struct leak_record* next;                   // Next record in the bucket (or the free list)
+    void*               ptr;
+    size_t              size;
+    void*               site;                   // Return address of the alloc() call
+    int                 depth;                  // Frames in 'trace' (0 without backtraces)
+    void*               trace[LEAK_TRACE_DEPTH];
+};
+
+struct leak_stripe
+{
+    pthread_mutex_t     lock;
+    struct leak_record* free;
+    uint8_t*            arena_top;              // Records are carved from mmap()ed arenas,
+    uint8_t*            arena_end;              // so tracking never calls back into alloc()
+    struct leak_record* buckets[LEAK_BUCKETS];
+} __attribute__((aligned(64)));
+
+/**
+ * Everything leaked from one call site
+ */
+struct leak_site
+{
+    void*                       site;
+    size_t                      count;
+    size_t                      bytes;
+    const struct leak_record*   example;        // One of the leaked blocks (for its backtrace)
+};
+
+int  leak_mode = ALLOC_LEAKS_OFF;
+bool leak_tracked = false;
+
+static struct leak_stripe*  stripes = NULL;
+static pthread_once_t       stripes_once = PTHREAD_ONCE_INIT;
+static bool                 report_registered = false;
+
+static inline size_t _leak_hash(const void* ptr)
+{
+    uintptr_t x = (uintptr_t)ptr >> 4;
+    x ^= x >> 15;
+    x *= 0x2c1b3c6dU;
+    x ^= x >> 12;
+    return (size_t)x;
+}
+
+static void _leak_init()
+{
+    stripes = mmap(NULL, LEAK_STRIPES * sizeof(struct leak_stripe), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(stripes == MAP_FAILED)
+    {
+        printf("leak: unable to map the leak table!\n");
+        abort();
+    }
+
+    for(size_t i = 0; i < LEAK_STRIPES; i++)
+        pthread_mutex_init(&stripes[i].lock, NULL);
+}
+
+void leak_set_mode(int mode)
+{
+    pthread_once(&stripes_once, _leak_init);
+
+    if(mode != ALLOC_LEAKS_OFF && !report_registered)
+    {
+        atexit(leak_report);
+        report_registered = true;
+    }
+
+    if(mode != ALLOC_LEAKS_OFF)
+        leak_tracked = true;
+
+    leak_mode = mode;
+}
+
+__attribute__((noinline)) void leak_record(void* ptr, size_t size, void* site)
+{
+    size_t              hash = _leak_hash(ptr);
+    struct leak_stripe* stripe = &stripes[hash % LEAK_STRIPES];
+    struct leak_record* record;
+    void*               trace[LEAK_TRACE_DEPTH + LEAK_SKIP_FRAMES];
+    int                 depth = 0;
+
+    if(leak_mode == ALLOC_LEAKS_BACKTRACES)
+    {
+        depth = backtrace(trace, LEAK_TRACE_DEPTH + LEAK_SKIP_FRAMES) - LEAK_SKIP_FRAMES;
+        if(depth < 0)
+            depth = 0;
+    }
+
+    pthread_mutex_lock(&stripe->lock);
+    record = stripe->free;
+    if(record != NULL)
+    {
+        stripe->free = record->next;
+    }
+    else
+    {
+        if(stripe->arena_top == NULL || stripe->arena_top + sizeof(struct leak_record) > stripe->arena_end)
+        {
+            void* arena = mmap(NULL, LEAK_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if(arena == MAP_FAILED)
+            {
+                pthread_mutex_unlock(&stripe->lock);
+                return;
+            }
+
+            stripe->arena_top = arena;
+            stripe->arena_end = stripe->arena_top + LEAK_ARENA_SIZE;
+        }
+
+        record = (struct leak_record*)stripe->arena_top;
+        stripe->arena_top += sizeof(struct leak_record);
+    }
+
+    record->ptr     = ptr;
+    record->size    = size;
+    record->site    = site;
+    record->depth   = depth;
+    memcpy(record->trace, trace + LEAK_SKIP_FRAMES, depth * sizeof(void*));
+
+    size_t bucket = (hash / LEAK_STRIPES) % LEAK_BUCKETS;
+    record->next = stripe->buckets[bucket];
+    stripe->buckets[bucket] = record;
+    pthread_mutex_unlock(&stripe->lock);
+}
+
+void leak_forget(void* ptr)
+{
+    size_t              hash = _leak_hash(ptr);
+    struct leak_stripe* stripe = &stripes[hash % LEAK_STRIPES];
+
+    pthread_mutex_lock(&stripe->lock);
+    struct leak_record** link = &stripe->buckets[(hash / LEAK_STRIPES) % LEAK_BUCKETS];
+    while(*link != NULL && (*link)->ptr != ptr)
+        link = &(*link)->next;
+
+    struct leak_record* record = *link;
+    if(record != NULL)
+    {
+        *link = record->next;
+        record->next = stripe->free;
+        stripe->free = record;
+    }
+    pthread_mutex_unlock(&stripe->lock);
+}
+
+static int _leak_site_compare(const void* a, const void* b)
+{
+    const struct leak_site* x = a;
+    const struct leak_site* y = b;
+
+    if(x->bytes != y->bytes)
+        return (x->bytes < y->bytes) ? 1 : -1;
+
+    return (x->count < y->count) - (x->count > y->count);
+}
+
+/**
+ * Count the blocks still in use that were allocated before tracking was turned on
+ */
+static int _leak_untracked_callback(const alloc_block_info_t* block, void* ctx)
+{
+    size_t*             untracked = ctx;
+    size_t              hash = _leak_hash(block->ptr);
+    struct leak_stripe* stripe = &stripes[hash % LEAK_STRIPES];
+    struct leak_record* record;
+
+    if(!block->in_use)
+        return 0;
+
+    pthread_mutex_lock(&stripe->lock);
+    for(record = stripe->buckets[(hash / LEAK_STRIPES) % LEAK_BUCKETS]; record != NULL; record = record->next)
+    {
+        if(record->ptr == block->ptr)
+            break;
+    }
+    pthread_mutex_unlock(&stripe->lock);
+
+    if(record == NULL)
+        untracked[0]++;
+
+    return 0;
+}
+
+void leak_report()
+{
+    size_t  num_sites = 0, max_sites = 1024;
+    size_t  total_count = 0, total_bytes = 0;
+    size_t  untracked = 0;
+
+    if(stripes == NULL)
+        return;
+
+    // Open addressed table of call sites, kept at most half full
+    struct leak_site* sites = mmap(NULL, max_sites * sizeof(struct leak_site), PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(sites == MAP_FAILED)
+        return;
+    memset(sites, 0, max_sites * sizeof(struct leak_site));
+
+    for(size_t i = 0; i < LEAK_STRIPES; i++)
+    {
+        pthread_mutex_lock(&stripes[i].lock);
+        for(size_t j = 0; j < LEAK_BUCKETS; j++)
+        {
+            for(struct leak_record* record = stripes[i].buckets[j]; record != NULL; record = record->next)
+            {
+                if(num_sites * 2 >= max_sites)
+                {
+                    struct leak_site* bigger = mmap(NULL, 2 * max_sites * sizeof(struct leak_site), PROT_READ | PROT_WRITE,
+                                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                    if(bigger == MAP_FAILED)
+                        break;
+
+                    memset(bigger, 0, 2 * max_sites * sizeof(struct leak_site));
+                    for(size_t k = 0; k < max_sites; k++)
+                    {
+                        if(sites[k].count == 0)
+                            continue;
+
+                        size_t slot = _leak_hash(sites[k].site) % (2 * max_sites);
+                        while(bigger[slot].count != 0)
+                            slot = (slot + 1) % (2 * max_sites);
+                        bigger[slot] = sites[k];
+                    }
+
+                    munmap(sites, max_sites * sizeof(struct leak_site));
+                    sites = bigger;
+                    max_sites *= 2;
+                }
+
+                size_t slot = _leak_hash(record->site) % max_sites;
+                while(sites[slot].count != 0 && sites[slot].site != record->site)
+                    slot = (slot + 1) % max_sites;
+
+                if(sites[slot].count == 0)
+                {
+                    sites[slot].site    = record->site;
+                    sites[slot].example = record;
+                    num_sites++;
+                }
+
+                sites[slot].count++;
+                sites[slot].bytes += record->size;
+                total_count++;
+                total_bytes += record->size;
+            }
+        }
+        pthread_mutex_unlock(&stripes[i].lock);
+    }
+
+    allocator_walk(_leak_untracked_callback, &untracked);
+
+    // Squash the table down, and put the worst offenders first
+    size_t used = 0;
+    for(size_t i = 0; i < max_sites; i++)
+    {
+        if(sites[i].count != 0)
+            sites[used++] = sites[i];
+    }
+    qsort(sites, used, sizeof(struct leak_site), _leak_site_compare);
+
+    printf("\nLeak report: %ld bytes in %ld blocks from %ld call sites\n", total_bytes, total_count, num_sites);
+    if(untracked > 0)
+        printf("(plus %ld blocks allocated before leak tracking was turned on)\n", untracked);
+
+    for(size_t i = 0; i < used && i < LEAK_TOP_SITES; i++)
+    {
+        char** symbol = backtrace_symbols(&sites[i].site, 1);
+
+        printf("%10ld bytes in %6ld blocks allocated from %s\n", sites[i].bytes, sites[i].count,
+               symbol ? symbol[0] : "??");
+        free(symbol);
+
+        if(sites[i].example->depth > 0)
+        {
+            fflush(stdout);
+            backtrace_symbols_fd(sites[i].example->trace, sites[i].example->depth, STDOUT_FILENO);
+        }
+    }
+
+    if(used > LEAK_TOP_SITES)
+        printf("... and %ld more call sites\n", used - LEAK_TOP_SITES);
+
+    fflush(stdout);
+    munmap(sites, max_sites * sizeof(struct leak_site));
+}
@@ -0,0 +1,40 @@
+/**
+ * Leak tracking
+ *
+ * While tracking is on, every allocation is recorded along with its call site (the
+ * return address of alloc(), which costs nothing to capture) and, optionally, a full
+ * backtrace. Records live in a hash table striped over several locks, keyed by address,
+ * and are dropped again when the block is freed. Whatever is still recorded at exit is
+ * reported, grouped by call site and sorted by the number of bytes each site leaked.
+ */
+#ifndef _LEAK_H_
+#define _LEAK_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+extern int  leak_mode;      /** One of the ALLOC_LEAKS_* modes in allocator.h */
+extern bool leak_tracked;   /** True once tracking has been on (so frees must still be forgotten) */
+
+/**
+ * Set the tracking mode. The report is registered to run at exit the first time
+ * tracking is turned on.
+ */
+void leak_set_mode(int mode);
+
+/**
+ * Record a new allocation made from 'site'
+ */
+void leak_record(void* ptr, size_t size, void* site);
+
+/**
+ * Drop the record for 'ptr' (if there is one)
+ */
+void leak_forget(void* ptr);
+
+/**
+ * Print every allocation that is still live, grouped by call site
+ */
+void leak_report();
+
+#endif
@@ -3,6 +3,9 @@
  * 
  */
 #include "memblk.h"
+#include "bins.h"
+
+#include <stdint.h>
 
 void list_append_block(list_t* list, memblk_t* block)
 {
@@ -19,10 +22,19 @@ void list_append_block(list_t* list, memblk_t* block)
     
     list->tail = block; 
     list->tail->next = NULL;
+
+    block->list = list;
+    block->seq = ++list->seq;
+
+    if(list->bins != NULL)
+        bins_insert(list->bins, block);
 }
 
 void list_delete_block(list_t* list, memblk_t* block)
 {
+    if(list->bins != NULL)
+        bins_remove(list->bins, block);
+
     if(block == list->head)
     {
         list->head = block->next;
@@ -44,4 +56,73 @@ void list_delete_block(list_t* list, memblk_t* block)
 
     block->next = NULL;
     block->prev = NULL;
-}
\ No newline at end of file
+    block->list = NULL;
+}
+
+/**
+ * Merge two address sorted, NULL terminated chains (linked through 'next' only)
+ */
+static memblk_t* _list_merge(memblk_t* a, memblk_t* b)
+{
+    memblk_t    head;
+    memblk_t*   tail = &head;
+
+    while(a != NULL && b != NULL)
+    {
+        if((uintptr_t)a->data <= (uintptr_t)b->data)
+        {
+            tail->next = a;
+            a = a->next;
+        }
+        else
+        {
+            tail->next = b;
+            b = b->next;
+        }
+        tail = tail->next;
+    }
+
+    tail->next = (a != NULL) ? a : b;
+    return head.next;
+}
+
+/**
+ * Bottom-up merge sort. This needs no extra memory (which we can't exactly allocate
+ * in here), and is O(n log n) even on a list that is already mostly sorted.
+ */
+void list_sort_by_address(list_t* list)
+{
+    memblk_t*   runs[64] = {NULL};
+    memblk_t*   block = list->head;
+    memblk_t*   result = NULL;
+
+    while(block != NULL)
+    {
+        memblk_t* next = block->next;
+        block->next = NULL;
+
+        // runs[i] is either empty or a sorted chain of 2^i blocks
+        int i;
+        for(i = 0; i < 64 && runs[i] != NULL; i++)
+        {
+            block = _list_merge(runs[i], block);
+            runs[i] = NULL;
+        }
+        runs[i == 64 ? 63 : i] = block;
+
+        block = next;
+    }
+
+    for(int i = 0; i < 64; i++)
+        result = _list_merge(runs[i], result);
+
+    // Fix up the back links and the tail
+    memblk_t* prev = NULL;
+    list->head = result;
+    for(block = result; block != NULL; block = block->next)
+    {
+        block->prev = prev;
+        prev = block;
+    }
+    list->tail = prev;
+}
@@ -2,49 +2,85 @@
  *  Implementation of lock.h
  */
 #include "lock.h"
+#include "probes.h"
 
 #include <stdio.h>
 #include <string.h>
 
 /**
- * Initialise a read/write lock.
+ * Initialise a read/write lock, with its mutex and condition variables set to 'pshared'
+ * (PTHREAD_PROCESS_PRIVATE or PTHREAD_PROCESS_SHARED).
  */
-int rwlock_init(rwlock_t* lock)
+static int _rwlock_init(rwlock_t* lock, int pshared)
 {
-    if(lock == NULL)
-    {
-        printf("rwlock_init: lock == NULL!\n");
-        return -1;
-    }
+    pthread_mutexattr_t mutex_attr;
+    pthread_condattr_t  cond_attr;
+    int                 ret;
 
-    int ret;
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, pshared);
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, pshared);
 
-    ret = pthread_mutex_init(&lock->lock, NULL);
+    ret = pthread_mutex_init(&lock->lock, &mutex_attr);
     if(ret != 0)
     {
         printf("pthread_mutex_init failed! Reason: %s", strerror(ret));
-        return ret;
+        goto out;
     }
 
-    ret = pthread_cond_init(&lock->rd_cond, NULL);
+    ret = pthread_cond_init(&lock->rd_cond, &cond_attr);
     if(ret != 0)
     {
         printf("pthread_cond_init failed! Reason: %s", strerror(ret));
-        return ret;
+        goto out;
     }
 
-    ret = pthread_cond_init(&lock->wr_cond, NULL);
+    ret = pthread_cond_init(&lock->wr_cond, &cond_attr);
     if(ret != 0)
     {
         printf("pthread_cond_init failed! Reason: %s", strerror(ret));
-        return ret;
+        goto out;
     }
 
     lock->num_readers = 0;
     lock->wr_queue = 0;
     lock->rd_queue = 0;;
     lock->writer_id = 0;
-    return 0;
+    lock->contended = 0;
+
+out:
+    pthread_condattr_destroy(&cond_attr);
+    pthread_mutexattr_destroy(&mutex_attr);
+    return ret;
+}
+
+/**
+ * Initialise a read/write lock.
+ */
+int rwlock_init(rwlock_t* lock)
+{
+    if(lock == NULL)
+    {
+        printf("rwlock_init: lock == NULL!\n");
+        return -1;
+    }
+
+    return _rwlock_init(lock, PTHREAD_PROCESS_PRIVATE);
+}
+
+/**
+ * Initialise a read/write lock that several processes can use.
+ */
+int rwlock_init_shared(rwlock_t* lock)
+{
+    if(lock == NULL)
+    {
+        printf("rwlock_init_shared: lock == NULL!\n");
+        return -1;
+    }
+
+    return _rwlock_init(lock, PTHREAD_PROCESS_SHARED);
 }
 
 /**
@@ -73,13 +109,16 @@ int rwlock_wrlock(rwlock_t* lock)
     if(lock->num_readers == -1 || lock->num_readers > 0)
     {
         lock->wr_queue++; // Increment the number of writers in the queue
+        lock->contended++;
 
         // Block here until we get a signal from rwlock_unlock()
+        PROBE2(rwlock_wait, lock, 1);
         do
             pthread_cond_wait(&lock->wr_cond, &lock->lock);
         while(lock->num_readers == -1 || lock->num_readers > 0);
 
         lock->wr_queue--; // If we've unblocked, there's one less writer in the queue (that's us!).
+        PROBE2(rwlock_acquired, lock, 1);
     }
 
     // Inform other threads there is a write in progress.
@@ -112,15 +151,18 @@ int rwlock_rdlock(rwlock_t* lock)
     if(lock->num_readers == -1 || lock->wr_queue > 0)
     {
         lock->rd_queue++; // Add this reader to the queue of readers
+        lock->contended++;
 
         // All threads that are waiting here unblock when the cond signal
         // is sent. 
+        PROBE2(rwlock_wait, lock, 0);
         do
             pthread_cond_wait(&lock->rd_cond, &lock->lock);
         while(lock->num_readers == -1);
 
         // If we get here, it means that 'pthread_cond_wait()' has unblocked, hence the writer has relinquised the lock
         lock->rd_queue--;
+        PROBE2(rwlock_acquired, lock, 0);
     }
  
     
@@ -27,7 +27,7 @@
 #include <pthread.h>
 #include <stdint.h>
 
-#define RWLOCK_INITIALIZER { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, 0 }
+#define RWLOCK_INITIALIZER { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, 0, 0 }
 /**
  *  rwlock
  */
@@ -40,6 +40,7 @@ typedef struct
     int                 rd_queue;
     int                 wr_queue;
     pthread_t           writer_id;      /**< Stores the TID of the writer */
+    uint64_t            contended;      /**< Number of times a caller had to queue for the lock */
 } rwlock_t;
 
 /**
@@ -47,6 +48,13 @@ typedef struct
  */
 int rwlock_init(rwlock_t* lock);
 
+/**
+ * Initialise an rwlock that can be shared between processes. The lock has to live in
+ * memory that every process maps (a MAP_SHARED file or shared memory segment). A process
+ * that dies holding the lock leaves it held.
+ */
+int rwlock_init_shared(rwlock_t* lock);
+
 /**
  *  Acquire the read lock
  */
@@ -3,6 +3,7 @@
  */
 #include <ctype.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -20,6 +21,9 @@
 #define NUMBER_ITERATIONS   1
 #define NUMBER_OF_THREADS   12
 
+#define PC_ITEMS_PER_PAIR   5000    // Messages each producer sends its consumer
+#define PC_RING_SIZE        1024    // Messages in flight between a producer and its consumer
+
 // sizeof == 8 bytes
 typedef struct
 {
@@ -66,12 +70,60 @@ typedef enum
 
 static allocation_type          alloc_type = SMALL;
 
+/**
+ * Single producer, single consumer ring of messages
+ */
+typedef struct
+{
+    char*           slots[PC_RING_SIZE];
+    size_t          head;       // Next slot the consumer reads (only written by the consumer)
+    size_t          tail;       // Next slot the producer writes (only written by the producer)
+    unsigned int    seed;       // Producer's random seed
+    size_t          checksum;   // Consumer's running checksum (stops the reads being optimised out)
+} pc_ring;
+
+static const size_t message_sizes[] = {sizeof(small_struct), sizeof(medium_struct), sizeof(big_struct),
+                                       sizeof(huge_struct), sizeof(insane_struct)};
+
 void print_info()
 {
     printf("average allocated size \t= %ld\n", average_allocated_size());
     printf("average free size \t= %ld\n", average_free_size());
     printf("number of blocks \t= %ld\n", number_of_allocated_blocks());
     printf("number of free blocks \t= %ld\n", number_of_free_blocks());
+
+    printf("shard\tallocated\tfree\talloc waits\tfree waits\n");
+    for(size_t i = 0; i < ALLOC_SHARDS; i++)
+    {
+        alloc_shard_stats_t stats;
+
+        allocator_shard_stats(i, &stats);
+        printf("%zu\t%zu\t\t%zu\t%llu\t\t%llu\n", i, stats.allocated_blocks, stats.free_blocks,
+               (unsigned long long)stats.alloc_contended, (unsigned long long)stats.free_contended);
+    }
+}
+
+/**
+ * Allocate (and free) a few blocks bigger than the heaps grow by in one go, including one
+ * past the TLSF heap's largest pool (16 MiB). Any failure is a bug, so abort.
+ */
+void check_large_allocs()
+{
+    static const size_t sizes[] = {300000, 1000000, 20 * 1024 * 1024};
+
+    for(size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        uint8_t* ptr = alloc(sizes[i]);
+        if(ptr == NULL)
+        {
+            printf("alloc(%zu) failed!\n", sizes[i]);
+            abort();
+        }
+
+        ptr[0] = 1;
+        ptr[sizes[i] - 1] = 1;
+        dealloc(ptr);
+    }
 }
 
 /**
@@ -113,11 +165,108 @@ void* thread_func(void* data)
     return 0;
 }
 
+/**
+ * Producer half of the producer/consumer workload.
+ *
+ * Allocates messages and hands them to the consumer, which frees them. Every
+ * deallocation is therefore cross-thread, and goes through our remote free queue.
+ */
+void* producer_func(void* data)
+{
+    pc_ring* ring = data;
+
+    for(size_t i = 0; i < PC_ITEMS_PER_PAIR; i++)
+    {
+        size_t  len = message_sizes[rand_r(&ring->seed) % (sizeof(message_sizes) / sizeof(message_sizes[0]))];
+        char*   msg = alloc(len);
+        memset(msg, (int)i, len);
+
+        while(ring->tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == PC_RING_SIZE)
+            sched_yield();
+
+        ring->slots[ring->tail % PC_RING_SIZE] = msg;
+        __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+/**
+ * Consumer half of the producer/consumer workload
+ */
+void* consumer_func(void* data)
+{
+    pc_ring* ring = data;
+
+    for(size_t i = 0; i < PC_ITEMS_PER_PAIR; i++)
+    {
+        while(__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ring->head)
+            sched_yield();
+
+        char* msg = ring->slots[ring->head % PC_RING_SIZE];
+        ring->checksum += (unsigned char)msg[0];
+        dealloc(msg);
+
+        __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+/**
+ * Run the producer/consumer workload with an increasing number of producer/consumer
+ * pairs, and print the throughput of each run.
+ */
+void producer_consumer()
+{
+    static pc_ring  rings[NUMBER_OF_THREADS / 2];
+    pthread_t       producers[NUMBER_OF_THREADS / 2];
+    pthread_t       consumers[NUMBER_OF_THREADS / 2];
+    int             pair_counts[] = {1, 2, 4, NUMBER_OF_THREADS / 2};
+
+    for(size_t run = 0; run < sizeof(pair_counts) / sizeof(pair_counts[0]); run++)
+    {
+        int             pairs = pair_counts[run];
+        size_t          remote_before = number_of_remote_frees();
+        struct timespec start, end;
+
+        memset(rings, 0, sizeof(rings));
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(int i = 0; i < pairs; i++)
+        {
+            rings[i].seed = i + 1;
+            if(pthread_create(&consumers[i], NULL, consumer_func, &rings[i]) != 0 ||
+               pthread_create(&producers[i], NULL, producer_func, &rings[i]) != 0)
+            {
+                fprintf(stderr, "Can not create thread");
+                abort();
+            }
+        }
+
+        for(int i = 0; i < pairs; i++)
+        {
+            if(pthread_join(producers[i], NULL) != 0 || pthread_join(consumers[i], NULL) != 0)
+            {
+                fprintf(stderr, "Can not join thread");
+                abort();
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        size_t messages = (size_t)pairs * PC_ITEMS_PER_PAIR;
+        printf("%d pair(s): %ld messages in %.3f s (%.0f msgs/s), %ld remote frees\n",
+                pairs, messages, seconds, messages / seconds, number_of_remote_frees() - remote_before);
+    }
+}
+
 int main(int argc, char **argv)
 {
     if(argc <= 1)
     {
-        printf("usage: alloc <usage_type>\nUsage types are: first, best, worst\n\n");
+        printf("usage: alloc <usage_type> [workload]\nUsage types are: first, best, worst, tlsf\n"
+               "Workloads are: frag (default), prodcons\n"
+               "Set ALLOC_LEAK_REPORT=1 (or =full, for backtraces) to report leaked blocks at exit\n\n");
         exit(-1);
     }
 
@@ -137,12 +286,35 @@ int main(int argc, char **argv)
     {
         allocator_set_method(ALLOC_WF); // Set to the "Best Fit" allocation strategy
     }
+    else if(!strcmp(strategy, "tlsf"))
+    {
+        allocator_set_method(ALLOC_TLSF); // Set to the "Two-Level Segregated Fit" allocation strategy
+    }
     else
     {
         printf("invalid strategy %s!\n", strategy);
         exit(-1);
     }
 
+    // Report whatever is still allocated at exit, grouped by the call site that allocated it
+    char* leaks = getenv("ALLOC_LEAK_REPORT");
+    if(leaks != NULL && strcmp(leaks, "0"))
+        allocator_set_leak_report(!strcmp(leaks, "full") ? ALLOC_LEAKS_BACKTRACES : ALLOC_LEAKS_SITES);
+
+    check_large_allocs();
+
+    if(argc > 2 && !strcmp(argv[2], "prodcons"))
+    {
+        producer_consumer();
+        print_info();
+        return 0;
+    }
+    else if(argc > 2 && strcmp(argv[2], "frag"))
+    {
+        printf("invalid workload %s!\n", argv[2]);
+        exit(-1);
+    }
+
     medium_struct*      mediumAllocs[STRUCT_ARRAY_SIZE];
     big_struct*         bigAllocs[STRUCT_ARRAY_SIZE];
     huge_struct*        hugeAllocs[STRUCT_ARRAY_SIZE];
@@ -0,0 +1,107 @@
+/**
+ * Implementation of maintenance.h
+ */
+#include "maintenance.h"
+#include "allocator.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define MAINT_HANDLE_BUDGET (1024 * 1024)   // Bytes of handle objects moved per pass
+
+static pthread_t        maint_thread;
+static bool             running = false;
+static unsigned         interval_ms;
+static unsigned         budget_pct;
+static pthread_mutex_t  maint_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   maint_cond = PTHREAD_COND_INITIALIZER;
+
+static uint64_t _now_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void* _maintenance_func(void* data)
+{
+    (void)data;
+
+    pthread_mutex_lock(&maint_lock);
+    while(running)
+    {
+        pthread_mutex_unlock(&maint_lock);
+
+        uint64_t cpu_start = _now_ns(CLOCK_THREAD_CPUTIME_ID);
+        allocator_flush_thread_caches();
+        allocator_coalesce();
+        allocator_trim();
+        hcompact(MAINT_HANDLE_BUDGET);
+        uint64_t cpu_used = _now_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+
+        // If that pass took a while, back off for long enough to stay within the budget
+        uint64_t sleep_ns = (uint64_t)interval_ms * 1000000ULL;
+        uint64_t budget_ns = cpu_used * (100 - budget_pct) / budget_pct;
+        if(sleep_ns < budget_ns)
+            sleep_ns = budget_ns;
+
+        uint64_t        wake = _now_ns(CLOCK_REALTIME) + sleep_ns;
+        struct timespec deadline = {(time_t)(wake / 1000000000ULL), (long)(wake % 1000000000ULL)};
+
+        pthread_mutex_lock(&maint_lock);
+        while(running)
+        {
+            if(pthread_cond_timedwait(&maint_cond, &maint_lock, &deadline) == ETIMEDOUT)
+                break;
+        }
+    }
+    pthread_mutex_unlock(&maint_lock);
+
+    return NULL;
+}
+
+void maintenance_start(unsigned interval, unsigned cpu_budget_pct)
+{
+    pthread_mutex_lock(&maint_lock);
+    if(running)
+    {
+        pthread_mutex_unlock(&maint_lock);
+        return;
+    }
+
+    interval_ms = interval;
+    budget_pct = cpu_budget_pct;
+    if(budget_pct == 0 || budget_pct > 100)
+        budget_pct = 100;
+
+    running = true;
+    int ret = pthread_create(&maint_thread, NULL, _maintenance_func, NULL);
+    if(ret != 0)
+    {
+        fprintf(stderr, "maintenance_start: unable to create maintenance thread! Reason: %s\n", strerror(ret));
+        running = false;
+    }
+    pthread_mutex_unlock(&maint_lock);
+}
+
+void maintenance_stop()
+{
+    pthread_mutex_lock(&maint_lock);
+    if(!running)
+    {
+        pthread_mutex_unlock(&maint_lock);
+        return;
+    }
+
+    running = false;
+    pthread_cond_signal(&maint_cond);
+    pthread_mutex_unlock(&maint_lock);
+
+    pthread_join(maint_thread, NULL);
+}
@@ -0,0 +1,23 @@
+/**
+ * Background maintenance thread
+ *
+ * Keeps fragmentation cleanup off the alloc()/dealloc() path. Each pass hands back
+ * blocks stuck in idle threads' remote free queues, re-sorts and coalesces the free
+ * list, trims free pages back to the OS, and moves the handle heap's compactor along
+ * a step. Passes are spaced 'interval_ms' apart, or further if needed to keep the
+ * thread's CPU time under 'cpu_budget_pct' percent.
+ */
+#ifndef _MAINTENANCE_H_
+#define _MAINTENANCE_H_
+
+/**
+ * Start the maintenance thread (does nothing if it's already running)
+ */
+void maintenance_start(unsigned interval_ms, unsigned cpu_budget_pct);
+
+/**
+ * Stop the maintenance thread, and wait for it to exit
+ */
+void maintenance_stop();
+
+#endif
@@ -15,6 +15,13 @@
 
 #define BLOCK_MAGIC 0xcafebabe
 
+#define BLOCK_TRIMMED   0x1     // The free pages inside this block have been handed back to the OS
+#define BLOCK_PRIVATE   0x2     // Carved from its owner's span, and only ever reused by its owner
+#define BLOCK_FREED     0x4     // Passed to dealloc(), but may still be on the allocated list (in its owner's remote queue)
+
+struct thread_heap;
+struct bins;
+
 /**
  * Memory Block data structure
  *
@@ -24,11 +31,18 @@ struct memblk
 {
     pthread_mutex_t lock;   // This locks' block. Prevents a "double acquire".
     uint32_t        magic;	// Memblock magic number (to assure that this is a valid memory block!)
+    uint32_t        flags;  // BLOCK_* flags
     size_t          size;	// The size of this memory block in bytes
     void*           data;	// The actual data stored in this allocated block
     struct memblk*  prev;   // The previous block in the chain
     struct memblk*  next;	// The next memory block in the chain
-};
+    struct list*    list;           // The list this block is currently on (NULL if none)
+    uint64_t        seq;            // Value of list->seq when the block was appended to 'list'
+    struct thread_heap* owner;      // Thread heap of the thread that allocated this block
+    struct memblk*  remote_next;    // Next block in the owner's remote free queue
+    uint32_t        bin;            // Bin this block is in, while on a list with bins
+    uint32_t        bin_index;      // Its slot in that bin
+} __attribute__((aligned(16)));     // A new block's data follows its node, and has to stay 16 byte aligned
 
 typedef struct memblk memblk_t;
 
@@ -37,6 +51,8 @@ struct list
     memblk_t*   head;   /** First list element */
     memblk_t*   tail;   /** Last list element */
     rwlock_t    lock;   /** The lock for this list */
+    uint64_t    seq;    /** Number of appends so far (lets a heap walk tell if a block has moved) */
+    struct bins* bins;  /** Size bins mirroring this list (NULL if it has none), see bins.h */
 };
 
 typedef struct list list_t;
@@ -60,6 +76,11 @@ void list_append_block(list_t*, memblk_t*);
  */
 void list_delete_block(list_t*, memblk_t*);
 
+/**
+ * Sort a list by data address (lowest first)
+ */
+void list_sort_by_address(list_t*);
+
 /**
  * Non-allocator related block search
  */
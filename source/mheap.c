@@ -0,0 +1,762 @@
+/**
+ * Implementation of the persistent and shared heap functions in allocator.h
+ *
+ * The heap is a TLSF allocator (see tlsf.h) laid out inside a file. Everything in the file
+ * refers to everything else by its offset from the start of the file rather than by address,
+ * so the heap is valid wherever the file ends up mapped:
+ *
+ *      [ header | first block | ... | last block | sentinel ]
+ *
+ * The header holds the free list heads and bitmaps, the statistics, the roots and the heap's
+ * (process shared) lock. Blocks carry the same in-band header as TLSF blocks, with offsets in
+ * place of pointers.
+ *
+ * Shared heaps use exactly the same layout in a shared memory segment instead of a file, which
+ * is what lets every process map the segment at a different address.
+ */
+#define _GNU_SOURCE     // MAP_FIXED_NOREPLACE, memfd_create()
+
+#include "allocator.h"
+#include "lock.h"
+#include "tlsf.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0   // Older headers; the address is then only a hint
+#endif
+
+#define MHEAP_MAGIC         "MV2PHEAP"
+#define MHEAP_VERSION       2
+#define MHEAP_PAGE          4096
+#define MHEAP_BLOCK_FREE    0x1
+#define MHEAP_BLOCK_FLAGS   (TLSF_ALIGN - 1)
+
+#define ALIGN_UP(x, a)      (((x) + ((a) - 1)) & ~(uint64_t)((a) - 1))
+
+/**
+ * Block header. As with TLSF, the free list links overlap the data of a block in use.
+ */
+struct mheap_block
+{
+    uint64_t    prev_phys;  // Offset of the physically previous block (0 for the first block)
+    uint64_t    size;       // Size of the data area in bytes. The low bits hold the block flags
+    uint64_t    next_free;  // Offset of the next block in this block's free list (0 if none)
+    uint64_t    prev_free;  // Offset of the previous block in this block's free list (0 if none)
+};
+
+#define MHEAP_HEADER_SIZE   (offsetof(struct mheap_block, next_free))
+#define MHEAP_BLOCK_MIN     (sizeof(struct mheap_block) - MHEAP_HEADER_SIZE)
+#define MHEAP_BLOCK_MAX     (((uint64_t)1 << TLSF_FL_MAX) - TLSF_ALIGN)
+
+/**
+ * On-disk header, at the start of the file
+ */
+struct mheap_header
+{
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    header_size;                            // sizeof(struct mheap_header) when the file was made
+    uint64_t    size;                                   // Size of the file
+    uint64_t    base;                                   // Address the file was last mapped at
+    uint64_t    first;                                  // Offset of the first block
+    uint32_t    clean;                                  // Set by mheap_close(), and cleared while the heap is open
+    uint32_t    fl_bitmap;
+    uint32_t    sl_bitmap[TLSF_FL_COUNT];
+    uint64_t    blocks[TLSF_FL_COUNT][TLSF_SL_COUNT];   // Free list heads (offsets)
+    uint64_t    roots[MHEAP_MAX_ROOTS];                 // Offsets of the roots (0 for NULL)
+    uint64_t    num_used;
+    uint64_t    num_free;
+    uint64_t    used_bytes;
+    uint64_t    free_bytes;
+    rwlock_t    lock;                                   // Process shared, as the heap may be mapped by several processes
+};
+
+struct mheap
+{
+    uint8_t*                base;       /** Where the file is mapped */
+    struct mheap_header*    header;     /** == base */
+    size_t                  size;       /** Size of the mapping */
+    int                     fd;
+    bool                    shared;     /** Shared memory rather than a persistent file */
+    bool                    recovered;  /** The heap wasn't closed cleanly, and was rebuilt on open */
+};
+
+static inline struct mheap_block* _mheap_block(const mheap_t* heap, uint64_t off)
+{
+    return (struct mheap_block*)(heap->base + off);
+}
+
+static inline uint64_t _mheap_block_size(const struct mheap_block* block)
+{
+    return block->size & ~(uint64_t)MHEAP_BLOCK_FLAGS;
+}
+
+static inline bool _mheap_block_is_free(const struct mheap_block* block)
+{
+    return (block->size & MHEAP_BLOCK_FREE) != 0;
+}
+
+static inline uint64_t _mheap_block_next(const struct mheap_block* block, uint64_t off)
+{
+    return off + MHEAP_HEADER_SIZE + _mheap_block_size(block);
+}
+
+static void _mheap_insert_free(mheap_t* heap, uint64_t off)
+{
+    struct mheap_header*    header = heap->header;
+    struct mheap_block*     block = _mheap_block(heap, off);
+    int                     fl, sl;
+
+    tlsf_mapping_insert(_mheap_block_size(block), &fl, &sl);
+
+    block->prev_free = 0;
+    block->next_free = header->blocks[fl][sl];
+    if(block->next_free != 0)
+        _mheap_block(heap, block->next_free)->prev_free = off;
+
+    header->blocks[fl][sl] = off;
+    header->fl_bitmap |= (1U << fl);
+    header->sl_bitmap[fl] |= (1U << sl);
+
+    block->size |= MHEAP_BLOCK_FREE;
+    header->num_free++;
+    header->free_bytes += _mheap_block_size(block);
+}
+
+static void _mheap_remove_free(mheap_t* heap, uint64_t off)
+{
+    struct mheap_header*    header = heap->header;
+    struct mheap_block*     block = _mheap_block(heap, off);
+    int                     fl, sl;
+
+    tlsf_mapping_insert(_mheap_block_size(block), &fl, &sl);
+
+    if(block->next_free != 0)
+        _mheap_block(heap, block->next_free)->prev_free = block->prev_free;
+    if(block->prev_free != 0)
+        _mheap_block(heap, block->prev_free)->next_free = block->next_free;
+
+    if(header->blocks[fl][sl] == off)
+    {
+        header->blocks[fl][sl] = block->next_free;
+        if(block->next_free == 0)
+        {
+            header->sl_bitmap[fl] &= ~(1U << sl);
+            if(header->sl_bitmap[fl] == 0)
+                header->fl_bitmap &= ~(1U << fl);
+        }
+    }
+
+    block->size &= ~(uint64_t)MHEAP_BLOCK_FREE;
+    header->num_free--;
+    header->free_bytes -= _mheap_block_size(block);
+}
+
+static uint64_t _mheap_search(mheap_t* heap, int* fl, int* sl)
+{
+    struct mheap_header*    header = heap->header;
+    uint32_t                sl_map = header->sl_bitmap[*fl] & (~0U << *sl);
+
+    if(sl_map == 0)
+    {
+        uint32_t fl_map = header->fl_bitmap & (~0U << (*fl + 1));
+        if(fl_map == 0)
+            return 0;
+
+        *fl = __builtin_ffs((int)fl_map) - 1;
+        sl_map = header->sl_bitmap[*fl];
+    }
+
+    *sl = __builtin_ffs((int)sl_map) - 1;
+    return header->blocks[*fl][*sl];
+}
+
+/**
+ * Lay out an empty heap in a freshly mapped file: one free block spanning the whole
+ * file, followed by the sentinel.
+ */
+static void _mheap_format(mheap_t* heap)
+{
+    struct mheap_header* header = heap->header;
+
+    memset(header, 0, sizeof(struct mheap_header));
+    memcpy(header->magic, MHEAP_MAGIC, sizeof(header->magic));
+    header->version     = MHEAP_VERSION;
+    header->header_size = sizeof(struct mheap_header);
+    header->size        = heap->size;
+    header->first       = ALIGN_UP(sizeof(struct mheap_header), MHEAP_PAGE);
+
+    // The sentinel is a zero sized block that is never free, so nothing ever merges past the end of the heap
+    uint64_t            sentinel_off = heap->size - MHEAP_HEADER_SIZE;
+    struct mheap_block* block = _mheap_block(heap, header->first);
+    struct mheap_block* sentinel = _mheap_block(heap, sentinel_off);
+
+    block->prev_phys    = 0;
+    block->size         = sentinel_off - header->first - MHEAP_HEADER_SIZE;
+    sentinel->prev_phys = header->first;
+    sentinel->size      = 0;
+
+    _mheap_insert_free(heap, header->first);
+}
+
+/**
+ * Check every free list only holds free blocks of the right size, linked both ways, and
+ * that between them they hold all 'num_free' free blocks (which the caller has checked
+ * against the block chain).
+ */
+static bool _mheap_validate_free_lists(mheap_t* heap)
+{
+    struct mheap_header*    header = heap->header;
+    uint64_t                sentinel_off = heap->size - MHEAP_HEADER_SIZE;
+    uint64_t                count = 0;
+
+    for(int fl = 0; fl < TLSF_FL_COUNT; fl++)
+    {
+        if(((header->fl_bitmap >> fl) & 1) != (header->sl_bitmap[fl] != 0))
+            return false;
+
+        for(int sl = 0; sl < TLSF_SL_COUNT; sl++)
+        {
+            uint64_t prev = 0;
+            uint64_t off = header->blocks[fl][sl];
+
+            if(((header->sl_bitmap[fl] >> sl) & 1) != (off != 0))
+                return false;
+
+            while(off != 0)
+            {
+                int                 block_fl, block_sl;
+                struct mheap_block* block;
+
+                // Anything past num_free blocks means the list has a cycle
+                if(off < header->first || off >= sentinel_off || (off & (TLSF_ALIGN - 1)) || ++count > header->num_free)
+                    return false;
+
+                block = _mheap_block(heap, off);
+                tlsf_mapping_insert(_mheap_block_size(block), &block_fl, &block_sl);
+                if(!_mheap_block_is_free(block) || block->prev_free != prev || block_fl != fl || block_sl != sl)
+                    return false;
+
+                prev = off;
+                off = block->next_free;
+            }
+        }
+    }
+
+    return count == header->num_free;
+}
+
+/**
+ * Check the physical chain of blocks runs cleanly from the first block to the sentinel.
+ * If 'rebuild' is set, the free lists and statistics are rebuilt from the blocks as we go
+ * (merging any free blocks left next to each other). Otherwise the statistics just have to
+ * match the header's.
+ */
+static bool _mheap_validate(mheap_t* heap, bool rebuild)
+{
+    struct mheap_header*    header = heap->header;
+    uint64_t                sentinel_off = heap->size - MHEAP_HEADER_SIZE;
+    uint64_t                off = header->first;
+    uint64_t                prev = 0;
+    uint64_t                num_used = 0, num_free = 0, used_bytes = 0, free_bytes = 0;
+
+    if(rebuild)
+    {
+        header->fl_bitmap = 0;
+        memset(header->sl_bitmap, 0, sizeof(header->sl_bitmap));
+        memset(header->blocks, 0, sizeof(header->blocks));
+        header->num_used = header->num_free = header->used_bytes = header->free_bytes = 0;
+    }
+
+    while(off != sentinel_off)
+    {
+        struct mheap_block* block = _mheap_block(heap, off);
+        uint64_t            size = _mheap_block_size(block);
+
+        if((block->size & MHEAP_BLOCK_FLAGS & ~(uint64_t)MHEAP_BLOCK_FREE) != 0 || block->prev_phys != prev ||
+           size < MHEAP_BLOCK_MIN || size > MHEAP_BLOCK_MAX || size > sentinel_off - off - MHEAP_HEADER_SIZE)
+            return false;
+
+        uint64_t next = _mheap_block_next(block, off);
+        if(!_mheap_block_is_free(block))
+        {
+            num_used++;
+            used_bytes += size;
+        }
+        else if(!rebuild)
+        {
+            num_free++;
+            free_bytes += size;
+        }
+        else if(prev != 0 && _mheap_block_is_free(_mheap_block(heap, prev)))
+        {
+            // A free that didn't finish merging. Fold this block into the one before it.
+            struct mheap_block* merged = _mheap_block(heap, prev);
+
+            _mheap_remove_free(heap, prev);
+            merged->size += MHEAP_HEADER_SIZE + size;
+            _mheap_insert_free(heap, prev);
+            _mheap_block(heap, next)->prev_phys = prev;
+            off = next;
+            continue;
+        }
+        else
+        {
+            block->size &= ~(uint64_t)MHEAP_BLOCK_FREE;
+            _mheap_insert_free(heap, off);
+        }
+
+        prev = off;
+        off = next;
+    }
+
+    if(_mheap_block(heap, sentinel_off)->prev_phys != prev || _mheap_block(heap, sentinel_off)->size != 0)
+        return false;
+
+    if(rebuild)
+    {
+        header->num_used    = num_used;
+        header->used_bytes  = used_bytes;
+    }
+    else if(num_used != header->num_used || used_bytes != header->used_bytes ||
+            num_free != header->num_free || free_bytes != header->free_bytes ||
+            !_mheap_validate_free_lists(heap))
+    {
+        return false;
+    }
+
+    // Roots have to point into the heap
+    for(int i = 0; i < MHEAP_MAX_ROOTS; i++)
+    {
+        if(header->roots[i] != 0 && (header->roots[i] < header->first || header->roots[i] >= sentinel_off))
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * Sanity check a header before we trust anything in it
+ */
+static bool _mheap_header_ok(const struct mheap_header* header, size_t size)
+{
+    return memcmp(header->magic, MHEAP_MAGIC, sizeof(header->magic)) == 0 &&
+           header->version == MHEAP_VERSION &&
+           header->header_size == sizeof(struct mheap_header) &&
+           header->size == size &&
+           header->first == ALIGN_UP(sizeof(struct mheap_header), MHEAP_PAGE) &&
+           header->first + 2 * MHEAP_HEADER_SIZE + MHEAP_BLOCK_MIN <= size;
+}
+
+/**
+ * Round 'size' up to a page, and check it's something we can lay a heap out in
+ */
+static bool _mheap_size_ok(size_t* size)
+{
+    *size = ALIGN_UP(*size, MHEAP_PAGE);
+
+    return *size >= 2 * MHEAP_PAGE && *size - ALIGN_UP(sizeof(struct mheap_header), MHEAP_PAGE) <= MHEAP_BLOCK_MAX;
+}
+
+/**
+ * Map the heap in 'fd' (which is 'size' bytes long), and take ownership of 'fd'.
+ *
+ * 'create' lays out a new, empty heap. Otherwise a persistent heap is validated (and
+ * rebuilt if need be), while a shared heap is taken as it is, as other processes may be
+ * using it.
+ */
+static mheap_t* _mheap_map(int fd, size_t size, bool create, bool shared)
+{
+    struct mheap_header on_disk;
+    mheap_t*            heap = NULL;
+    void*               mem = MAP_FAILED;
+    int                 err;
+
+    on_disk.base = 0;
+    if(!create && (pread(fd, &on_disk, sizeof(on_disk), 0) != sizeof(on_disk) || !_mheap_header_ok(&on_disk, size)))
+    {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    heap = alloc(sizeof(mheap_t));
+    if(heap == NULL)
+        goto fail;
+
+    // Try for the address a persistent heap was mapped at last time, so pointers stored in it
+    // stay good. Every process maps a shared heap wherever it can.
+    if(!shared && on_disk.base != 0)
+        mem = mmap((void*)(uintptr_t)on_disk.base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+    if(mem != MAP_FAILED && (uintptr_t)mem != on_disk.base)
+    {
+        munmap(mem, size);
+        mem = MAP_FAILED;
+    }
+    if(mem == MAP_FAILED)
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(mem == MAP_FAILED)
+        goto fail;
+
+    heap->base      = mem;
+    heap->header    = mem;
+    heap->size      = size;
+    heap->fd        = fd;
+    heap->shared    = shared;
+    heap->recovered = false;
+
+    if(create)
+    {
+        _mheap_format(heap);
+        rwlock_init_shared(&heap->header->lock);
+    }
+    else if(!shared)
+    {
+        if(!heap->header->clean || !_mheap_validate(heap, false))
+        {
+            // We crashed (or the header and the blocks disagree), so rebuild the free lists from
+            // the blocks themselves. If even the blocks don't hang together, give up.
+            if(!_mheap_validate(heap, true))
+            {
+                munmap(mem, size);
+                errno = EINVAL;
+                goto fail;
+            }
+            heap->recovered = true;
+        }
+
+        // Whoever had the file last may have died holding the lock
+        rwlock_init_shared(&heap->header->lock);
+    }
+
+    if(!shared)
+    {
+        // Mark the heap open before anything can change it
+        heap->header->base  = (uintptr_t)mem;
+        heap->header->clean = 0;
+        msync(mem, MHEAP_PAGE, MS_SYNC);
+    }
+
+    return heap;
+
+fail:
+    err = errno;
+    if(heap != NULL)
+        dealloc(heap);
+    close(fd);
+    errno = err;
+    return NULL;
+}
+
+mheap_t* mheap_open(const char* path, size_t size)
+{
+    struct stat st;
+    int         err;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(fd < 0)
+        return NULL;
+
+    if(fstat(fd, &st) < 0)
+        goto fail;
+
+    if(st.st_size != 0)
+        return _mheap_map(fd, st.st_size, false, false);
+
+    if(!_mheap_size_ok(&size))
+    {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    if(ftruncate(fd, size) < 0)
+        goto fail;
+
+    return _mheap_map(fd, size, true, false);
+
+fail:
+    err = errno;
+    close(fd);
+    errno = err;
+    return NULL;
+}
+
+mheap_t* mheap_create_shared(const char* name, size_t size)
+{
+    int fd, err;
+
+    if(!_mheap_size_ok(&size))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    fd = (name != NULL) ? shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600) : memfd_create("mheap", MFD_CLOEXEC);
+    if(fd < 0)
+        return NULL;
+
+    if(ftruncate(fd, size) < 0)
+    {
+        err = errno;
+        close(fd);
+        if(name != NULL)
+            shm_unlink(name);
+        errno = err;
+        return NULL;
+    }
+
+    mheap_t* heap = _mheap_map(fd, size, true, true);
+    if(heap == NULL && name != NULL)
+    {
+        err = errno;
+        shm_unlink(name);
+        errno = err;
+    }
+
+    return heap;
+}
+
+/**
+ * Attach to the shared heap in 'fd', which we own
+ */
+static mheap_t* _mheap_attach(int fd)
+{
+    struct stat st;
+
+    if(fstat(fd, &st) < 0)
+    {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+
+    return _mheap_map(fd, st.st_size, false, true);
+}
+
+mheap_t* mheap_attach_shared(const char* name)
+{
+    int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+    if(fd < 0)
+        return NULL;
+
+    return _mheap_attach(fd);
+}
+
+mheap_t* mheap_attach_fd(int fd)
+{
+    int own = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if(own < 0)
+        return NULL;
+
+    return _mheap_attach(own);
+}
+
+int mheap_fd(const mheap_t* heap)
+{
+    return heap->fd;
+}
+
+int mheap_sync(mheap_t* heap)
+{
+    return msync(heap->base, heap->size, MS_SYNC);
+}
+
+int mheap_close(mheap_t* heap)
+{
+    int ret = 0;
+
+    if(heap == NULL)
+        return 0;
+
+    if(!heap->shared)
+    {
+        // Write out the data before the flag that says it's good
+        rwlock_wrlock(&heap->header->lock);
+        ret = msync(heap->base, heap->size, MS_SYNC);
+        if(ret == 0)
+        {
+            heap->header->clean = 1;
+            ret = msync(heap->base, MHEAP_PAGE, MS_SYNC);
+        }
+        rwlock_unlock(&heap->header->lock);
+    }
+
+    munmap(heap->base, heap->size);
+    close(heap->fd);
+    dealloc(heap);
+
+    return ret;
+}
+
+void* mheap_alloc(mheap_t* heap, size_t size)
+{
+    int fl, sl;
+
+    if(size > MHEAP_BLOCK_MAX)
+        return NULL;
+
+    size = ALIGN_UP(size, TLSF_ALIGN);
+    if(size < MHEAP_BLOCK_MIN)
+        size = MHEAP_BLOCK_MIN;
+
+    tlsf_mapping_search(size, &fl, &sl);
+    if(fl >= TLSF_FL_COUNT)
+        return NULL;
+
+    rwlock_wrlock(&heap->header->lock);
+    uint64_t off = _mheap_search(heap, &fl, &sl);
+    if(off == 0)
+    {
+        rwlock_unlock(&heap->header->lock);
+        return NULL;
+    }
+
+    struct mheap_block* block = _mheap_block(heap, off);
+    _mheap_remove_free(heap, off);
+
+    // If there's enough left over to make another block, split it off and put it back
+    uint64_t block_size = _mheap_block_size(block);
+    if(block_size >= size + MHEAP_HEADER_SIZE + MHEAP_BLOCK_MIN)
+    {
+        uint64_t            rest_off = off + MHEAP_HEADER_SIZE + size;
+        struct mheap_block* rest = _mheap_block(heap, rest_off);
+
+        rest->prev_phys = off;
+        rest->size      = block_size - size - MHEAP_HEADER_SIZE;
+        block->size     = size;
+        _mheap_block(heap, _mheap_block_next(rest, rest_off))->prev_phys = rest_off;
+
+        _mheap_insert_free(heap, rest_off);
+    }
+
+    heap->header->num_used++;
+    heap->header->used_bytes += _mheap_block_size(block);
+    rwlock_unlock(&heap->header->lock);
+
+    return (uint8_t*)block + MHEAP_HEADER_SIZE;
+}
+
+void mheap_free(mheap_t* heap, void* ptr)
+{
+    if(ptr == NULL)
+        return;
+
+    uint64_t            off = (uint8_t*)ptr - heap->base - MHEAP_HEADER_SIZE;
+    struct mheap_block* block = _mheap_block(heap, off);
+
+    if((uint8_t*)ptr < heap->base + heap->header->first || (uint8_t*)ptr >= heap->base + heap->size)
+    {
+        printf("mheap_free: pointer %p is not in this heap!\n", ptr);
+        abort();
+    }
+
+    rwlock_wrlock(&heap->header->lock);
+    if(_mheap_block_is_free(block))
+    {
+        printf("mheap_free: double free of pointer %p!\n", ptr);
+        abort();
+    }
+
+    heap->header->num_used--;
+    heap->header->used_bytes -= _mheap_block_size(block);
+
+    // Merge with the block before us...
+    if(block->prev_phys != 0 && _mheap_block_is_free(_mheap_block(heap, block->prev_phys)))
+    {
+        uint64_t            prev_off = block->prev_phys;
+        struct mheap_block* prev = _mheap_block(heap, prev_off);
+
+        _mheap_remove_free(heap, prev_off);
+        prev->size += MHEAP_HEADER_SIZE + _mheap_block_size(block);
+        off = prev_off;
+        block = prev;
+        _mheap_block(heap, _mheap_block_next(block, off))->prev_phys = off;
+    }
+
+    // ...and the block after us
+    uint64_t            next_off = _mheap_block_next(block, off);
+    struct mheap_block* next = _mheap_block(heap, next_off);
+    if(_mheap_block_is_free(next))
+    {
+        _mheap_remove_free(heap, next_off);
+        block->size += MHEAP_HEADER_SIZE + _mheap_block_size(next);
+        _mheap_block(heap, _mheap_block_next(block, off))->prev_phys = off;
+    }
+
+    _mheap_insert_free(heap, off);
+    rwlock_unlock(&heap->header->lock);
+}
+
+void mheap_set_root(mheap_t* heap, unsigned index, void* ptr)
+{
+    if(index < MHEAP_MAX_ROOTS)
+        __atomic_store_n(&heap->header->roots[index], mheap_offset(heap, ptr), __ATOMIC_RELEASE);
+}
+
+void* mheap_root(mheap_t* heap, unsigned index)
+{
+    if(index >= MHEAP_MAX_ROOTS)
+        return NULL;
+
+    return mheap_ptr(heap, __atomic_load_n(&heap->header->roots[index], __ATOMIC_ACQUIRE));
+}
+
+uint64_t mheap_offset(const mheap_t* heap, const void* ptr)
+{
+    return (ptr == NULL) ? 0 : (uint64_t)((const uint8_t*)ptr - heap->base);
+}
+
+void* mheap_ptr(const mheap_t* heap, uint64_t offset)
+{
+    return (offset == 0) ? NULL : heap->base + offset;
+}
+
+bool mheap_recovered(const mheap_t* heap)
+{
+    return heap->recovered;
+}
+
+void mheap_fragmentation(mheap_t* heap, alloc_frag_t* frag)
+{
+    memset(frag, 0, sizeof(alloc_frag_t));
+
+    rwlock_rdlock(&heap->header->lock);
+    uint64_t sentinel_off = heap->size - MHEAP_HEADER_SIZE;
+    for(uint64_t off = heap->header->first; off != sentinel_off;)
+    {
+        struct mheap_block* block = _mheap_block(heap, off);
+        size_t              size = _mheap_block_size(block);
+
+        if(!_mheap_block_is_free(block))
+        {
+            frag->used_blocks++;
+            frag->used_bytes += size;
+        }
+        else
+        {
+            frag->free_blocks++;
+            frag->free_bytes += size;
+            if(size > frag->largest_free)
+                frag->largest_free = size;
+
+            int bucket = 63 - __builtin_clzll((unsigned long long)size);
+            frag->histogram[bucket < ALLOC_FRAG_BUCKETS ? bucket : ALLOC_FRAG_BUCKETS - 1]++;
+        }
+
+        off = _mheap_block_next(block, off);
+    }
+    rwlock_unlock(&heap->header->lock);
+
+    if(frag->free_bytes > 0)
+        frag->external_fragmentation = 1.0 - (double)frag->largest_free / (double)frag->free_bytes;
+}
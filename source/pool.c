@@ -0,0 +1,372 @@
+/**
+ * Implementation of the pool functions in allocator.h
+ */
+#include "allocator.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define POOL_CACHELINE      64
+#define POOL_MAX            32                  // Maximum number of live pools
+#define POOL_TCACHE_SIZE    32                  // Objects each thread keeps in front of a pool
+#define POOL_BATCH          (POOL_TCACHE_SIZE / 2)
+#define POOL_SLAB_SIZE      (64 * 1024)         // Default slab size
+#define POOL_SLAB_MIN_OBJS  16                  // Slabs always hold at least this many objects
+
+#define ALIGN_UP(x, a)      (((x) + ((a) - 1)) & ~(size_t)((a) - 1))
+
+/**
+ * A free object. Free objects are linked through their first word.
+ */
+struct pool_object
+{
+    struct pool_object* next;
+};
+
+/**
+ * Slab header. The slab memory comes from alloc(), and objects follow the header
+ * (starting on a cache line boundary).
+ */
+struct pool_slab
+{
+    struct pool_slab*   next;
+};
+
+struct pool
+{
+    // Read-mostly fields
+    size_t                  obj_size;       /** Size requested by the user */
+    size_t                  stride;         /** Distance between objects in a slab */
+    size_t                  align;          /** Alignment of each object */
+    size_t                  slab_size;      /** Size of each slab (including the header) */
+    uint32_t                id;             /** Slot in the pool table (and the thread cache table) */
+    uint32_t                gen;            /** Generation, so thread caches can tell a reused slot apart */
+
+    // Shared state, kept on its own cache line so it doesn't thrash the fields above
+    pthread_mutex_t         lock __attribute__((aligned(POOL_CACHELINE)));
+    struct pool_object*     free;           /** Shared free list */
+    struct pool_slab*       slabs;          /** Every slab in the pool */
+    uint8_t*                carve_top;      /** Next uncarved object in the newest slab */
+    uint8_t*                carve_end;      /** End of the newest slab */
+    size_t                  capacity;       /** Number of objects carved so far */
+    size_t                  num_free;       /** Number of objects in the shared free list */
+};
+
+/**
+ * Per-thread cache in front of a pool
+ */
+struct pool_tcache
+{
+    pool_t*     pool;                       // Pool this cache belongs to
+    uint32_t    gen;                        // Generation of 'pool' when this cache was filled
+    uint32_t    count;                      // Number of objects in 'objs'
+    void*       objs[POOL_TCACHE_SIZE];
+};
+
+static pool_t*          pools[POOL_MAX];
+static uint32_t         pool_gen = 0;
+static pthread_mutex_t  pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread struct pool_tcache  tcaches[POOL_MAX];
+static __thread bool                tcache_registered = false;
+static pthread_key_t                tcache_key;
+static pthread_once_t               tcache_key_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Push 'count' objects back onto the shared free list. Caller holds pool->lock.
+ */
+static void _pool_release(pool_t* pool, void** objs, uint32_t count)
+{
+    for(uint32_t i = 0; i < count; i++)
+    {
+        struct pool_object* obj = objs[i];
+        obj->next = pool->free;
+        pool->free = obj;
+    }
+
+    pool->num_free += count;
+}
+
+/**
+ * Thread exit destructor. Hands anything left in this thread's caches back to
+ * the shared free lists, so objects don't get stranded in a dead thread.
+ */
+static void _pool_tcache_flush_all(void* unused)
+{
+    (void)unused;
+
+    pthread_mutex_lock(&pools_lock);
+    for(uint32_t i = 0; i < POOL_MAX; i++)
+    {
+        struct pool_tcache* tc = &tcaches[i];
+        if(tc->count > 0 && pools[i] == tc->pool && tc->pool->gen == tc->gen)
+        {
+            pthread_mutex_lock(&tc->pool->lock);
+            _pool_release(tc->pool, tc->objs, tc->count);
+            pthread_mutex_unlock(&tc->pool->lock);
+        }
+        tc->count = 0;
+        tc->pool = NULL;
+    }
+    pthread_mutex_unlock(&pools_lock);
+}
+
+static void _pool_tcache_key_create()
+{
+    pthread_key_create(&tcache_key, _pool_tcache_flush_all);
+}
+
+/**
+ * Get this thread's cache for 'pool', resetting it if it was left over from
+ * a pool that has since been destroyed.
+ */
+static inline struct pool_tcache* _pool_tcache(pool_t* pool)
+{
+    struct pool_tcache* tc = &tcaches[pool->id];
+
+    if(tc->pool != pool || tc->gen != pool->gen)
+    {
+        if(!tcache_registered)
+        {
+            pthread_once(&tcache_key_once, _pool_tcache_key_create);
+            pthread_setspecific(tcache_key, (void*)1);
+            tcache_registered = true;
+        }
+
+        tc->pool    = pool;
+        tc->gen     = pool->gen;
+        tc->count   = 0;
+    }
+
+    return tc;
+}
+
+/**
+ * Add a new slab to the pool. Caller holds pool->lock.
+ */
+static bool _pool_add_slab(pool_t* pool)
+{
+    struct pool_slab* slab = alloc(pool->slab_size);
+    if(slab == NULL)
+        return false;
+
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+
+    size_t first = ALIGN_UP((uintptr_t)slab + sizeof(struct pool_slab), pool->align);
+    pool->carve_top = (uint8_t*)first;
+    pool->carve_end = (uint8_t*)slab + pool->slab_size;
+
+    return true;
+}
+
+/**
+ * Refill a thread cache with up to POOL_BATCH objects, from the shared free list
+ * first, and then by carving from the newest slab.
+ */
+static void _pool_refill(pool_t* pool, struct pool_tcache* tc)
+{
+    pthread_mutex_lock(&pool->lock);
+    while(tc->count < POOL_BATCH && pool->free != NULL)
+    {
+        struct pool_object* obj = pool->free;
+        pool->free = obj->next;
+        pool->num_free--;
+        tc->objs[tc->count++] = obj;
+    }
+
+    while(tc->count < POOL_BATCH)
+    {
+        if(pool->carve_top == NULL || pool->carve_top + pool->stride > pool->carve_end)
+        {
+            if(!_pool_add_slab(pool))
+                break;
+        }
+
+        tc->objs[tc->count++] = pool->carve_top;
+        pool->carve_top += pool->stride;
+        pool->capacity++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+pool_t* pool_create(size_t obj_size, size_t align)
+{
+    if(align == 0)
+        align = 16;
+
+    if(align & (align - 1))
+    {
+        printf("pool_create: alignment %ld is not a power of two!\n", align);
+        return NULL;
+    }
+
+    // Work out the object spacing. Objects smaller than a cache line are padded up to a
+    // power of two so they never straddle two lines, and larger objects start on a line.
+    size_t stride = ALIGN_UP(obj_size < sizeof(struct pool_object) ? sizeof(struct pool_object) : obj_size, align);
+    if(stride <= POOL_CACHELINE)
+    {
+        size_t pow2 = sizeof(struct pool_object);
+        while(pow2 < stride)
+            pow2 <<= 1;
+        stride = pow2;
+    }
+    else
+    {
+        stride = ALIGN_UP(stride, POOL_CACHELINE);
+    }
+
+    if(align < POOL_CACHELINE && stride >= POOL_CACHELINE)
+        align = POOL_CACHELINE;
+    else if(align < stride && stride < POOL_CACHELINE)
+        align = stride;
+
+    size_t slab_size = POOL_SLAB_SIZE;
+    if(slab_size < sizeof(struct pool_slab) + align + stride * POOL_SLAB_MIN_OBJS)
+        slab_size = sizeof(struct pool_slab) + align + stride * POOL_SLAB_MIN_OBJS;
+
+    // Over-allocate so the pool structure itself can be cache line aligned.
+    // The raw pointer is stashed just before it so pool_destroy() can free it.
+    void* raw = alloc(sizeof(pool_t) + POOL_CACHELINE + sizeof(void*));
+    if(raw == NULL)
+        return NULL;
+
+    pool_t* pool = (pool_t*)ALIGN_UP((uintptr_t)raw + sizeof(void*), POOL_CACHELINE);
+    ((void**)pool)[-1] = raw;
+
+    pool->obj_size  = obj_size;
+    pool->stride    = stride;
+    pool->align     = align;
+    pool->slab_size = slab_size;
+    pool->free      = NULL;
+    pool->slabs     = NULL;
+    pool->carve_top = NULL;
+    pool->carve_end = NULL;
+    pool->capacity  = 0;
+    pool->num_free  = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+
+    pthread_mutex_lock(&pools_lock);
+    uint32_t id;
+    for(id = 0; id < POOL_MAX; id++)
+    {
+        if(pools[id] == NULL)
+            break;
+    }
+
+    if(id == POOL_MAX)
+    {
+        pthread_mutex_unlock(&pools_lock);
+        printf("pool_create: too many pools (max %d)!\n", POOL_MAX);
+        dealloc(raw);
+        return NULL;
+    }
+
+    pool->id    = id;
+    pool->gen   = ++pool_gen;
+    pools[id]   = pool;
+    pthread_mutex_unlock(&pools_lock);
+
+    return pool;
+}
+
+void* pool_get(pool_t* pool)
+{
+    struct pool_tcache* tc = _pool_tcache(pool);
+
+    if(tc->count == 0)
+    {
+        _pool_refill(pool, tc);
+        if(tc->count == 0)
+            return NULL;
+    }
+
+    return tc->objs[--tc->count];
+}
+
+void pool_put(pool_t* pool, void* obj)
+{
+    if(obj == NULL)
+        return;
+
+    struct pool_tcache* tc = _pool_tcache(pool);
+
+    // Cache is full, so give the older half back to everyone else
+    if(tc->count == POOL_TCACHE_SIZE)
+    {
+        pthread_mutex_lock(&pool->lock);
+        _pool_release(pool, tc->objs, POOL_BATCH);
+        pthread_mutex_unlock(&pool->lock);
+
+        for(uint32_t i = POOL_BATCH; i < POOL_TCACHE_SIZE; i++)
+            tc->objs[i - POOL_BATCH] = tc->objs[i];
+        tc->count -= POOL_BATCH;
+    }
+
+    tc->objs[tc->count++] = obj;
+}
+
+void pool_destroy(pool_t* pool)
+{
+    if(pool == NULL)
+        return;
+
+    pthread_mutex_lock(&pools_lock);
+    pools[pool->id] = NULL;
+    pthread_mutex_unlock(&pools_lock);
+
+    struct pool_slab* slab = pool->slabs;
+    while(slab != NULL)
+    {
+        struct pool_slab* next = slab->next;
+        dealloc(slab);
+        slab = next;
+    }
+
+    // Caches still pointing at this pool are invalidated by the generation check
+    pool->gen = 0;
+    pthread_mutex_destroy(&pool->lock);
+    dealloc(((void**)pool)[-1]);
+}
+
+size_t pool_capacity(pool_t* pool)
+{
+    size_t capacity;
+
+    pthread_mutex_lock(&pool->lock);
+    capacity = pool->capacity;
+    pthread_mutex_unlock(&pool->lock);
+
+    return capacity;
+}
+
+size_t pool_objects_in_use(pool_t* pool)
+{
+    size_t in_use;
+
+    pthread_mutex_lock(&pool->lock);
+    in_use = pool->capacity - pool->num_free;
+    pthread_mutex_unlock(&pool->lock);
+
+    return in_use;
+}
+
+void print_pool_stats()
+{
+    pthread_mutex_lock(&pools_lock);
+    for(uint32_t i = 0; i < POOL_MAX; i++)
+    {
+        pool_t* pool = pools[i];
+        if(pool == NULL)
+            continue;
+
+        size_t capacity = pool_capacity(pool);
+        size_t in_use   = pool_objects_in_use(pool);
+        printf("pool %u: object size %ld (stride %ld)\tin use %ld / %ld (%.1f%%)\n",
+                pool->id, pool->obj_size, pool->stride, in_use, capacity,
+                capacity ? (100.0 * in_use) / capacity : 0.0);
+    }
+    pthread_mutex_unlock(&pools_lock);
+}
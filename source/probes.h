@@ -0,0 +1,48 @@
+/**
+ * Static tracepoints
+ *
+ * USDT probes on the allocator's hot paths, for perf, bpftrace or SystemTap to attach to
+ * in a running process. Each probe is a single nop plus an ELF note naming it and where
+ * its arguments live, so an unattached probe costs next to nothing.
+ *
+ * The probes are built in whenever <sys/sdt.h> is available (on most distros it comes
+ * with systemtap-sdt-dev or systemtap-sdt-devel), unless ALLOC_NO_PROBES is defined.
+ * Without it they compile to nothing, and their arguments are never evaluated.
+ *
+ * Every probe is in the 'mallocv2' provider:
+ *
+ *      alloc(ptr, size, strategy)                  any successful allocation
+ *      dealloc(ptr, size, search_len)              search_len = allocated list blocks visited
+ *      search(size, strategy, shards, block)       free list search (block is 0 if none fit)
+ *      split(ptr, size, remainder)                 a free block split to fit a request
+ *      new_block(ptr, size)                        no free block fit, so a new one was made
+ *      heap_grow(ptr, bytes)                       more memory from the OS
+ *      rwlock_wait(lock, writer)                   about to block on a contended lock
+ *      rwlock_acquired(lock, writer)               got it after blocking
+ *      trim(bytes)                                 allocator_trim() gave 'bytes' back
+ *
+ * 'strategy' is an alloc_method_t. See tools/alloc_sizes.bt for an example.
+ */
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+#if !defined(ALLOC_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define ALLOC_PROBES
+#endif
+#endif
+
+#ifdef ALLOC_PROBES
+#define PROBE1(name, a)             DTRACE_PROBE1(mallocv2, name, a)
+#define PROBE2(name, a, b)          DTRACE_PROBE2(mallocv2, name, a, b)
+#define PROBE3(name, a, b, c)       DTRACE_PROBE3(mallocv2, name, a, b, c)
+#define PROBE4(name, a, b, c, d)    DTRACE_PROBE4(mallocv2, name, a, b, c, d)
+#else
+#define PROBE1(name, a)             do { } while(0)
+#define PROBE2(name, a, b)          do { } while(0)
+#define PROBE3(name, a, b, c)       do { } while(0)
+#define PROBE4(name, a, b, c, d)    do { } while(0)
+#endif
+
+#endif
@@ -0,0 +1,420 @@
+/**
+ * Implementation of profiler.h
+ */
+#include "profiler.h"
+
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PROF_MAX_DEPTH      32
+#define PROF_SKIP_FRAMES    2                   // profiler_record_alloc() and alloc()
+#define PROF_STACK_BUCKETS  4096
+#define PROF_LIVE_BUCKETS   4096
+#define PROF_FILTER_SIZE    16384
+#define PROF_ARENA_SIZE     (1 << 20)
+#define PROF_WRITE_BUFFER   4096
+
+/**
+ * Every sample taken from one call stack
+ */
+struct prof_stack
+{
+    struct prof_stack*  next;               // Next stack in the hash bucket
+    uint64_t            hash;
+    int                 depth;
+    void*               trace[PROF_MAX_DEPTH];
+    size_t              alloc_count;        // Samples taken since profiling started
+    size_t              alloc_bytes;
+    size_t              live_count;         // Samples still allocated
+    size_t              live_bytes;
+};
+
+/**
+ * A live sampled allocation
+ */
+struct prof_sample
+{
+    struct prof_sample* next;               // Next sample in the hash bucket (or the free list)
+    void*               ptr;
+    size_t              size;
+    struct prof_stack*  stack;
+};
+
+size_t                  profiler_rate = 0;
+size_t                  profiler_live = 0;
+__thread long long      profiler_bytes_left = 0;
+
+static __thread uint64_t    rng_state = 0;
+
+static pthread_mutex_t      prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct prof_stack*   stacks[PROF_STACK_BUCKETS];
+static struct prof_sample*  live[PROF_LIVE_BUCKETS];
+static struct prof_sample*  free_samples = NULL;
+
+// Counting filter over live sample addresses, so dealloc() can rule out almost every
+// pointer without taking the lock
+static uint32_t             filter[PROF_FILTER_SIZE];
+
+// Metadata is carved from arenas mapped straight from the OS, so the profiler never
+// calls back into alloc()
+static uint8_t*             arena_top = NULL;
+static uint8_t*             arena_end = NULL;
+
+static sem_t                dump_sem;
+static pthread_t            dump_thread;
+static bool                 dump_thread_running = false;
+static char                 dump_prefix[256];
+static unsigned             dump_seq = 0;
+
+static inline size_t _profiler_ptr_hash(const void* ptr)
+{
+    uintptr_t x = (uintptr_t)ptr >> 4;
+    x ^= x >> 17;
+    x *= 0xed5ad4bbU;
+    x ^= x >> 11;
+    return (size_t)x;
+}
+
+/**
+ * Get 'size' bytes of metadata. Caller holds prof_lock.
+ */
+static void* _profiler_meta(size_t size)
+{
+    size = (size + 15) & ~(size_t)15;
+
+    if(arena_top == NULL || arena_top + size > arena_end)
+    {
+        void* arena = mmap(NULL, PROF_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(arena == MAP_FAILED)
+            return NULL;
+
+        arena_top = arena;
+        arena_end = arena_top + PROF_ARENA_SIZE;
+    }
+
+    void* ptr = arena_top;
+    arena_top += size;
+    return ptr;
+}
+
+/**
+ * Pick the number of bytes until the next sample, from an exponential distribution with
+ * a mean of profiler_rate (so sampling is a Poisson process over bytes allocated).
+ */
+static long long _profiler_next_interval()
+{
+    if(rng_state == 0)
+        rng_state = ((uintptr_t)&rng_state ^ (uint64_t)time(NULL) * 0x9e3779b97f4a7c15ULL) | 1;
+
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+
+    // Uniform in (0, 1]
+    double u = (double)((rng_state >> 11) + 1) / 9007199254740992.0;
+
+    return (long long)(-log(u) * (double)profiler_rate) + 1;
+}
+
+/**
+ * Find (or add) the bucket for a stack. Caller holds prof_lock.
+ */
+static struct prof_stack* _profiler_stack(void* const* trace, int depth)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for(int i = 0; i < depth; i++)
+    {
+        hash ^= (uintptr_t)trace[i];
+        hash *= 1099511628211ULL;
+    }
+
+    size_t              bucket = hash % PROF_STACK_BUCKETS;
+    struct prof_stack*  stack;
+
+    for(stack = stacks[bucket]; stack != NULL; stack = stack->next)
+    {
+        if(stack->hash == hash && stack->depth == depth &&
+           memcmp(stack->trace, trace, depth * sizeof(void*)) == 0)
+            return stack;
+    }
+
+    stack = _profiler_meta(sizeof(struct prof_stack));
+    if(stack == NULL)
+        return NULL;
+
+    memset(stack, 0, sizeof(struct prof_stack));
+    stack->hash     = hash;
+    stack->depth    = depth;
+    memcpy(stack->trace, trace, depth * sizeof(void*));
+    stack->next     = stacks[bucket];
+    stacks[bucket]  = stack;
+
+    return stack;
+}
+
+void profiler_set_rate(size_t rate)
+{
+    profiler_rate = rate;
+}
+
+__attribute__((noinline)) void profiler_record_alloc(void* ptr, size_t size)
+{
+    void*   trace[PROF_MAX_DEPTH + PROF_SKIP_FRAMES];
+    int     depth;
+
+    // A thread's first trip here just picks its first interval
+    bool first = (rng_state == 0);
+
+    profiler_bytes_left = _profiler_next_interval();
+    if(first)
+        return;
+
+    depth = backtrace(trace, PROF_MAX_DEPTH + PROF_SKIP_FRAMES) - PROF_SKIP_FRAMES;
+    if(depth < 0)
+        depth = 0;
+
+    pthread_mutex_lock(&prof_lock);
+    struct prof_stack* stack = _profiler_stack(trace + PROF_SKIP_FRAMES, depth);
+
+    struct prof_sample* sample = free_samples;
+    if(sample != NULL)
+        free_samples = sample->next;
+    else
+        sample = _profiler_meta(sizeof(struct prof_sample));
+
+    if(stack == NULL || sample == NULL)
+    {
+        pthread_mutex_unlock(&prof_lock);
+        return;
+    }
+
+    stack->alloc_count++;
+    stack->alloc_bytes  += size;
+    stack->live_count++;
+    stack->live_bytes   += size;
+
+    size_t hash = _profiler_ptr_hash(ptr);
+
+    sample->ptr     = ptr;
+    sample->size    = size;
+    sample->stack   = stack;
+    sample->next    = live[hash % PROF_LIVE_BUCKETS];
+    live[hash % PROF_LIVE_BUCKETS] = sample;
+
+    __atomic_add_fetch(&filter[hash % PROF_FILTER_SIZE], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&profiler_live, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&prof_lock);
+}
+
+void profiler_record_free(void* ptr)
+{
+    size_t hash = _profiler_ptr_hash(ptr);
+
+    if(__atomic_load_n(&filter[hash % PROF_FILTER_SIZE], __ATOMIC_RELAXED) == 0)
+        return;
+
+    pthread_mutex_lock(&prof_lock);
+    struct prof_sample** link = &live[hash % PROF_LIVE_BUCKETS];
+    while(*link != NULL && (*link)->ptr != ptr)
+        link = &(*link)->next;
+
+    struct prof_sample* sample = *link;
+    if(sample != NULL)
+    {
+        *link = sample->next;
+
+        sample->stack->live_count--;
+        sample->stack->live_bytes -= sample->size;
+
+        sample->next = free_samples;
+        free_samples = sample;
+
+        __atomic_sub_fetch(&filter[hash % PROF_FILTER_SIZE], 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&profiler_live, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&prof_lock);
+}
+
+/**
+ * Buffered output for profiler_dump()
+ */
+struct prof_writer
+{
+    int     fd;
+    int     error;                          // errno of the first failed write (0 if none)
+    size_t  len;
+    char    buf[PROF_WRITE_BUFFER];
+};
+
+static void _profiler_flush(struct prof_writer* out)
+{
+    size_t done = 0;
+
+    while(out->error == 0 && done < out->len)
+    {
+        ssize_t ret = write(out->fd, out->buf + done, out->len - done);
+        if(ret < 0)
+        {
+            if(errno != EINTR)
+                out->error = errno;
+            continue;
+        }
+        done += ret;
+    }
+
+    out->len = 0;
+}
+
+static void _profiler_printf(struct prof_writer* out, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void _profiler_printf(struct prof_writer* out, const char* fmt, ...)
+{
+    va_list args;
+
+    // Longest line we print is a stack line, which is well under 1 KiB
+    if(out->len + 1024 > PROF_WRITE_BUFFER)
+        _profiler_flush(out);
+
+    va_start(args, fmt);
+    int len = vsnprintf(out->buf + out->len, PROF_WRITE_BUFFER - out->len, fmt, args);
+    va_end(args);
+
+    if(len > 0)
+        out->len += ((size_t)len < PROF_WRITE_BUFFER - out->len) ? (size_t)len : PROF_WRITE_BUFFER - out->len - 1;
+}
+
+int profiler_dump(const char* path)
+{
+    struct prof_writer  out;
+    size_t              live_count = 0, live_bytes = 0, alloc_count = 0, alloc_bytes = 0;
+
+    out.fd      = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    out.error   = 0;
+    out.len     = 0;
+    if(out.fd < 0)
+        return -1;
+
+    pthread_mutex_lock(&prof_lock);
+    for(size_t i = 0; i < PROF_STACK_BUCKETS; i++)
+    {
+        for(struct prof_stack* stack = stacks[i]; stack != NULL; stack = stack->next)
+        {
+            live_count  += stack->live_count;
+            live_bytes  += stack->live_bytes;
+            alloc_count += stack->alloc_count;
+            alloc_bytes += stack->alloc_bytes;
+        }
+    }
+
+    _profiler_printf(&out, "heap profile: %ld: %ld [%ld: %ld] @ heap_v2/%ld\n",
+            live_count, live_bytes, alloc_count, alloc_bytes, profiler_rate);
+
+    for(size_t i = 0; i < PROF_STACK_BUCKETS; i++)
+    {
+        for(struct prof_stack* stack = stacks[i]; stack != NULL; stack = stack->next)
+        {
+            _profiler_printf(&out, "%ld: %ld [%ld: %ld] @",
+                    stack->live_count, stack->live_bytes, stack->alloc_count, stack->alloc_bytes);
+            for(int j = 0; j < stack->depth; j++)
+                _profiler_printf(&out, " %p", stack->trace[j]);
+            _profiler_printf(&out, "\n");
+        }
+    }
+    pthread_mutex_unlock(&prof_lock);
+
+    // pprof needs the mappings to symbolise the addresses
+    _profiler_printf(&out, "\nMAPPED_LIBRARIES:\n");
+    _profiler_flush(&out);
+
+    int maps = open("/proc/self/maps", O_RDONLY);
+    if(maps >= 0)
+    {
+        ssize_t len;
+        while(out.error == 0 && (len = read(maps, out.buf, PROF_WRITE_BUFFER)) > 0)
+        {
+            out.len = len;
+            _profiler_flush(&out);
+        }
+        close(maps);
+    }
+
+    close(out.fd);
+
+    if(out.error != 0)
+    {
+        errno = out.error;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void _profiler_signal_handler(int signo)
+{
+    (void)signo;
+
+    // The dump takes locks and formats output, so hand it off to the dump thread
+    sem_post(&dump_sem);
+}
+
+static void* _profiler_dump_loop(void* unused)
+{
+    char path[320];
+
+    (void)unused;
+
+    for(;;)
+    {
+        if(sem_wait(&dump_sem) != 0)
+            continue;
+
+        snprintf(path, sizeof(path), "%s.%d.%u.heap", dump_prefix, (int)getpid(), dump_seq++);
+        if(profiler_dump(path) != 0)
+            fprintf(stderr, "profiler: unable to write %s: %s\n", path, strerror(errno));
+    }
+
+    return NULL;
+}
+
+int profiler_dump_on_signal(int signo, const char* prefix)
+{
+    struct sigaction action;
+
+    snprintf(dump_prefix, sizeof(dump_prefix), "%s", prefix);
+
+    if(!dump_thread_running)
+    {
+        if(sem_init(&dump_sem, 0, 0) != 0)
+            return -1;
+
+        int ret = pthread_create(&dump_thread, NULL, _profiler_dump_loop, NULL);
+        if(ret != 0)
+        {
+            errno = ret;
+            return -1;
+        }
+
+        pthread_detach(dump_thread);
+        dump_thread_running = true;
+    }
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = _profiler_signal_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+
+    return sigaction(signo, &action, NULL);
+}
@@ -0,0 +1,62 @@
+/**
+ * Sampling heap profiler
+ *
+ * Rather than tracking every allocation, the profiler samples one allocation roughly every
+ * 'rate' bytes. The gaps between samples are drawn from an exponential distribution, so every
+ * byte has the same chance of being sampled regardless of allocation pattern, and a sampled
+ * allocation of 'size' bytes stands in for 1 / (1 - exp(-size / rate)) allocations of its size.
+ * Only sampled allocations pay for a backtrace; everything else costs a thread-local
+ * subtraction in alloc(), and a table lookup in dealloc() while any sample is live.
+ *
+ * Samples are aggregated by stack, both as live (in use) and cumulative (allocated since
+ * profiling started) counts, and dumped in the legacy pprof "heap_v2" text format, which
+ * pprof unsamples using the rate in the header.
+ */
+#ifndef _PROFILER_H_
+#define _PROFILER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+extern size_t               profiler_rate;          /** Mean bytes between samples (0 if profiling is off) */
+extern size_t               profiler_live;          /** Number of sampled allocations still live */
+extern __thread long long   profiler_bytes_left;    /** Bytes this thread can allocate before its next sample */
+
+/**
+ * Turn profiling on, sampling every 'rate' bytes on average (or off, with a rate of 0)
+ */
+void profiler_set_rate(size_t rate);
+
+/**
+ * Returns true if an allocation of 'size' bytes should be sampled
+ */
+static inline bool profiler_should_sample(size_t size)
+{
+    if(profiler_rate == 0)
+        return false;
+
+    profiler_bytes_left -= (long long)size;
+    return profiler_bytes_left < 0;
+}
+
+/**
+ * Record a sampled allocation (and pick the gap to the next sample)
+ */
+void profiler_record_alloc(void* ptr, size_t size);
+
+/**
+ * Forget 'ptr' if it's a live sampled allocation
+ */
+void profiler_record_free(void* ptr);
+
+/**
+ * Write a heap profile to 'path'. Returns 0 on success, or -1 (with errno set) on failure.
+ */
+int profiler_dump(const char* path);
+
+/**
+ * Dump a profile to "<prefix>.<pid>.<n>.heap" each time signal 'signo' arrives
+ */
+int profiler_dump_on_signal(int signo, const char* prefix);
+
+#endif
@@ -0,0 +1,207 @@
+/**
+ * Implementation of the region functions in allocator.h
+ */
+#include "allocator.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define REGION_ALIGN        16
+#define REGION_CHUNK_MIN    (4 * 1024)          // Smallest chunk a region will grow by
+#define REGION_CHUNK_MAX    (4 * 1024 * 1024)   // Largest chunk a region will grow by (unless a single allocation needs more)
+
+#define ALIGN_UP(x, a)      (((x) + ((a) - 1)) & ~(size_t)((a) - 1))
+
+/**
+ * A chunk of memory that a region bumps through. The data follows the header.
+ */
+struct region_chunk
+{
+    struct region_chunk*    next;   // Next chunk in the region
+    size_t                  size;   // Number of usable bytes after the header
+};
+
+struct region
+{
+    struct region_chunk*    head;       /** The first chunk (which also holds this structure) */
+    struct region_chunk*    cur;        /** Chunk we are currently bumping through */
+    uint8_t*                top;        /** Next free byte in 'cur' */
+    uint8_t*                end;        /** One past the last byte in 'cur' */
+    size_t                  next_size;  /** Size of the next chunk we'll allocate */
+    size_t                  in_use;     /** Bytes handed out since creation (or the last reset) */
+    size_t                  soft_limit; /** Limits on 'in_use' (0 = no limit) */
+    size_t                  hard_limit;
+    alloc_limit_fn          soft_fn;    /** Called when 'in_use' crosses 'soft_limit' */
+    void*                   soft_ctx;
+};
+
+#define CHUNK_HEADER_SIZE   ALIGN_UP(sizeof(struct region_chunk), REGION_ALIGN)
+#define REGION_HEADER_SIZE  ALIGN_UP(sizeof(struct region), REGION_ALIGN)
+
+static inline uint8_t* _chunk_data(struct region_chunk* chunk)
+{
+    return (uint8_t*)chunk + CHUNK_HEADER_SIZE;
+}
+
+static void _region_use_chunk(region_t* region, struct region_chunk* chunk)
+{
+    region->cur = chunk;
+    region->top = _chunk_data(chunk);
+    region->end = _chunk_data(chunk) + chunk->size;
+}
+
+/**
+ * Bump 'top' up to the next aligned address (alloc() only guarantees the alignment of
+ * the strategy that handed us the chunk).
+ */
+static inline uint8_t* _region_aligned_top(region_t* region)
+{
+    return (uint8_t*)ALIGN_UP((uintptr_t)region->top, REGION_ALIGN);
+}
+
+region_t* region_create(size_t initial)
+{
+    initial = ALIGN_UP(initial, REGION_ALIGN);
+    if(initial < REGION_CHUNK_MIN)
+        initial = REGION_CHUNK_MIN;
+
+    // The region lives at the start of its first chunk, so creating one costs a single alloc()
+    struct region_chunk* chunk = alloc(CHUNK_HEADER_SIZE + REGION_HEADER_SIZE + initial + REGION_ALIGN);
+    if(chunk == NULL)
+        return NULL;
+
+    chunk->next = NULL;
+    chunk->size = REGION_HEADER_SIZE + initial + REGION_ALIGN;
+
+    // Everything after the region header is aligned relative to the chunk, so the
+    // region itself only needs the alignment alloc() gave us.
+    region_t* region = (region_t*)_chunk_data(chunk);
+    region->head = chunk;
+    region->next_size = initial * 2;
+    region->in_use = 0;
+    region->soft_limit = 0;
+    region->hard_limit = 0;
+    region->soft_fn = NULL;
+    region->soft_ctx = NULL;
+    _region_use_chunk(region, chunk);
+    region->top += REGION_HEADER_SIZE;
+
+    return region;
+}
+
+/**
+ * Move on to a chunk that can hold 'size' bytes.
+ *
+ * Chunks retained from before the last region_reset() are reused in order. Any that
+ * are too small are skipped over (but kept), and a new chunk is spliced in after the
+ * current one if none of them fit.
+ */
+static bool _region_grow(region_t* region, size_t size)
+{
+    struct region_chunk* chunk = region->cur->next;
+
+    while(chunk != NULL)
+    {
+        if(chunk->size >= size + REGION_ALIGN)
+        {
+            _region_use_chunk(region, chunk);
+            return true;
+        }
+
+        region->cur = chunk;
+        chunk = chunk->next;
+    }
+
+    size_t chunk_size = region->next_size;
+    if(chunk_size < size)
+        chunk_size = ALIGN_UP(size, REGION_CHUNK_MIN);
+
+    chunk = alloc(CHUNK_HEADER_SIZE + chunk_size + REGION_ALIGN);
+    if(chunk == NULL)
+        return false;
+
+    chunk->size = chunk_size + REGION_ALIGN;
+    chunk->next = region->cur->next;
+    region->cur->next = chunk;
+
+    if(region->next_size < REGION_CHUNK_MAX)
+        region->next_size *= 2;
+
+    _region_use_chunk(region, chunk);
+    return true;
+}
+
+void* region_alloc(region_t* region, size_t size)
+{
+    void* ptr;
+
+    if(region == NULL)
+    {
+        printf("region_alloc: region == NULL!\n");
+        return NULL;
+    }
+
+    size = ALIGN_UP(size, REGION_ALIGN);
+    if(region->hard_limit != 0 && region->in_use + size > region->hard_limit)
+        return NULL;
+
+    ptr = _region_aligned_top(region);
+    if((uint8_t*)ptr > region->end || size > (size_t)(region->end - (uint8_t*)ptr))
+    {
+        if(!_region_grow(region, size))
+            return NULL;
+
+        ptr = _region_aligned_top(region);
+    }
+
+    region->top = (uint8_t*)ptr + size;
+
+    // Only the allocation that takes us over the soft limit calls back
+    bool crossed = region->soft_limit != 0 && region->in_use <= region->soft_limit &&
+                   region->in_use + size > region->soft_limit;
+
+    region->in_use += size;
+    if(crossed && region->soft_fn != NULL)
+        region->soft_fn(region->in_use, region->soft_limit, region->soft_ctx);
+
+    return ptr;
+}
+
+void region_set_limits(region_t* region, size_t soft, size_t hard, alloc_limit_fn fn, void* ctx)
+{
+    region->soft_limit  = soft;
+    region->hard_limit  = hard;
+    region->soft_fn     = fn;
+    region->soft_ctx    = ctx;
+}
+
+size_t region_bytes_in_use(region_t* region)
+{
+    return region->in_use;
+}
+
+void region_reset(region_t* region)
+{
+    _region_use_chunk(region, region->head);
+    region->top += REGION_HEADER_SIZE;
+    region->in_use = 0;
+}
+
+void region_destroy(region_t* region)
+{
+    if(region == NULL)
+        return;
+
+    // The first chunk holds the region itself, so it has to go last
+    struct region_chunk* head = region->head;
+    struct region_chunk* chunk = head->next;
+    while(chunk != NULL)
+    {
+        struct region_chunk* next = chunk->next;
+        dealloc(chunk);
+        chunk = next;
+    }
+
+    dealloc(head);
+}
@@ -0,0 +1,50 @@
+/**
+ * Size classes (generated by tools/sizeclass_gen from tools/main_workload.hist, do not edit)
+ *
+ * 32 classes over 64 distinct sizes. For the input histogram (101096 allocations of 39967504
+ * bytes), rounding up to these classes wastes 893376 bytes (2.24%).
+ */
+#ifndef _SIZE_CLASSES_H_
+#define _SIZE_CLASSES_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SIZE_CLASS_COUNT    32
+#define SIZE_CLASS_GRANULE  16
+#define SIZE_CLASS_MAX      1024
+
+static const uint32_t size_class_sizes[SIZE_CLASS_COUNT] =
+{
+    16, 48, 80, 128, 160, 192, 224, 256, 288, 320, 352, 384,
+    416, 448, 480, 512, 544, 576, 608, 640, 672, 704, 736, 768,
+    800, 832, 864, 896, 928, 960, 992, 1024
+};
+
+static const uint8_t size_class_lookup[SIZE_CLASS_MAX / SIZE_CLASS_GRANULE + 1] =
+{
+    0, 0, 1, 1, 2, 2, 3, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11,
+    11, 12, 12, 13, 13, 14, 14, 15, 15, 16, 16, 17, 17, 18, 18, 19, 19, 20, 20, 21, 21, 22, 22, 23,
+    23, 24, 24, 25, 25, 26, 26, 27, 27, 28, 28, 29, 29, 30, 30, 31, 31
+};
+
+/**
+ * Get the class of an allocation of 'size' bytes (no more than SIZE_CLASS_MAX)
+ */
+static inline unsigned size_class_of(size_t size)
+{
+    return size_class_lookup[(size + SIZE_CLASS_GRANULE - 1) / SIZE_CLASS_GRANULE];
+}
+
+/**
+ * Round 'size' up to its class, or to the granule past the largest class
+ */
+static inline size_t size_class_round(size_t size)
+{
+    if(size > SIZE_CLASS_MAX)
+        return (size + SIZE_CLASS_GRANULE - 1) & ~(size_t)(SIZE_CLASS_GRANULE - 1);
+
+    return size_class_sizes[size_class_of(size)];
+}
+
+#endif
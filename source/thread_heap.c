@@ -0,0 +1,167 @@
+/**
+ * Implementation of thread_heap.h
+ */
+#include "thread_heap.h"
+#include "heap.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+static thread_heap_t*       heaps = NULL;           // Every thread heap ever created
+static uint32_t             num_heaps = 0;
+static pthread_mutex_t      heaps_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread thread_heap_t*  self = NULL;
+static pthread_key_t            self_key;
+static pthread_once_t           self_key_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Thread exit destructor. Orphans the heap so the next new thread can adopt it.
+ */
+static void _thread_heap_orphan(void* data)
+{
+    thread_heap_t* heap = data;
+
+    __atomic_store_n(&heap->orphaned, true, __ATOMIC_RELEASE);
+    self = NULL;
+}
+
+static void _thread_heap_key_create()
+{
+    pthread_key_create(&self_key, _thread_heap_orphan);
+}
+
+static thread_heap_t* _thread_heap_create()
+{
+    thread_heap_t* heap;
+
+    pthread_mutex_lock(&heaps_lock);
+
+    // Adopt an orphan if there is one (along with anything still in its remote queue)
+    for(heap = heaps; heap != NULL; heap = heap->next)
+    {
+        if(__atomic_load_n(&heap->orphaned, __ATOMIC_ACQUIRE))
+        {
+            __atomic_store_n(&heap->orphaned, false, __ATOMIC_RELEASE);
+            pthread_mutex_unlock(&heaps_lock);
+            return heap;
+        }
+    }
+
+    // Thread heaps get whole cache lines of their own, so remote pushes don't false-share
+    uint8_t* mem = heap_grow(sizeof(thread_heap_t) + THREAD_HEAP_LINE);
+    if(mem == NULL)
+    {
+        printf("_thread_heap_create: unable to allocate a thread heap!\n");
+        abort();
+    }
+
+    heap = (thread_heap_t*)(((uintptr_t)mem + THREAD_HEAP_LINE - 1) & ~(uintptr_t)(THREAD_HEAP_LINE - 1));
+    memset(heap, 0, sizeof(*heap));
+    heap->remote        = NULL;
+    heap->remote_frees  = 0;
+    heap->seen_remote   = NULL;
+    heap->id            = num_heaps++;
+    heap->orphaned      = false;
+    heap->next          = heaps;
+    __atomic_store_n(&heaps, heap, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&heaps_lock);
+
+    return heap;
+}
+
+thread_heap_t* thread_heap_self()
+{
+    if(self == NULL)
+    {
+        pthread_once(&self_key_once, _thread_heap_key_create);
+        self = _thread_heap_create();
+        pthread_setspecific(self_key, self);
+    }
+
+    return self;
+}
+
+void thread_heap_push_remote(thread_heap_t* heap, memblk_t* block)
+{
+    memblk_t* head = __atomic_load_n(&heap->remote, __ATOMIC_RELAXED);
+
+    do
+        block->remote_next = head;
+    while(!__atomic_compare_exchange_n(&heap->remote, &head, block, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    __atomic_fetch_add(&heap->remote_frees, 1, __ATOMIC_RELAXED);
+}
+
+memblk_t* thread_heap_take_remote(thread_heap_t* heap)
+{
+    // Taking the whole stack at once (rather than popping) sidesteps the ABA problem
+    return __atomic_exchange_n(&heap->remote, NULL, __ATOMIC_ACQUIRE);
+}
+
+void* thread_heap_carve(thread_heap_t* heap, size_t size)
+{
+    size = (size + HEAP_ALIGN - 1) & ~(size_t)(HEAP_ALIGN - 1);
+
+    if((size_t)(heap->span_end - heap->span_top) < size)
+    {
+        // Whatever is left of the old span goes unused; it's never more than one block
+        size_t   span = (size > THREAD_HEAP_SPAN) ? size : THREAD_HEAP_SPAN;
+        uint8_t* mem;
+
+        span = (span + THREAD_HEAP_LINE - 1) & ~(size_t)(THREAD_HEAP_LINE - 1);
+        mem = heap_grow(span + THREAD_HEAP_LINE);
+        if(mem == NULL)
+            return NULL;
+
+        heap->span_top = (uint8_t*)(((uintptr_t)mem + THREAD_HEAP_LINE - 1) & ~(uintptr_t)(THREAD_HEAP_LINE - 1));
+        heap->span_end = heap->span_top + span;
+    }
+
+    void* ptr = heap->span_top;
+    heap->span_top += size;
+    return ptr;
+}
+
+bool thread_heap_claim_orphan(thread_heap_t* heap)
+{
+    bool claimed = false;
+
+    // Adoption happens under heaps_lock, so taking the flag under it too means a new
+    // thread can't adopt the heap while it's being emptied
+    pthread_mutex_lock(&heaps_lock);
+    if(__atomic_load_n(&heap->orphaned, __ATOMIC_ACQUIRE))
+    {
+        __atomic_store_n(&heap->orphaned, false, __ATOMIC_RELEASE);
+        claimed = true;
+    }
+    pthread_mutex_unlock(&heaps_lock);
+
+    return claimed;
+}
+
+void thread_heap_unclaim(thread_heap_t* heap)
+{
+    __atomic_store_n(&heap->orphaned, true, __ATOMIC_RELEASE);
+}
+
+thread_heap_t* thread_heap_list()
+{
+    return __atomic_load_n(&heaps, __ATOMIC_ACQUIRE);
+}
+
+size_t thread_heap_remote_frees()
+{
+    size_t total = 0;
+
+    pthread_mutex_lock(&heaps_lock);
+    for(thread_heap_t* heap = heaps; heap != NULL; heap = heap->next)
+        total += __atomic_load_n(&heap->remote_frees, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&heaps_lock);
+
+    return total;
+}
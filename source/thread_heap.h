@@ -0,0 +1,135 @@
+/**
+ * Thread heaps
+ *
+ * Each thread that allocates from the list strategies gets a thread heap, which owns
+ * every block that thread allocated. When another thread deallocates one of those
+ * blocks, it doesn't touch the allocator's lists at all; it pushes the block onto the
+ * owner's remote free queue (a lock-free multi-producer, single-consumer stack) and
+ * carries on. The owner drains the whole queue in one batch on its next alloc().
+ *
+ * Thread heaps are never freed. When a thread exits its heap is orphaned, and handed
+ * to the next thread that starts allocating (which drains whatever was left behind).
+ *
+ * With cache line isolation on, a thread also carves its small blocks from spans of its
+ * own, and keeps those blocks in a per-thread cache once they're freed, so no other
+ * thread's objects ever land on the same cache lines. An orphan's cache and the rest of
+ * its span go to an adopter, or back to the shared free lists at the next maintenance
+ * pass (allocator_flush_thread_caches()) if nobody adopts it first.
+ */
+#ifndef _THREAD_HEAP_H_
+#define _THREAD_HEAP_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "memblk.h"
+#include "size_classes.h"
+
+#define THREAD_HEAP_LINE    64              /** Cache line size */
+#define THREAD_HEAP_SPAN    (16 * 1024)     /** Size of the spans threads carve their own blocks from */
+
+struct thread_heap
+{
+    memblk_t*           remote;         /** Remote free queue. Pushed to by any thread, drained by the owner */
+    size_t              remote_frees;   /** Number of blocks other threads have pushed to us */
+    memblk_t*           seen_remote;    /** Head of the remote queue the last time the maintenance thread looked */
+    uint32_t            id;             /** Thread heap number (for debugging) */
+    bool                orphaned;       /** Set once the owning thread has exited */
+    struct thread_heap* next;           /** Next thread heap in the registry */
+
+    // Only touched by the owner, so kept off the line other threads push remote frees to
+    uint8_t*            span_top __attribute__((aligned(THREAD_HEAP_LINE)));  /** Next uncarved byte of the span */
+    uint8_t*            span_end;       /** End of the span */
+    memblk_t*           cache[SIZE_CLASS_COUNT];    /** Freed blocks carved from our spans, by size class (chained through 'next') */
+    size_t              cache_count;    /** Number of blocks in 'cache' */
+};
+
+typedef struct thread_heap thread_heap_t;
+
+/**
+ * Get the calling thread's heap, creating (or adopting) one if it doesn't have one yet
+ */
+thread_heap_t* thread_heap_self();
+
+/**
+ * Push a block onto another thread's remote free queue
+ */
+void thread_heap_push_remote(thread_heap_t* heap, memblk_t* block);
+
+/**
+ * Take every block in the remote free queue. The blocks are chained through 'remote_next'.
+ *
+ * This is normally only called by the owner, but as the whole queue is taken with a
+ * single exchange, it's also safe for the maintenance thread to drain an idle heap.
+ */
+memblk_t* thread_heap_take_remote(thread_heap_t* heap);
+
+/**
+ * Returns true if the heap's remote free queue is not empty
+ */
+static inline bool thread_heap_has_remote(thread_heap_t* heap)
+{
+    return __atomic_load_n(&heap->remote, __ATOMIC_RELAXED) != NULL;
+}
+
+/**
+ * Carve 'size' bytes (rounded up to HEAP_ALIGN) from the heap's span, starting a new span
+ * when it runs out. Spans are whole cache lines, and only their owner carves from them.
+ * Returns NULL if the heap can't grow.
+ */
+void* thread_heap_carve(thread_heap_t* heap, size_t size);
+
+/**
+ * Park a freed block in the owner's cache. Only the owner may call this.
+ */
+static inline void thread_heap_cache_push(thread_heap_t* heap, memblk_t* block)
+{
+    unsigned cls = size_class_of(block->size);
+
+    block->flags &= ~BLOCK_FREED;
+    block->next = heap->cache[cls];
+    heap->cache[cls] = block;
+    heap->cache_count++;
+}
+
+/**
+ * Take a block of class 'cls' from the owner's cache (NULL if it has none)
+ */
+static inline memblk_t* thread_heap_cache_pop(thread_heap_t* heap, unsigned cls)
+{
+    memblk_t* block = heap->cache[cls];
+
+    if(block != NULL)
+    {
+        heap->cache[cls] = block->next;
+        block->next = NULL;
+        heap->cache_count--;
+    }
+
+    return block;
+}
+
+/**
+ * Take an orphaned heap out of circulation, so no new thread adopts it while the caller
+ * empties its cache. Returns false if the heap isn't an orphan (any more). Hand it back
+ * with thread_heap_unclaim().
+ */
+bool thread_heap_claim_orphan(thread_heap_t* heap);
+
+/**
+ * Orphan a heap claimed with thread_heap_claim_orphan() again
+ */
+void thread_heap_unclaim(thread_heap_t* heap);
+
+/**
+ * Get the first thread heap in the registry (follow 'next' for the rest). Heaps are
+ * never removed, so the registry can be walked without a lock.
+ */
+thread_heap_t* thread_heap_list();
+
+/**
+ * Total number of cross-thread deallocations across all thread heaps
+ */
+size_t thread_heap_remote_frees();
+
+#endif
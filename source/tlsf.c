@@ -0,0 +1,313 @@
+/**
+ * Implementation of tlsf.h
+ */
+#include "tlsf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TLSF_BLOCK_FREE     0x1     // Block is free (and in a free list)
+#define TLSF_BLOCK_FLAGS    (TLSF_ALIGN - 1)
+
+#define TLSF_HEADER_SIZE    (offsetof(tlsf_block_t, next_free))
+#define TLSF_BLOCK_MIN      (sizeof(tlsf_block_t) - TLSF_HEADER_SIZE)
+#define TLSF_BLOCK_MAX      (((size_t)1 << TLSF_FL_MAX) - TLSF_ALIGN)
+
+static inline size_t _block_size(const tlsf_block_t* block)
+{
+    return block->size & ~(size_t)TLSF_BLOCK_FLAGS;
+}
+
+static inline bool _block_is_free(const tlsf_block_t* block)
+{
+    return (block->size & TLSF_BLOCK_FREE) != 0;
+}
+
+static inline void* _block_to_ptr(const tlsf_block_t* block)
+{
+    return (uint8_t*)block + TLSF_HEADER_SIZE;
+}
+
+static inline tlsf_block_t* _ptr_to_block(const void* ptr)
+{
+    return (tlsf_block_t*)((uint8_t*)ptr - TLSF_HEADER_SIZE);
+}
+
+static inline tlsf_block_t* _block_next(const tlsf_block_t* block)
+{
+    return (tlsf_block_t*)((uint8_t*)_block_to_ptr(block) + _block_size(block));
+}
+
+/**
+ * Index of the least significant set bit
+ */
+static inline int _ffs(uint32_t x)
+{
+    return __builtin_ffs((int)x) - 1;
+}
+
+static tlsf_block_t* _search_suitable_block(tlsf_t* tlsf, int* fl, int* sl)
+{
+    uint32_t sl_map = tlsf->sl_bitmap[*fl] & (~0U << *sl);
+
+    if(sl_map == 0)
+    {
+        // Nothing left in this first level, so take the smallest non-empty one above it
+        uint32_t fl_map = tlsf->fl_bitmap & (~0U << (*fl + 1));
+        if(fl_map == 0)
+            return NULL;
+
+        *fl = _ffs(fl_map);
+        sl_map = tlsf->sl_bitmap[*fl];
+    }
+
+    *sl = _ffs(sl_map);
+    return tlsf->blocks[*fl][*sl];
+}
+
+static void _insert_free_block(tlsf_t* tlsf, tlsf_block_t* block)
+{
+    int fl, sl;
+
+    tlsf_mapping_insert(_block_size(block), &fl, &sl);
+
+    block->prev_free = NULL;
+    block->next_free = tlsf->blocks[fl][sl];
+    if(block->next_free != NULL)
+        block->next_free->prev_free = block;
+
+    tlsf->blocks[fl][sl] = block;
+    tlsf->fl_bitmap |= (1U << fl);
+    tlsf->sl_bitmap[fl] |= (1U << sl);
+
+    block->size |= TLSF_BLOCK_FREE;
+    tlsf->num_free++;
+    tlsf->free_bytes += _block_size(block);
+}
+
+static void _remove_free_block(tlsf_t* tlsf, tlsf_block_t* block)
+{
+    int fl, sl;
+
+    tlsf_mapping_insert(_block_size(block), &fl, &sl);
+
+    if(block->next_free != NULL)
+        block->next_free->prev_free = block->prev_free;
+    if(block->prev_free != NULL)
+        block->prev_free->next_free = block->next_free;
+
+    if(tlsf->blocks[fl][sl] == block)
+    {
+        tlsf->blocks[fl][sl] = block->next_free;
+        if(block->next_free == NULL)
+        {
+            tlsf->sl_bitmap[fl] &= ~(1U << sl);
+            if(tlsf->sl_bitmap[fl] == 0)
+                tlsf->fl_bitmap &= ~(1U << fl);
+        }
+    }
+
+    block->size &= ~(size_t)TLSF_BLOCK_FREE;
+    tlsf->num_free--;
+    tlsf->free_bytes -= _block_size(block);
+}
+
+void tlsf_init(tlsf_t* tlsf)
+{
+    memset(tlsf, 0, sizeof(tlsf_t));
+}
+
+size_t tlsf_pool_overhead()
+{
+    // One header for the first block, and one for the sentinel at the end of the pool
+    return 2 * TLSF_HEADER_SIZE + TLSF_ALIGN;
+}
+
+bool tlsf_add_pool(tlsf_t* tlsf, void* mem, size_t bytes)
+{
+    uintptr_t start = ((uintptr_t)mem + TLSF_ALIGN - 1) & ~(uintptr_t)(TLSF_ALIGN - 1);
+    uintptr_t end   = ((uintptr_t)mem + bytes) & ~(uintptr_t)(TLSF_ALIGN - 1);
+
+    if(tlsf->num_pools >= TLSF_MAX_POOLS)
+        return false;
+
+    if(end <= start || end - start < 2 * TLSF_HEADER_SIZE + TLSF_BLOCK_MIN)
+        return false;
+
+    size_t size = end - start - 2 * TLSF_HEADER_SIZE;
+    if(size > TLSF_BLOCK_MAX)
+        size = TLSF_BLOCK_MAX;
+
+    tlsf_block_t* block = (tlsf_block_t*)start;
+    block->prev_phys    = NULL;
+    block->size         = size;
+
+    // The sentinel is a zero sized block that is never free, so nothing ever merges past the end of the pool
+    tlsf_block_t* sentinel  = _block_next(block);
+    sentinel->prev_phys     = block;
+    sentinel->size          = 0;
+
+    _insert_free_block(tlsf, block);
+
+    // Readers of the pool table (tlsf_owns()) don't take the caller's lock, so publish the
+    // entry before the count.
+    tlsf->pools[tlsf->num_pools].start  = start;
+    tlsf->pools[tlsf->num_pools].end    = (uintptr_t)sentinel + TLSF_HEADER_SIZE;
+    __atomic_store_n(&tlsf->num_pools, tlsf->num_pools + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+/**
+ * Size of the block tlsf_malloc() actually carves for a 'size' byte request
+ */
+static inline size_t _adjust_size(size_t size)
+{
+    size = (size + TLSF_ALIGN - 1) & ~(size_t)(TLSF_ALIGN - 1);
+    if(size < TLSF_BLOCK_MIN)
+        size = TLSF_BLOCK_MIN;
+
+    return size;
+}
+
+size_t tlsf_pool_size_for(size_t size)
+{
+    int fl, sl;
+
+    if(size > TLSF_BLOCK_MAX)
+        return 0;
+
+    size = _adjust_size(size);
+    tlsf_mapping_search(size, &fl, &sl);
+    if(fl >= TLSF_FL_COUNT)
+        return 0;
+
+    // The search skips the list 'size' itself maps to (unless it's on a list boundary), so
+    // the pool's one free block has to be big enough to land in the list searched from
+    if(size >= ((size_t)1 << TLSF_FL_SHIFT))
+        size += ((size_t)1 << (tlsf_fls(size) - TLSF_SL_LOG2)) - 1;
+    size = (size + TLSF_ALIGN - 1) & ~(size_t)(TLSF_ALIGN - 1);
+
+    return size + tlsf_pool_overhead();
+}
+
+void* tlsf_malloc(tlsf_t* tlsf, size_t size)
+{
+    int fl, sl;
+
+    if(size > TLSF_BLOCK_MAX)
+        return NULL;
+
+    size = _adjust_size(size);
+
+    tlsf_mapping_search(size, &fl, &sl);
+    if(fl >= TLSF_FL_COUNT)
+        return NULL;
+
+    tlsf_block_t* block = _search_suitable_block(tlsf, &fl, &sl);
+    if(block == NULL)
+        return NULL;
+
+    _remove_free_block(tlsf, block);
+
+    // If there's enough left over to make another block, split it off and put it back
+    size_t block_size = _block_size(block);
+    if(block_size >= size + TLSF_HEADER_SIZE + TLSF_BLOCK_MIN)
+    {
+        tlsf_block_t* remaining = (tlsf_block_t*)((uint8_t*)_block_to_ptr(block) + size);
+        remaining->prev_phys    = block;
+        remaining->size         = block_size - size - TLSF_HEADER_SIZE;
+        block->size             = size;
+        _block_next(remaining)->prev_phys = remaining;
+
+        _insert_free_block(tlsf, remaining);
+    }
+
+    tlsf->num_used++;
+    tlsf->used_bytes += _block_size(block);
+
+    return _block_to_ptr(block);
+}
+
+void tlsf_free(tlsf_t* tlsf, void* ptr)
+{
+    tlsf_block_t* block = _ptr_to_block(ptr);
+
+    if(_block_is_free(block))
+    {
+        printf("tlsf_free: double free of pointer %p!\n", ptr);
+        abort();
+    }
+
+    tlsf->num_used--;
+    tlsf->used_bytes -= _block_size(block);
+
+    // Merge with the block before us...
+    tlsf_block_t* prev = block->prev_phys;
+    if(prev != NULL && _block_is_free(prev))
+    {
+        _remove_free_block(tlsf, prev);
+        prev->size += TLSF_HEADER_SIZE + _block_size(block);
+        tlsf->merges++;
+        block = prev;
+        _block_next(block)->prev_phys = block;
+    }
+
+    // ...and the block after us
+    tlsf_block_t* next = _block_next(block);
+    if(_block_is_free(next))
+    {
+        _remove_free_block(tlsf, next);
+        block->size += TLSF_HEADER_SIZE + _block_size(next);
+        tlsf->merges++;
+        _block_next(block)->prev_phys = block;
+    }
+
+    _insert_free_block(tlsf, block);
+}
+
+size_t tlsf_block_size(const void* ptr)
+{
+    return _block_size(_ptr_to_block(ptr));
+}
+
+void* tlsf_walk_pool(tlsf_t* tlsf, size_t pool, void* start, const void* skip_below,
+                     size_t max, tlsf_walker walker, void* ctx)
+{
+    if(pool >= tlsf->num_pools)
+        return NULL;
+
+    tlsf_block_t* block = (start == NULL) ? (tlsf_block_t*)tlsf->pools[pool].start : _ptr_to_block(start);
+    size_t        count = 0;
+
+    // The sentinel at the end of the pool is the only block with a size of 0
+    while(_block_size(block) != 0)
+    {
+        if((uintptr_t)_block_to_ptr(block) >= (uintptr_t)skip_below)
+        {
+            if(count++ == max)
+                return _block_to_ptr(block);
+
+            if(!walker(_block_to_ptr(block), _block_size(block), !_block_is_free(block), ctx))
+                return NULL;
+        }
+
+        block = _block_next(block);
+    }
+
+    return NULL;
+}
+
+bool tlsf_owns(const tlsf_t* tlsf, const void* ptr)
+{
+    size_t num_pools = __atomic_load_n(&tlsf->num_pools, __ATOMIC_ACQUIRE);
+
+    for(size_t i = 0; i < num_pools; i++)
+    {
+        if((uintptr_t)ptr >= tlsf->pools[i].start && (uintptr_t)ptr < tlsf->pools[i].end)
+            return true;
+    }
+
+    return false;
+}
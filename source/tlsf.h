@@ -0,0 +1,174 @@
+/**
+ * Two-Level Segregated Fit (TLSF) allocator.
+ *
+ * TLSF keeps free blocks in a two dimensional array of free lists. The first level
+ * splits sizes into power of two classes, and the second level splits each of those
+ * linearly into TLSF_SL_COUNT sub-ranges. A pair of bitmaps records which lists are
+ * non-empty, so finding a suitable block is a couple of find-first-set instructions
+ * rather than a walk over the free list. Allocation and deallocation are both O(1).
+ *
+ * Unlike the list allocator, blocks carry their header in-band (directly before the
+ * data), which lets a freed block be merged with its physical neighbours straight away.
+ *
+ * This module does no locking and never grows on its own; the caller owns both.
+ */
+#ifndef _TLSF_H_
+#define _TLSF_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TLSF_ALIGN_LOG2     4                                   /** Blocks are 16 byte aligned */
+#define TLSF_ALIGN          (1 << TLSF_ALIGN_LOG2)
+#define TLSF_SL_LOG2        5                                   /** log2 of the number of second level lists */
+#define TLSF_SL_COUNT       (1 << TLSF_SL_LOG2)
+#define TLSF_FL_SHIFT       (TLSF_SL_LOG2 + TLSF_ALIGN_LOG2)    /** Blocks below (1 << TLSF_FL_SHIFT) all share first level 0 */
+#define TLSF_FL_MAX         32                                  /** Largest block is (1 << TLSF_FL_MAX) bytes */
+#define TLSF_FL_COUNT       (TLSF_FL_MAX - TLSF_FL_SHIFT + 1)
+#define TLSF_MAX_POOLS      256
+
+/**
+ * TLSF block header
+ *
+ * 'next_free' and 'prev_free' are only valid while the block is free, and overlap
+ * the start of the data otherwise.
+ */
+struct tlsf_block
+{
+    struct tlsf_block*  prev_phys;  // The physically previous block (NULL for the first block in a pool)
+    size_t              size;       // Size of the data area in bytes. The low bits hold the block flags
+    struct tlsf_block*  next_free;  // Next block in this block's free list
+    struct tlsf_block*  prev_free;  // Previous block in this block's free list
+};
+
+typedef struct tlsf_block tlsf_block_t;
+
+struct tlsf_pool
+{
+    uintptr_t   start;  /** First byte of the pool */
+    uintptr_t   end;    /** One past the last byte of the pool */
+};
+
+/**
+ * TLSF control structure
+ */
+struct tlsf
+{
+    uint32_t        fl_bitmap;                              /** Bit n is set if any list in first level n is non-empty */
+    uint32_t        sl_bitmap[TLSF_FL_COUNT];               /** Bit m of entry n is set if blocks[n][m] is non-empty */
+    tlsf_block_t*   blocks[TLSF_FL_COUNT][TLSF_SL_COUNT];   /** Free list heads */
+    struct tlsf_pool pools[TLSF_MAX_POOLS];                 /** Memory regions handed to this allocator */
+    size_t          num_pools;
+    size_t          num_used;                               /** Number of blocks in use */
+    size_t          num_free;                               /** Number of free blocks */
+    size_t          used_bytes;                             /** Bytes of data in blocks in use */
+    size_t          free_bytes;                             /** Bytes of data in free blocks */
+    uint64_t        merges;                                 /** Number of times a block header has been merged away */
+};
+
+typedef struct tlsf tlsf_t;
+
+/**
+ * Index of the most significant set bit
+ */
+static inline int tlsf_fls(size_t x)
+{
+    return (int)(sizeof(unsigned long long) * 8) - 1 - __builtin_clzll((unsigned long long)x);
+}
+
+/**
+ * Work out which list a block of 'size' bytes belongs in.
+ */
+static inline void tlsf_mapping_insert(size_t size, int* fl, int* sl)
+{
+    if(size < ((size_t)1 << TLSF_FL_SHIFT))
+    {
+        // Small blocks are spread linearly across the lists of the first level
+        *fl = 0;
+        *sl = (int)(size >> TLSF_ALIGN_LOG2);
+    }
+    else
+    {
+        int bit = tlsf_fls(size);
+        *sl = (int)((size >> (bit - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT);
+        *fl = bit - TLSF_FL_SHIFT + 1;
+    }
+}
+
+/**
+ * Work out the first list in which every block is large enough for 'size'.
+ *
+ * The size is rounded up to the next list boundary, so whatever we pull off
+ * the head of that list is guaranteed to fit (this is the "good fit" part of
+ * TLSF, and what keeps the search free of any list walking).
+ */
+static inline void tlsf_mapping_search(size_t size, int* fl, int* sl)
+{
+    if(size >= ((size_t)1 << TLSF_FL_SHIFT))
+        size += ((size_t)1 << (tlsf_fls(size) - TLSF_SL_LOG2)) - 1;
+
+    tlsf_mapping_insert(size, fl, sl);
+}
+
+/**
+ * Initialise an (empty) TLSF control structure
+ */
+void tlsf_init(tlsf_t*);
+
+/**
+ * Hand a region of memory to the allocator.
+ *
+ * Returns false if the region is too small, or the pool table is full.
+ */
+bool tlsf_add_pool(tlsf_t*, void* mem, size_t bytes);
+
+/**
+ * Allocate 'size' bytes. Returns NULL if no free block is large enough.
+ */
+void* tlsf_malloc(tlsf_t*, size_t size);
+
+/**
+ * Free a pointer returned by tlsf_malloc(), merging it with any free neighbours
+ */
+void tlsf_free(tlsf_t*, void* ptr);
+
+/**
+ * Get the usable size of an allocated pointer
+ */
+size_t tlsf_block_size(const void* ptr);
+
+/**
+ * Returns true if 'ptr' lies inside one of this allocator's pools
+ */
+bool tlsf_owns(const tlsf_t*, const void* ptr);
+
+/**
+ * Heap walk callback. Return false to stop the walk.
+ */
+typedef bool (*tlsf_walker)(void* ptr, size_t size, bool used, void* ctx);
+
+/**
+ * Walk at most 'max' physical blocks of pool number 'pool', starting with the block whose
+ * data is at 'start' (or the first block in the pool if 'start' is NULL). Blocks whose data
+ * lies below 'skip_below' are passed over without being counted or reported.
+ *
+ * Returns the data pointer of the block to resume from, or NULL once the end of the pool
+ * (or a walker returning false) has been reached. The resume point is only valid for as
+ * long as 'merges' doesn't change.
+ */
+void* tlsf_walk_pool(tlsf_t*, size_t pool, void* start, const void* skip_below,
+                     size_t max, tlsf_walker walker, void* ctx);
+
+/**
+ * Number of bytes of bookkeeping a pool needs on top of the data it holds
+ */
+size_t tlsf_pool_overhead();
+
+/**
+ * Smallest pool that tlsf_malloc() is sure to find room for 'size' bytes in (0 if the
+ * request is too big for any pool)
+ */
+size_t tlsf_pool_size_for(size_t size);
+
+#endif
@@ -0,0 +1,230 @@
+/**
+ * Size class table generator
+ *
+ * Reads an allocation size histogram (or a raw trace of sizes) and picks the 'k' size
+ * classes that waste the fewest bytes to internal fragmentation, then writes them out as
+ * a header the allocator compiles in (see source/size_classes.h).
+ *
+ * Input is one allocation per line, either "<size>" or "<size> <count>"; blank lines and
+ * anything after a '#' are ignored. Class sizes are multiples of the granule (16 bytes, the
+ * heap alignment), and the largest class is the largest size seen.
+ *
+ * The search is a dynamic program over the distinct (granule rounded) sizes: best[c][j] is
+ * the least waste covering the j smallest sizes with c classes, the largest of which is
+ * size j. That's O(k * n^2) for n distinct sizes, which is instant for any real histogram.
+ *
+ * usage: sizeclass_gen [-k classes] [-g granule] [histogram]  > size_classes.h
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_CLASSES     32
+#define DEFAULT_GRANULE     16
+#define MAX_CLASSES         255     // Classes have to fit in the uint8_t lookup table
+#define MAX_SIZE            (1 << 20)
+
+struct size_count
+{
+    size_t      size;       // Size, rounded up to the granule
+    uint64_t    count;      // Allocations of this (rounded) size
+    uint64_t    bytes;      // Bytes actually requested by those allocations
+};
+
+static int _compare_sizes(const void* a, const void* b)
+{
+    const struct size_count* x = a;
+    const struct size_count* y = b;
+
+    return (x->size > y->size) - (x->size < y->size);
+}
+
+int main(int argc, char** argv)
+{
+    unsigned    classes = DEFAULT_CLASSES;
+    size_t      granule = DEFAULT_GRANULE;
+    const char* path = NULL;
+    FILE*       in = stdin;
+
+    for(int i = 1; i < argc; i++)
+    {
+        if(!strcmp(argv[i], "-k") && i + 1 < argc)
+            classes = (unsigned)strtoul(argv[++i], NULL, 10);
+        else if(!strcmp(argv[i], "-g") && i + 1 < argc)
+            granule = strtoul(argv[++i], NULL, 10);
+        else if(argv[i][0] != '-' && path == NULL)
+            path = argv[i];
+        else
+        {
+            fprintf(stderr, "usage: %s [-k classes] [-g granule] [histogram]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if(classes == 0 || classes > MAX_CLASSES || granule == 0 || (granule & (granule - 1)))
+    {
+        fprintf(stderr, "%s: need 1 to %d classes, and a power of two granule\n", argv[0], MAX_CLASSES);
+        return 1;
+    }
+
+    if(path != NULL && (in = fopen(path, "r")) == NULL)
+    {
+        fprintf(stderr, "%s: unable to open %s: %s\n", argv[0], path, strerror(errno));
+        return 1;
+    }
+
+    // Bucket the input by rounded size
+    size_t              num_buckets = MAX_SIZE / granule + 1;
+    struct size_count*  buckets = calloc(num_buckets, sizeof(struct size_count));
+    char                line[256];
+    uint64_t            total_count = 0, total_bytes = 0;
+
+    while(fgets(line, sizeof(line), in) != NULL)
+    {
+        char*               hash = strchr(line, '#');
+        unsigned long long  size, count = 1;
+
+        if(hash != NULL)
+            *hash = '\0';
+
+        int fields = sscanf(line, "%llu %llu", &size, &count);
+        if(fields < 1)
+            continue;
+
+        if(size > MAX_SIZE)
+        {
+            fprintf(stderr, "%s: ignoring size %llu (larger than %d)\n", argv[0], size, MAX_SIZE);
+            continue;
+        }
+
+        size_t rounded = (size + granule - 1) & ~(granule - 1);
+        if(rounded == 0)
+            rounded = granule;
+
+        buckets[rounded / granule].size     = rounded;
+        buckets[rounded / granule].count    += count;
+        buckets[rounded / granule].bytes    += size * count;
+        total_count += count;
+        total_bytes += size * count;
+    }
+
+    if(in != stdin)
+        fclose(in);
+
+    // Squash down to the sizes we actually saw
+    size_t n = 0;
+    for(size_t i = 0; i < num_buckets; i++)
+    {
+        if(buckets[i].count != 0)
+            buckets[n++] = buckets[i];
+    }
+    qsort(buckets, n, sizeof(struct size_count), _compare_sizes);
+
+    if(n == 0)
+    {
+        fprintf(stderr, "%s: no sizes in the input\n", argv[0]);
+        return 1;
+    }
+
+    if(classes > n)
+        classes = n;
+
+    // Prefix sums, so the waste of putting sizes (i, j] in a class of size j is O(1):
+    //      sum(count) * size[j] - sum(bytes)
+    uint64_t* count_sum = calloc(n + 1, sizeof(uint64_t));
+    uint64_t* bytes_sum = calloc(n + 1, sizeof(uint64_t));
+    for(size_t i = 0; i < n; i++)
+    {
+        count_sum[i + 1] = count_sum[i] + buckets[i].count;
+        bytes_sum[i + 1] = bytes_sum[i] + buckets[i].bytes;
+    }
+
+    // best[c * (n + 1) + j]: least waste covering the first j sizes with c classes.
+    // from[...]: where the last of those classes starts.
+    uint64_t*   best = malloc((classes + 1) * (n + 1) * sizeof(uint64_t));
+    size_t*     from = malloc((classes + 1) * (n + 1) * sizeof(size_t));
+    for(size_t i = 0; i < (classes + 1) * (n + 1); i++)
+        best[i] = UINT64_MAX;
+    best[0] = 0;
+
+    for(size_t c = 1; c <= classes; c++)
+    {
+        for(size_t j = c; j <= n; j++)
+        {
+            for(size_t i = c - 1; i < j; i++)
+            {
+                uint64_t prev = best[(c - 1) * (n + 1) + i];
+                if(prev == UINT64_MAX)
+                    continue;
+
+                uint64_t waste = prev + (count_sum[j] - count_sum[i]) * buckets[j - 1].size - (bytes_sum[j] - bytes_sum[i]);
+                if(waste < best[c * (n + 1) + j])
+                {
+                    best[c * (n + 1) + j] = waste;
+                    from[c * (n + 1) + j] = i;
+                }
+            }
+        }
+    }
+
+    // Walk back through the choices to get the class sizes
+    size_t* class_size = calloc(classes, sizeof(size_t));
+    size_t  j = n;
+    for(size_t c = classes; c > 0; c--)
+    {
+        class_size[c - 1] = buckets[j - 1].size;
+        j = from[c * (n + 1) + j];
+    }
+
+    uint64_t    waste = best[classes * (n + 1) + n];
+    double      waste_pct = total_bytes ? 100.0 * waste / total_bytes : 0.0;
+    size_t      max_size = class_size[classes - 1];
+
+    fprintf(stderr, "%u classes over %zu distinct sizes, %llu allocations of %llu bytes: "
+            "%llu bytes wasted (%.2f%%)\n", classes, n, (unsigned long long)total_count,
+            (unsigned long long)total_bytes, (unsigned long long)waste, waste_pct);
+
+    printf("/**\n");
+    printf(" * Size classes (generated by tools/sizeclass_gen%s%s, do not edit)\n", path ? " from " : "", path ? path : "");
+    printf(" *\n");
+    printf(" * %u classes over %zu distinct sizes. For the input histogram (%llu allocations of %llu\n",
+           classes, n, (unsigned long long)total_count, (unsigned long long)total_bytes);
+    printf(" * bytes), rounding up to these classes wastes %llu bytes (%.2f%%).\n",
+           (unsigned long long)waste, waste_pct);
+    printf(" */\n");
+    printf("#ifndef _SIZE_CLASSES_H_\n#define _SIZE_CLASSES_H_\n\n");
+    printf("#include <stddef.h>\n#include <stdint.h>\n\n");
+    printf("#define SIZE_CLASS_COUNT    %u\n", classes);
+    printf("#define SIZE_CLASS_GRANULE  %zu\n", granule);
+    printf("#define SIZE_CLASS_MAX      %zu\n\n", max_size);
+
+    printf("static const uint32_t size_class_sizes[SIZE_CLASS_COUNT] =\n{");
+    for(size_t c = 0; c < classes; c++)
+        printf("%s%zu", (c % 12) ? ", " : (c ? ",\n    " : "\n    "), class_size[c]);
+    printf("\n};\n\n");
+
+    // lookup[(size + granule - 1) / granule] is the class of 'size'
+    printf("static const uint8_t size_class_lookup[SIZE_CLASS_MAX / SIZE_CLASS_GRANULE + 1] =\n{");
+    size_t c = 0;
+    for(size_t i = 0; i <= max_size / granule; i++)
+    {
+        while(class_size[c] < i * granule)
+            c++;
+        printf("%s%zu", (i % 24) ? ", " : (i ? ",\n    " : "\n    "), c);
+    }
+    printf("\n};\n\n");
+
+    printf("/**\n * Get the class of an allocation of 'size' bytes (no more than SIZE_CLASS_MAX)\n */\n");
+    printf("static inline unsigned size_class_of(size_t size)\n{\n");
+    printf("    return size_class_lookup[(size + SIZE_CLASS_GRANULE - 1) / SIZE_CLASS_GRANULE];\n}\n\n");
+    printf("/**\n * Round 'size' up to its class, or to the granule past the largest class\n */\n");
+    printf("static inline size_t size_class_round(size_t size)\n{\n");
+    printf("    if(size > SIZE_CLASS_MAX)\n");
+    printf("        return (size + SIZE_CLASS_GRANULE - 1) & ~(size_t)(SIZE_CLASS_GRANULE - 1);\n\n");
+    printf("    return size_class_sizes[size_class_of(size)];\n}\n\n");
+    printf("#endif\n");
+
+    return 0;
+}